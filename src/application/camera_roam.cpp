@@ -21,6 +21,7 @@ CameraRoamControl::CameraRoamControl()
     direction[1] = DZERO;
     direction[2] = DZERO;
     rotation = RNONE;
+    moved = false;
 }
 
 CameraRoamControl::~CameraRoamControl()
@@ -104,8 +105,10 @@ void CameraRoamControl::handle_event( const Application* app, const SDL_Event& e
         if ( rotation == RPITCHYAW ) {
             camera.yaw( -RotationSpeed * event.motion.xrel );
             camera.pitch( -RotationSpeed * event.motion.yrel );
+            moved = true;
         } else if ( rotation == RROLL ) {
             camera.roll( RotationSpeed * event.motion.yrel );
+            moved = true;
         }
         break;
 
@@ -124,7 +127,10 @@ void CameraRoamControl::update( real_t dt )
         DirectionTable[direction[1]],
         DirectionTable[direction[2]]
     );
-    camera.translate( displacement * dist );
+    if ( displacement != Vector3::Zero() ) {
+        camera.translate( displacement * dist );
+        moved = true;
+    }
 }
 
 }
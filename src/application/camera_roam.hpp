@@ -26,6 +26,9 @@ public:
     // the camera of this control
     Camera camera;
 
+    // set whenever the camera is translated or rotated, cleared by the owner
+    bool moved;
+
 private:
 
     enum Direction { DZERO=0, DPOS=1, DNEG=2 };
@@ -26,11 +26,14 @@
 
 #include "application/imageio.hpp"
 
+#ifndef AZ_HEADLESS
 #include "application/opengl.hpp"
 #include "application/application.hpp"
+#endif
 #include <iostream>
 #include <png.h>
 #include <cassert>
+#include <cstring>
 
 namespace _462 {
 
@@ -228,6 +231,7 @@ bool imageio_save_image( const char *fileName, unsigned char *buffer,
 // Wraps the general functionality of saving an image and writes the current
 // frame buffer to a specified file name.  Also returns true on succces,
 // false otherwise.
+#ifndef AZ_HEADLESS
 bool imageio_save_screenshot( const char *fileName, int width, int height )
 {
 
@@ -239,6 +243,7 @@ bool imageio_save_screenshot( const char *fileName, int width, int height )
     delete [] buffer;
     return result;
 }
+#endif
 
 void imageio_gen_name( char* filename, size_t len )
 {
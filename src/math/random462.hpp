@@ -1,29 +1,59 @@
 #include "math/math.hpp"
 #include <random>
+#include <atomic>
 
 namespace _462{
 
+    /**
+     * Seed for the engine of a new thread. Threads get distinct streams, so
+     * workers started together do not draw the same samples.
+     */
+    inline unsigned int random_thread_seed()
+    {
+        static std::atomic<unsigned int> threads(0);
+        return 0x9E3779B9u * (threads.fetch_add(1) + 1);
+    }
+
+    /**
+     * Engine of the calling thread, shared by the samplers below.
+     */
+    inline std::minstd_rand &random_engine()
+    {
+        static thread_local std::minstd_rand engine(random_thread_seed());
+        return engine;
+    }
+
+    inline std::normal_distribution<real_t> &random_normal_distribution()
+    {
+        static thread_local std::normal_distribution<real_t> dist;
+        return dist;
+    }
+
+    /**
+     * Restart the sequence of the calling thread, e.g. per photon batch so a
+     * photon map does not depend on which worker traced which batch.
+     */
+    inline void random_seed(unsigned int seed)
+    {
+        random_engine().seed(seed);
+        random_normal_distribution().reset();
+    }
+
     /**
      * Generate a uniform random real_t on the interval [0, 1)
      */
     inline real_t random_uniform()
     {
-//        unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-//        std::mt19937 generator (seed);
-//        return real_t(generator())/std::mt19937::max();
-        
-      return real_t(rand())/RAND_MAX;
+        return std::uniform_real_distribution<real_t>(0, 1)(random_engine());
     }
 
     /**
-     * Generate a uniform random real_t from N(0, 1)
+     * Generate a uniform random real_t from N(0, 1). Every thread draws from
+     * its own engine, so trace and scatter workers may call it concurrently.
      */
     inline real_t random_gaussian()
     {
-        static std::default_random_engine generator;
-        static std::normal_distribution<real_t> dist =
-            std::normal_distribution<real_t>();
-        return dist(generator);
+        return random_normal_distribution()(random_engine());
     }
 
 
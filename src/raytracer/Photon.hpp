@@ -10,104 +10,125 @@
 #define __P3__Photon__
 
 #include <iostream>
+#include <cmath>
+#include <algorithm>
 #include "math/color.hpp"
 #include "math/vector.hpp"
 
-#define COLOR_COEEF (0.004)
-
 using namespace _462;
 
+/*!
+ @brief a stored photon in 20 bytes, the same record is scattered, balanced into
+        the kd-trees and gathered. Flux is packed as RGB9E5, three 9 bit
+        mantissas with a shared 5 bit exponent, so it is not clamped to [0, 1];
+        the incident direction is an octahedral map with 8 bits per coordinate.
+ */
 class Photon {
-    
+
 public:
-    
-    // Naive implementation
-    // Will be optimized later
-    Vector3 position;       // Hit position
-//    Vector3 direction;      // Incoming direction
-//    Vector3 normal;         // Normal of the intersection point, for not sampling a sphere but a disk
-    
-//    Color3 color;           // Photon color, also flux
-    
-//    real_t squaredDistance;
-    
-    // compressed color
-    unsigned char ccolor[4];
-    
-    unsigned char phi, theta; // compressed incident direction
+
+    float position[3];      // Hit position
+
+    unsigned int flux;      // RGB9E5 color, also flux
+
+    unsigned char direction[2]; // octahedral incident direction
 
     char mask;              // Mask to indicate where the photon belongs to
     // 0x1 : Hit on diffusive surface, 0x1 : Hit before, 0x0 : Not hit before
     // 0x2 : Hit on specular surface, 0x2 : Hit before, 0x0 : Not hit before
     char splitAxis;
-    
+
     Photon(){}
-    
+
     Photon(Color3 lcolor) {
-        position = Vector3::Zero();
-//        direction = Vector3::Zero();
-//        normal = Vector3::Zero();
-        
+        setPosition(Vector3::Zero());
         setColor(lcolor);
-//        color = lcolor;
-        
+        direction[0] = direction[1] = 0;
         mask = 0x0;
-//        squaredDistance = 0;
         splitAxis = -1;
     }
-    
-    void setColor(Color3 color)
+
+    Vector3 getPosition() const
     {
-        color.to_array(ccolor);
+        return Vector3(position[0], position[1], position[2]);
     }
-    
-    Color3 getColor()
+
+    void setPosition(const Vector3 &p)
     {
-        Color3 color = Color3::Black();
-        color.r = (ccolor[0]) * COLOR_COEEF;
-        color.g = (ccolor[1]) * COLOR_COEEF;
-        color.b = (ccolor[2]) * COLOR_COEEF;
-        return color;
+        position[0] = float(p.x);
+        position[1] = float(p.y);
+        position[2] = float(p.z);
+    }
+
+    void setColor(Color3 color)
+    {
+        // 9 bit mantissas, exponent bias 15, as in EXT_texture_shared_exponent
+        const float maxValue = 65408.0f;
+        float c[3] = { float(color.r), float(color.g), float(color.b) };
+        for (int i = 0; i < 3; i++) {
+            c[i] = (c[i] > 0) ? std::min(c[i], maxValue) : 0.0f;    // also drops NaN
+        }
+
+        float maxc = std::max(c[0], std::max(c[1], c[2]));
+        if (maxc < 1e-10f) {
+            flux = 0;
+            return;
+        }
+
+        int exp;
+        frexpf(maxc, &exp);                     // maxc = m * 2^exp, 0.5 <= m < 1
+        int shared = std::max(exp, -15) + 15;
+        if (int(floorf(maxc / ldexpf(1.0f, shared - 24) + 0.5f)) == 512) {
+            shared++;
+        }
+
+        float scale = ldexpf(1.0f, shared - 24);
+        unsigned int m[3];
+        for (int i = 0; i < 3; i++) {
+            m[i] = std::min(511u, (unsigned int)floorf(c[i] / scale + 0.5f));
+        }
+        flux = m[0] | (m[1] << 9) | (m[2] << 18) | ((unsigned int)shared << 27);
     }
-    
-    // Photon squared distance greater
-//    bool operator()(const Photon& a,const Photon& b) const{
-//        return (a.squaredDistance < b.squaredDistance);
-//    }
-    
-//    bool operator<(const Photon &p2) const {
-//        return squaredDistance < p2.squaredDistance;
-//    }
-};
 
-struct ClosePhoton
-{
-    size_t kdtreeIndex;
-    real_t x, y, z;
-    real_t squaredDistance;
-    short splitAxis;
-    
-    ClosePhoton()
+    Color3 getColor() const
     {
-        kdtreeIndex = -1;
-        x = y = z =0;
-        splitAxis = -1;
+        float scale = ldexpf(1.0f, int(flux >> 27) - 24);
+        return Color3((flux & 0x1ff) * scale,
+                      ((flux >> 9) & 0x1ff) * scale,
+                      ((flux >> 18) & 0x1ff) * scale);
     }
-    
-    ClosePhoton(Photon photon, size_t idx)
+
+    // dir must be normalized
+    void setDirection(const Vector3 &dir)
     {
-        kdtreeIndex = idx;
-        x = photon.position.x;
-        y = photon.position.y;
-        z = photon.position.z;
-        squaredDistance = -1;
-        splitAxis = photon.splitAxis;
+        float l1 = float(fabs(dir.x) + fabs(dir.y) + fabs(dir.z));
+        float u = float(dir.x) / l1;
+        float v = float(dir.y) / l1;
+        if (dir.z < 0) {
+            // fold the lower half over the diagonals
+            float fu = (1 - fabsf(v)) * (u >= 0 ? 1 : -1);
+            float fv = (1 - fabsf(u)) * (v >= 0 ? 1 : -1);
+            u = fu;
+            v = fv;
+        }
+        direction[0] = (unsigned char)floorf((u * 0.5f + 0.5f) * 255 + 0.5f);
+        direction[1] = (unsigned char)floorf((v * 0.5f + 0.5f) * 255 + 0.5f);
     }
-    
-    bool operator<(const ClosePhoton &p2) const {
-        return squaredDistance < p2.squaredDistance;
+
+    Vector3 getDirection() const
+    {
+        float u = direction[0] * (2.0f / 255) - 1;
+        float v = direction[1] * (2.0f / 255) - 1;
+        float z = 1 - fabsf(u) - fabsf(v);
+        if (z < 0) {
+            float fu = (1 - fabsf(v)) * (u >= 0 ? 1 : -1);
+            float fv = (1 - fabsf(u)) * (v >= 0 ? 1 : -1);
+            u = fu;
+            v = fv;
+        }
+        return normalize(Vector3(u, v, z));
     }
+
 };
 
 #endif /* defined(__P3__Photon__) */
-
@@ -88,25 +88,34 @@ namespace _462 {
     
     void RaytracerApplication::destroy()
     {
-        
+        raytracer.stopPreview();
     }
     
     void RaytracerApplication::update( real_t delta_time )
     {
         if ( raytracing ) {
-            // do part of the raytrace
-            if ( !raytrace_finished ) {
-                assert( buffer.cbuffer );
-                //                printf("delta time = %f\n",delta_time);
-                //                raytrace_finished = raytracer.raytrace( buffer, nullptr );
-                raytrace_finished = raytracer.raytrace( buffer.cbuffer, &delta_time );
-                //                raytrace_finished = raytracer.PacketizedRayTrace( buffer );
+            // tracing runs on the raytracer's workers, the camera stays live and
+            // any move restarts the preview for the new view
+            camera_control.update( delta_time );
+            if ( camera_control.moved ) {
+                camera_control.moved = false;
+                raytracer.restartPreview( camera_control.camera );
             }
             
+            // show the newest finished pass
+            assert( buffer.cbuffer );
+            raytracer.acquirePreview( buffer.cbuffer );
+            
         } else {
             // copy camera over from camera control (if not raytracing)
             camera_control.update( delta_time );
             scene.camera = camera_control.camera;
+
+            // cached primary hits are only valid for the camera they were traced with
+            if ( camera_control.moved ) {
+                raytracer.invalidateGBuffer();
+                camera_control.moved = false;
+            }
         }
     }
     
@@ -118,9 +127,11 @@ namespace _462 {
         get_dimension( &width, &height );
         glViewport( 0, 0, width, height );
         
-        // fix camera aspect
-        Camera& camera = scene.camera;
-        camera.aspect = real_t( width ) / real_t( height );
+        // fix camera aspect, while raytracing the scene camera belongs to the preview workers
+        if ( !raytracing ) {
+            Camera& camera = scene.camera;
+            camera.aspect = real_t( width ) / real_t( height );
+        }
         
         // clear buffer
         glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
@@ -152,9 +163,7 @@ namespace _462 {
     {
         int width, height;
         
-        if ( !raytracing ) {
-            camera_control.handle_event( this, event );
-        }
+        camera_control.handle_event( this, event );
         
         switch ( event.type )
         {
@@ -213,9 +222,16 @@ namespace _462 {
             
             // reset flag that says we are done
             raytrace_finished = false;
+            
+            raytracer.startPreview();
         }
         else
         {
+            raytracer.stopPreview();
+            
+            // the viewer continues from where the preview camera ended up
+            scene.camera = camera_control.camera;
+            
             // clean buffer
             buffer.cleanbuffer(width, height);
         }
@@ -381,7 +397,7 @@ namespace _462 {
     }
     
     
-    void render_scene( const Scene& scene , Raytracer raytracer)
+    void render_scene( const Scene& scene , Raytracer &raytracer)
     {
         // backup state so it doesn't mess up raytrace image rendering
         glPushAttrib( GL_ALL_ATTRIB_BITS );
@@ -7,6 +7,7 @@
 #include "scene/scene.hpp"
 #include "raytracer/raytracer.hpp"
 #include "raytracer/Utils.h"
+#include "raytracer/options.hpp"
 
 #ifdef __APPLE__
 #include <GLKit/GLKMath.h>
@@ -24,9 +25,6 @@
 
 namespace _462 {
 
-#define DEFAULT_WIDTH 800
-#define DEFAULT_HEIGHT 600
-
 #define KEY_RAYTRACE SDLK_r
 #define KEY_SCREENSHOT SDLK_f
 
@@ -40,24 +38,8 @@ namespace _462 {
     static const size_t NUM_GL_LIGHTS = 8;
 
     // renders a scene using opengl
-    void render_scene( const Scene& scene , Raytracer raytracer);
+    void render_scene( const Scene& scene , Raytracer &raytracer);
 
-    /**
-     * Struct of the program options.
-     */
-    struct Options
-    {
-        // whether to open a window or just render without one
-        bool open_window;
-        // not allocated, pointed it to something static
-        const char* input_filename;
-        // not allocated, pointed it to something static
-        const char* output_filename;
-        // window dimensions
-        int width, height;
-        int num_samples;
-    };
-    
     class RaytracerApplication : public Application
     {
     public:
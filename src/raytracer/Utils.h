@@ -11,26 +11,30 @@
 #ifndef AZ_UTILS_H
 #define AZ_UTILS_H
 
+#include <chrono>
+
 #define BUFFER_SIZE(w,h) ( (size_t) ( 4 * (w) * (h) ) )
 
-struct cPhoton
+/*!
+ * Milliseconds since the first call, steady clock. Stands in for SDL_GetTicks
+ * so the raytracer core builds without SDL.
+ */
+inline unsigned int azGetTicks()
 {
-	/* data */
-    float position[3];              // 12
-    unsigned int index;             // 4   // index in photon list
-    int splitAxis;                  // 4     // char and short cannot be compiled by ispc
-    int padding;
-};
+    static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    return (unsigned int)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - epoch).count();
+}
 
 struct metaCPhoton
 {
-    unsigned int cphotonIndex;      // index in cphoton list
+    unsigned int cphotonIndex;      // index in photon list
     unsigned int sortedIndex[3];    // index in sorted index lists
 };
 
 struct KDNode
 {
-    int cphotonIndex;
+    int cphotonIndex;   // splitting photon, index in the photon list
     int splitAxis;
     float splitValue;
     int head;           // including
@@ -0,0 +1,326 @@
+//
+//  azDenoiser.cpp
+//  Azurender
+//
+//  Edge-avoiding a-trous wavelet filter, Dammertz et al. 2010
+//
+
+#include "azDenoiser.hpp"
+#include "raytracer/raytracer.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// depth written for pixels whose primary ray missed, far enough that a miss
+// never blends with a hit
+#define DENOISE_MISS_DEPTH              (1e6f)
+
+namespace _462 {
+
+    // B3 spline kernel of the a-trous transform
+    static const float kernel[5] = { 1.f/16.f, 1.f/4.f, 3.f/8.f, 1.f/4.f, 1.f/16.f };
+
+    enum GuidePlane
+    {
+        Guide_NormalX = 0,
+        Guide_NormalY,
+        Guide_NormalZ,
+        Guide_Depth,
+        Guide_AlbedoR,
+        Guide_AlbedoG,
+        Guide_AlbedoB,
+    };
+
+#if defined(__SSE2__)
+    // exp(x) for x <= 0, polynomial 2^f with exponent bit shift, rel. error < 1e-5
+    static inline __m128 expNegative4(__m128 x)
+    {
+        x = _mm_max_ps(x, _mm_set1_ps(-87.f));
+        __m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+
+        // floor(t), t is never positive
+        __m128 tf = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+        tf = _mm_sub_ps(tf, _mm_and_ps(_mm_cmpgt_ps(tf, t), _mm_set1_ps(1.f)));
+        __m128 f = _mm_sub_ps(t, tf);
+
+        __m128 p = _mm_set1_ps(0.0013333558f);
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.0096181291f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.0555041087f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.2402264923f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.6931471806f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.f));
+
+        __m128i e = _mm_slli_epi32(_mm_add_epi32(_mm_cvtps_epi32(tf), _mm_set1_epi32(127)), 23);
+        return _mm_mul_ps(p, _mm_castsi128_ps(e));
+    }
+
+    static inline __m128 square4(__m128 x)
+    {
+        return _mm_mul_ps(x, x);
+    }
+#endif
+
+    azDenoiser::azDenoiser()
+    : iterations(5), sigmaColor(0.6f), sigmaNormal(0.3f), sigmaDepth(0.05f), sigmaAlbedo(0.1f),
+      width(0), height(0) { }
+
+    void azDenoiser::resize(int width, int height)
+    {
+        assert(width > 0 && height > 0);
+        this->width = width;
+        this->height = height;
+
+        size_t screensize = width * height;
+        guide.resize(DENOISE_GUIDE_PLANES * screensize);
+        color.resize(3 * screensize);
+        result.resize(3 * screensize);
+
+        clearGuide();
+    }
+
+    void azDenoiser::clearGuide()
+    {
+        size_t screensize = width * height;
+        std::fill(guide.begin(), guide.end(), 0.f);
+        std::fill_n(guide.begin() + Guide_Depth * screensize, screensize, DENOISE_MISS_DEPTH);
+    }
+
+    void azDenoiser::setGuide(int x, int y, const HitRecord &record)
+    {
+        assert(x >= 0 && x < width && y >= 0 && y < height);
+        size_t screensize = width * height;
+        size_t index = y * width + x;
+
+        if (!record.isHit || record.t >= guide[Guide_Depth * screensize + index]) {
+            return;
+        }
+
+        Color3 albedo = record.diffuse * record.texture;
+        guide[Guide_NormalX * screensize + index] = record.normal.x;
+        guide[Guide_NormalY * screensize + index] = record.normal.y;
+        guide[Guide_NormalZ * screensize + index] = record.normal.z;
+        guide[Guide_Depth   * screensize + index] = record.t;
+        guide[Guide_AlbedoR * screensize + index] = albedo.r;
+        guide[Guide_AlbedoG * screensize + index] = albedo.g;
+        guide[Guide_AlbedoB * screensize + index] = albedo.b;
+    }
+
+    void azDenoiser::mergeGuide(const float *otherGuide)
+    {
+        size_t screensize = width * height;
+        for (size_t i = 0; i < screensize; i++)
+        {
+            if (otherGuide[Guide_Depth * screensize + i] < guide[Guide_Depth * screensize + i])
+            {
+                for (int plane = 0; plane < DENOISE_GUIDE_PLANES; plane++) {
+                    guide[plane * screensize + i] = otherGuide[plane * screensize + i];
+                }
+            }
+        }
+    }
+
+    void azDenoiser::denoise(const Color3 *input, Color3 *output)
+    {
+        assert(input != output);
+        size_t screensize = width * height;
+        for (size_t i = 0; i < screensize; i++)
+        {
+            color[i] = input[i].r;
+            color[screensize + i] = input[i].g;
+            color[2 * screensize + i] = input[i].b;
+        }
+
+        filter();
+
+        for (size_t i = 0; i < screensize; i++)
+        {
+            output[i] = Color3(color[i], color[screensize + i], color[2 * screensize + i]);
+        }
+    }
+
+    void azDenoiser::denoise(unsigned char *rgba)
+    {
+        size_t screensize = width * height;
+        for (size_t i = 0; i < screensize; i++)
+        {
+            Color3 c(&rgba[4 * i]);
+            color[i] = c.r;
+            color[screensize + i] = c.g;
+            color[2 * screensize + i] = c.b;
+        }
+
+        filter();
+
+        for (size_t i = 0; i < screensize; i++)
+        {
+            Color3 c(color[i], color[screensize + i], color[2 * screensize + i]);
+            c = clamp(c, 0.0, 1.0);
+            c.to_array(&rgba[4 * i]);
+        }
+    }
+
+    void azDenoiser::filter()
+    {
+        float sigmaC = sigmaColor;
+        for (int i = 0; i < iterations; i++)
+        {
+            atrousPass(1 << i, sigmaC);
+            sigmaC *= 0.5f;
+        }
+    }
+
+    void azDenoiser::atrousPass(int step, float sigmaC)
+    {
+        int numThreads = std::min(MAX_THREADS_TRACE, height);
+        int rowsPerThread = (height + numThreads - 1) / numThreads;
+
+        std::vector<std::thread> workers;
+        for (int t = 0; t < numThreads; t++)
+        {
+            int rowBegin = t * rowsPerThread;
+            int rowEnd = std::min(height, rowBegin + rowsPerThread);
+            workers.push_back(std::thread(&azDenoiser::atrousRows, this, step, sigmaC, rowBegin, rowEnd));
+        }
+        for (size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+
+        color.swap(result);
+    }
+
+    void azDenoiser::atrousRows(int step, float sigmaC, int rowBegin, int rowEnd)
+    {
+        size_t screensize = width * height;
+
+        const float *cr = &color[0];
+        const float *cg = &color[screensize];
+        const float *cb = &color[2 * screensize];
+        const float *nx = &guide[Guide_NormalX * screensize];
+        const float *ny = &guide[Guide_NormalY * screensize];
+        const float *nz = &guide[Guide_NormalZ * screensize];
+        const float *dz = &guide[Guide_Depth * screensize];
+        const float *ar = &guide[Guide_AlbedoR * screensize];
+        const float *ag = &guide[Guide_AlbedoG * screensize];
+        const float *ab = &guide[Guide_AlbedoB * screensize];
+        float *outr = &result[0];
+        float *outg = &result[screensize];
+        float *outb = &result[2 * screensize];
+
+        // inverse squared sigmas, normals are allowed to drift further apart with the step
+        float invC = 1.f / (sigmaC * sigmaC);
+        float invN = 1.f / (sigmaNormal * sigmaNormal * step * step);
+        float invD = 1.f / (sigmaDepth * sigmaDepth);
+        float invA = 1.f / (sigmaAlbedo * sigmaAlbedo);
+
+        // pixels whose whole footprint lies inside the row can be filtered 4 wide
+        int simdBegin = 2 * step;
+        int simdEnd = width - 2 * step;
+
+        for (int y = rowBegin; y < rowEnd; y++)
+        {
+            int x = 0;
+            while (x < width)
+            {
+#if defined(__SSE2__)
+                if (x >= simdBegin && x + 4 <= simdEnd)
+                {
+                    int p = y * width + x;
+                    __m128 pr = _mm_loadu_ps(cr + p), pg = _mm_loadu_ps(cg + p), pb = _mm_loadu_ps(cb + p);
+                    __m128 pnx = _mm_loadu_ps(nx + p), pny = _mm_loadu_ps(ny + p), pnz = _mm_loadu_ps(nz + p);
+                    __m128 pdz = _mm_loadu_ps(dz + p);
+                    __m128 par = _mm_loadu_ps(ar + p), pag = _mm_loadu_ps(ag + p), pab = _mm_loadu_ps(ab + p);
+                    __m128 pinvDepth = _mm_div_ps(_mm_set1_ps(invD), square4(_mm_max_ps(pdz, _mm_set1_ps(1e-6f))));
+
+                    __m128 sumr = _mm_setzero_ps(), sumg = _mm_setzero_ps(), sumb = _mm_setzero_ps();
+                    __m128 sumw = _mm_setzero_ps();
+
+                    for (int ky = -2; ky <= 2; ky++)
+                    {
+                        int qy = clamp(y + ky * step, 0, height - 1);
+                        for (int kx = -2; kx <= 2; kx++)
+                        {
+                            int q = qy * width + x + kx * step;
+                            __m128 qr = _mm_loadu_ps(cr + q), qg = _mm_loadu_ps(cg + q), qb = _mm_loadu_ps(cb + q);
+
+                            __m128 distC = _mm_add_ps(_mm_add_ps(square4(_mm_sub_ps(pr, qr)),
+                                                                 square4(_mm_sub_ps(pg, qg))),
+                                                      square4(_mm_sub_ps(pb, qb)));
+                            __m128 distN = _mm_add_ps(_mm_add_ps(square4(_mm_sub_ps(pnx, _mm_loadu_ps(nx + q))),
+                                                                 square4(_mm_sub_ps(pny, _mm_loadu_ps(ny + q)))),
+                                                      square4(_mm_sub_ps(pnz, _mm_loadu_ps(nz + q))));
+                            __m128 distD = square4(_mm_sub_ps(pdz, _mm_loadu_ps(dz + q)));
+                            __m128 distA = _mm_add_ps(_mm_add_ps(square4(_mm_sub_ps(par, _mm_loadu_ps(ar + q))),
+                                                                 square4(_mm_sub_ps(pag, _mm_loadu_ps(ag + q)))),
+                                                      square4(_mm_sub_ps(pab, _mm_loadu_ps(ab + q))));
+
+                            __m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(distC, _mm_set1_ps(invC)),
+                                                             _mm_mul_ps(distN, _mm_set1_ps(invN))),
+                                                  _mm_add_ps(_mm_mul_ps(distD, pinvDepth),
+                                                             _mm_mul_ps(distA, _mm_set1_ps(invA))));
+                            __m128 w = _mm_mul_ps(_mm_set1_ps(kernel[ky + 2] * kernel[kx + 2]),
+                                                  expNegative4(_mm_sub_ps(_mm_setzero_ps(), e)));
+
+                            sumr = _mm_add_ps(sumr, _mm_mul_ps(w, qr));
+                            sumg = _mm_add_ps(sumg, _mm_mul_ps(w, qg));
+                            sumb = _mm_add_ps(sumb, _mm_mul_ps(w, qb));
+                            sumw = _mm_add_ps(sumw, w);
+                        }
+                    }
+
+                    // the center tap has weight 3/8 * 3/8, so sumw is never zero
+                    __m128 inv = _mm_div_ps(_mm_set1_ps(1.f), sumw);
+                    _mm_storeu_ps(outr + p, _mm_mul_ps(sumr, inv));
+                    _mm_storeu_ps(outg + p, _mm_mul_ps(sumg, inv));
+                    _mm_storeu_ps(outb + p, _mm_mul_ps(sumb, inv));
+                    x += 4;
+                    continue;
+                }
+#endif
+                // scalar path for borders and targets without SSE2
+                int p = y * width + x;
+                float pinvDepth = invD / std::max(dz[p] * dz[p], 1e-12f);
+                float sumr = 0.f, sumg = 0.f, sumb = 0.f, sumw = 0.f;
+
+                for (int ky = -2; ky <= 2; ky++)
+                {
+                    int qy = clamp(y + ky * step, 0, height - 1);
+                    for (int kx = -2; kx <= 2; kx++)
+                    {
+                        int qx = clamp(x + kx * step, 0, width - 1);
+                        int q = qy * width + qx;
+
+                        float distC = (cr[p] - cr[q]) * (cr[p] - cr[q]) +
+                                      (cg[p] - cg[q]) * (cg[p] - cg[q]) +
+                                      (cb[p] - cb[q]) * (cb[p] - cb[q]);
+                        float distN = (nx[p] - nx[q]) * (nx[p] - nx[q]) +
+                                      (ny[p] - ny[q]) * (ny[p] - ny[q]) +
+                                      (nz[p] - nz[q]) * (nz[p] - nz[q]);
+                        float distD = (dz[p] - dz[q]) * (dz[p] - dz[q]);
+                        float distA = (ar[p] - ar[q]) * (ar[p] - ar[q]) +
+                                      (ag[p] - ag[q]) * (ag[p] - ag[q]) +
+                                      (ab[p] - ab[q]) * (ab[p] - ab[q]);
+
+                        float e = distC * invC + distN * invN + distD * pinvDepth + distA * invA;
+                        float w = kernel[ky + 2] * kernel[kx + 2] * expf(-std::min(e, 87.f));
+
+                        sumr += w * cr[q];
+                        sumg += w * cg[q];
+                        sumb += w * cb[q];
+                        sumw += w;
+                    }
+                }
+
+                outr[p] = sumr / sumw;
+                outg[p] = sumg / sumw;
+                outb[p] = sumb / sumw;
+                x++;
+            }
+        }
+    }
+
+}
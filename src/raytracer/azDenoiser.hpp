@@ -0,0 +1,81 @@
+//
+//  azDenoiser.hpp
+//  Azurender
+//
+//  Edge-avoiding a-trous wavelet filter, Dammertz et al. 2010
+//
+
+#ifndef __Azurender__azDenoiser__
+#define __Azurender__azDenoiser__
+
+#include <vector>
+
+#include "math/color.hpp"
+#include "math/vector.hpp"
+#include "scene/ray.hpp"
+
+namespace _462 {
+
+    // number of float planes of the guide buffer: normal xyz, depth, albedo rgb
+#define DENOISE_GUIDE_PLANES            (7)
+
+    /*!
+     @brief Post-process denoiser guided by per pixel normal, depth and albedo of the
+            primary hit. All buffers are stored as planes of width * height floats
+            so that four neighbouring pixels are filtered per SSE instruction.
+     */
+    class azDenoiser
+    {
+    public:
+
+        azDenoiser();
+
+        // allocate buffers for a new image size and clear the guide
+        void resize(int width, int height);
+
+        // reset guide to "no hit" for every pixel
+        void clearGuide();
+
+        // record the primary hit of pixel (x, y), the nearest hit wins
+        void setGuide(int x, int y, const HitRecord &record);
+
+        // merge a guide gathered from another node, the nearest hit wins
+        void mergeGuide(const float *otherGuide);
+
+        // raw guide planes, DENOISE_GUIDE_PLANES * width * height floats
+        float *guideData() { return &guide[0]; }
+        size_t guideSize() const { return guide.size(); }
+
+        // filter an accumulation buffer, input and output may not alias
+        void denoise(const Color3 *input, Color3 *output);
+
+        // filter an rgba byte buffer in place
+        void denoise(unsigned char *rgba);
+
+        int iterations;         // number of a-trous passes, filter footprint is 2^(iterations+1) + 1
+        float sigmaColor;       // color edge stopping, halved every pass
+        float sigmaNormal;
+        float sigmaDepth;       // relative to the depth of the center pixel
+        float sigmaAlbedo;
+
+    private:
+
+        // filter rows [rowBegin, rowEnd) of the current source planes with given step
+        void atrousRows(int step, float sigmaC, int rowBegin, int rowEnd);
+
+        // filter all rows with MAX_THREADS_TRACE workers and swap source/target planes
+        void atrousPass(int step, float sigmaC);
+
+        // run all passes on the color planes
+        void filter();
+
+        int width, height;
+
+        std::vector<float> guide;
+        std::vector<float> color;   // 3 planes, source of the current pass
+        std::vector<float> result;  // 3 planes, target of the current pass
+    };
+
+}
+
+#endif /* defined(__Azurender__azDenoiser__) */
@@ -0,0 +1,69 @@
+//
+//  azDistribution.hpp
+//  Azurender
+//
+//  Piecewise constant 1D distribution, sampled through its CDF
+//
+
+#ifndef __Azurender__azDistribution__
+#define __Azurender__azDistribution__
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+#include "math/math.hpp"
+
+namespace _462 {
+
+    /*!
+     @brief picks index i with probability weight[i] / sum of the weights.
+            Zero weights are never picked; when all weights are zero the
+            distribution is empty.
+     */
+    class azDistribution1D
+    {
+    public:
+
+        azDistribution1D() : sum(0) { }
+
+        void build(const std::vector<real_t> &weights)
+        {
+            cdf.assign(weights.size() + 1, 0);
+            for (size_t i = 0; i < weights.size(); i++) {
+                cdf[i + 1] = cdf[i] + std::max(weights[i], real_t(0));
+            }
+            sum = cdf.back();
+        }
+
+        bool empty() const { return !(sum > 0); }
+
+        size_t size() const { return cdf.empty() ? 0 : cdf.size() - 1; }
+
+        // index for u in [0, 1), must not be called when empty
+        size_t sample(real_t u) const
+        {
+            // first entry whose cdf exceeds u * sum, skips zero weights
+            size_t i = std::upper_bound(cdf.begin() + 1, cdf.end(), u * sum) - cdf.begin() - 1;
+            i = std::min(i, size() - 1);
+            while (!(cdf[i + 1] > cdf[i])) {
+                i--;
+            }
+            return i;
+        }
+
+        // probability of picking index i
+        real_t pmf(size_t i) const
+        {
+            return sum > 0 ? (cdf[i + 1] - cdf[i]) / sum : 0;
+        }
+
+    private:
+
+        std::vector<real_t> cdf;
+        real_t sum;
+    };
+
+}
+
+#endif /* defined(__Azurender__azDistribution__) */
@@ -0,0 +1,180 @@
+//
+//  azIrradianceCache.cpp
+//  Azurender
+//
+//  Irradiance caching, Ward et al. 1988 with gradients of Ward & Heckbert 1992
+//
+
+#include "azIrradianceCache.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+namespace _462 {
+
+    // read or write lock of a pthread rwlock for the scope of the guard
+    class RWLockGuard
+    {
+    public:
+        RWLockGuard(pthread_rwlock_t *lock, bool write) : lock(lock)
+        {
+            if (write) {
+                pthread_rwlock_wrlock(lock);
+            } else {
+                pthread_rwlock_rdlock(lock);
+            }
+        }
+        ~RWLockGuard() { pthread_rwlock_unlock(lock); }
+
+    private:
+        RWLockGuard(const RWLockGuard &);
+        RWLockGuard &operator=(const RWLockGuard &);
+
+        pthread_rwlock_t *lock;
+    };
+
+    azIrradianceCache::azIrradianceCache()
+    : accuracy(0.2f), minRadius(0.01), maxRadius(1.0), root(NULL)
+    {
+        pthread_rwlock_init(&recordsLock, NULL);
+    }
+
+    azIrradianceCache::~azIrradianceCache()
+    {
+        deleteNode(root);
+        pthread_rwlock_destroy(&recordsLock);
+    }
+
+    void azIrradianceCache::reset(const BndBox &bounds)
+    {
+        RWLockGuard guard(&recordsLock, true);
+        deleteNode(root);
+        records.clear();
+
+        Vector3 extent = bounds.pMax - bounds.pMin;
+        real_t halfSize = std::max(extent.x, std::max(extent.y, extent.z)) * 0.5;
+        // pad a little so records right on the scene border stay inside
+        root = createNode((bounds.pMin + bounds.pMax) * 0.5, halfSize * 1.01 + minRadius);
+    }
+
+    azIrradianceCache::OctreeNode *azIrradianceCache::createNode(const Vector3 &center, real_t halfSize)
+    {
+        OctreeNode *node = new OctreeNode;
+        node->center = center;
+        node->halfSize = halfSize;
+        for (int i = 0; i < 8; i++) {
+            node->children[i] = NULL;
+        }
+        return node;
+    }
+
+    void azIrradianceCache::deleteNode(OctreeNode *node)
+    {
+        if (!node) {
+            return;
+        }
+        for (int i = 0; i < 8; i++) {
+            deleteNode(node->children[i]);
+        }
+        delete node;
+    }
+
+    void azIrradianceCache::insert(IrradianceRecord record)
+    {
+        RWLockGuard guard(&recordsLock, true);
+        assert(root);
+        record.radius = clamp(record.radius, minRadius, maxRadius);
+        real_t validRadius = accuracy * record.radius;
+
+        // descend while the child is still large enough to hold the whole valid sphere
+        OctreeNode *node = root;
+        Vector3 d = record.position - root->center;
+        bool inside = fabs(d.x) <= root->halfSize && fabs(d.y) <= root->halfSize && fabs(d.z) <= root->halfSize;
+        while (inside && node->halfSize * 0.5 >= validRadius)
+        {
+            int octant = (record.position.x > node->center.x ? 1 : 0) |
+                         (record.position.y > node->center.y ? 2 : 0) |
+                         (record.position.z > node->center.z ? 4 : 0);
+            if (!node->children[octant])
+            {
+                real_t quarter = node->halfSize * 0.5;
+                Vector3 center(node->center.x + ((octant & 1) ? quarter : -quarter),
+                               node->center.y + ((octant & 2) ? quarter : -quarter),
+                               node->center.z + ((octant & 4) ? quarter : -quarter));
+                node->children[octant] = createNode(center, quarter);
+            }
+            node = node->children[octant];
+        }
+
+        node->records.push_back(records.size());
+        records.push_back(record);
+    }
+
+    bool azIrradianceCache::interpolate(const Vector3 &p, const Vector3 &n, Color3 *irradiance) const
+    {
+        RWLockGuard guard(&recordsLock, false);
+        if (!root || records.empty()) {
+            return false;
+        }
+
+        Color3 sum = Color3::Black();
+        real_t weightSum = 0;
+        lookup(root, p, n, &sum, &weightSum);
+
+        if (weightSum <= 0) {
+            return false;
+        }
+
+        *irradiance = sum * (1.0 / weightSum);
+        return true;
+    }
+
+    void azIrradianceCache::lookup(const OctreeNode *node, const Vector3 &p, const Vector3 &n,
+                                   Color3 *sum, real_t *weightSum) const
+    {
+        for (size_t i = 0; i < node->records.size(); i++)
+        {
+            const IrradianceRecord &rec = records[node->records[i]];
+            Vector3 diff = p - rec.position;
+
+            // reject records in front of p, they see a different part of the scene
+            if (dot(diff, (n + rec.normal) * 0.5) < -0.01 * rec.radius) {
+                continue;
+            }
+
+            real_t error = length(diff) / rec.radius + sqrt(std::max(real_t(0), real_t(1) - dot(n, rec.normal)));
+            if (error >= accuracy) {
+                continue;
+            }
+            real_t weight = real_t(1) / std::max(error, real_t(1e-6));
+
+            // first order extrapolation using rotation and translation gradients
+            Vector3 rotation = cross(rec.normal, n);
+            Color3 estimate(rec.irradiance.r + dot(rotation, rec.rotGradient[0]) + dot(diff, rec.transGradient[0]),
+                            rec.irradiance.g + dot(rotation, rec.rotGradient[1]) + dot(diff, rec.transGradient[1]),
+                            rec.irradiance.b + dot(rotation, rec.rotGradient[2]) + dot(diff, rec.transGradient[2]));
+            estimate = clamp(estimate, 0.0, std::numeric_limits<float>::max());
+
+            *sum += estimate * weight;
+            *weightSum += weight;
+        }
+
+        for (int i = 0; i < 8; i++)
+        {
+            const OctreeNode *child = node->children[i];
+            if (!child) {
+                continue;
+            }
+
+            // records of a child are within its bounds and reach at most halfSize further
+            real_t reach = 2 * child->halfSize;
+            Vector3 d = p - child->center;
+            if (fabs(d.x) <= reach && fabs(d.y) <= reach && fabs(d.z) <= reach) {
+                lookup(child, p, n, sum, weightSum);
+            }
+        }
+    }
+
+}
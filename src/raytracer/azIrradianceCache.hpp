@@ -0,0 +1,89 @@
+//
+//  azIrradianceCache.hpp
+//  Azurender
+//
+//  Irradiance caching, Ward et al. 1988 with gradients of Ward & Heckbert 1992
+//
+
+#ifndef __Azurender__azIrradianceCache__
+#define __Azurender__azIrradianceCache__
+
+#include <vector>
+#include <pthread.h>
+
+#include "math/color.hpp"
+#include "math/vector.hpp"
+#include "scene/BndBox.hpp"
+
+namespace _462 {
+
+    /*!
+     @brief irradiance sampled over the hemisphere of a diffuse surface point
+     */
+    struct IrradianceRecord
+    {
+        Vector3 position;
+        Vector3 normal;
+        Color3 irradiance;
+        real_t radius;                  // harmonic mean distance to the surfaces seen from the record
+        Vector3 rotGradient[3];         // per color channel, change with normal rotation
+        Vector3 transGradient[3];       // per color channel, change with position
+    };
+
+    /*!
+     @brief world space irradiance cache. Records are kept in an octree, every
+            record lives in the deepest node whose extent is still at least twice
+            its validity radius, so a lookup only visits nodes around the point.
+            interpolate and insert may be called from several trace threads,
+            lookups share a read lock and only inserts wait for each other.
+     */
+    class azIrradianceCache
+    {
+    public:
+
+        azIrradianceCache();
+        ~azIrradianceCache();
+
+        // drop all records and cover the given bounds
+        void reset(const BndBox &bounds);
+
+        // interpolate irradiance at p from all valid records, false if none covers p
+        bool interpolate(const Vector3 &p, const Vector3 &n, Color3 *irradiance) const;
+
+        // add a freshly sampled record, radius is clamped to [minRadius, maxRadius]
+        void insert(IrradianceRecord record);
+
+        size_t size() const { return records.size(); }
+
+        float accuracy;         // a in Ward's weight, smaller means denser records
+        real_t minRadius;
+        real_t maxRadius;
+
+    private:
+
+        struct OctreeNode
+        {
+            Vector3 center;
+            real_t halfSize;
+            OctreeNode *children[8];
+            std::vector<int> records;
+        };
+
+        OctreeNode *createNode(const Vector3 &center, real_t halfSize);
+
+        void deleteNode(OctreeNode *node);
+
+        void lookup(const OctreeNode *node, const Vector3 &p, const Vector3 &n,
+                    Color3 *sum, real_t *weightSum) const;
+
+        OctreeNode *root;
+
+        std::vector<IrradianceRecord> records;
+
+        // guards the octree and records, shared by lookups; sampling a new record happens outside of it
+        mutable pthread_rwlock_t recordsLock;
+    };
+
+}
+
+#endif /* defined(__Azurender__azIrradianceCache__) */
@@ -0,0 +1,57 @@
+//
+//  azMorton.hpp
+//  Azurender
+//
+//  Morton (Z-order) codes of points in a box
+//
+
+#ifndef __Azurender__azMorton__
+#define __Azurender__azMorton__
+
+#include "math/vector.hpp"
+
+namespace _462 {
+
+    // spread the low 10 bits of v so two zero bits follow each of them
+    inline unsigned int azMortonExpandBits(unsigned int v)
+    {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    }
+
+    /*!
+     @brief 30 bit Morton code of p in the box [min, min + extent], 10 bits per
+            axis. Points sorted by it are sorted along a Z-order curve, so
+            neighbours in the order are mostly neighbours in space. invExtent is
+            1 / extent per axis, 0 for a flat axis.
+     */
+    inline unsigned int azMortonCode(const Vector3 &p, const Vector3 &min, const Vector3 &invExtent)
+    {
+        unsigned int code = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            real_t t = (p[axis] - min[axis]) * invExtent[axis];
+            t = t < 0 ? 0 : (t > 1 ? 1 : t);
+            code |= azMortonExpandBits((unsigned int)(t * 1023)) << (2 - axis);
+        }
+        return code;
+    }
+
+    // 1 / extent of the box, 0 where it is flat
+    inline Vector3 azMortonInvExtent(const Vector3 &min, const Vector3 &max)
+    {
+        Vector3 inv;
+        for (int axis = 0; axis < 3; axis++) {
+            real_t extent = max[axis] - min[axis];
+            inv[axis] = extent > 0 ? 1 / extent : 0;
+        }
+        return inv;
+    }
+
+}
+
+#endif /* defined(__Azurender__azMorton__) */
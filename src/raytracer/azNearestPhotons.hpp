@@ -0,0 +1,87 @@
+//
+//  azNearestPhotons.hpp
+//  Azurender
+//
+//  k nearest neighbour photon queries
+//
+
+#ifndef __Azurender__azNearestPhotons__
+#define __Azurender__azNearestPhotons__
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+namespace _462 {
+
+    /*!
+     @brief photons found by a k nearest neighbour query, with a fixed capacity.
+            Until it is full every photon within the initial radius is kept; then
+            the photons become a max-heap on squared distance, a closer photon
+            replaces the farthest one and sqrDist shrinks to the new farthest, so
+            the kd-tree search prunes ever more of the tree.
+     */
+    struct azNearestPhotons
+    {
+        struct Entry
+        {
+            float sqrDist;
+            int index;          // photon index, meaning depends on the searched tree
+
+            bool operator<(const Entry &other) const { return sqrDist < other.sqrDist; }
+        };
+
+        azNearestPhotons(size_t capacity, float maxSqrDist)
+        : capacity(capacity), sqrDist(maxSqrDist)
+        {
+            entries.reserve(capacity);
+        }
+
+        // offer a photon at squared distance d, ignored unless closer than sqrDist
+        void insert(int index, float d)
+        {
+            if (d > sqrDist || capacity == 0) {
+                return;
+            }
+
+            Entry entry = { d, index };
+            if (entries.size() < capacity)
+            {
+                // order is only needed once photons get replaced
+                entries.push_back(entry);
+                if (entries.size() == capacity) {
+                    std::make_heap(entries.begin(), entries.end());
+                    sqrDist = entries.front().sqrDist;
+                }
+            }
+            else
+            {
+                std::pop_heap(entries.begin(), entries.end());
+                entries.back() = entry;
+                std::push_heap(entries.begin(), entries.end());
+                sqrDist = entries.front().sqrDist;
+            }
+        }
+
+        // empty again with the search radius back at maxSqrDist, keeps the storage
+        void reset(float maxSqrDist)
+        {
+            entries.clear();
+            sqrDist = maxSqrDist;
+        }
+
+        size_t size() const { return entries.size(); }
+
+        int operator[](size_t i) const { return entries[i].index; }
+
+        size_t capacity;
+
+        // squared search radius, the initial radius until the heap is full
+        float sqrDist;
+
+        std::vector<Entry> entries;
+    };
+
+}
+
+#endif /* defined(__Azurender__azNearestPhotons__) */
@@ -0,0 +1,45 @@
+//
+//  azParallel.hpp
+//  Azurender
+//
+//  Fork-join over contiguous chunks of an index range
+//
+
+#ifndef __Azurender__azParallel__
+#define __Azurender__azParallel__
+
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+namespace _462 {
+
+    /*!
+     @brief Run fn(begin, end, worker) over numWorkers contiguous chunks of
+            [0, count), worker 0 on the calling thread, and return once all of
+            them are done. Chunks follow worker order, so output appended per
+            worker can be concatenated and does not depend on the thread count.
+            Every worker index is run, a chunk may be empty if count is smaller
+            than numWorkers.
+     */
+    template <typename Func>
+    void azParallelChunks(size_t count, size_t numWorkers, const Func &fn)
+    {
+        if (numWorkers <= 1) {
+            fn(size_t(0), count, size_t(0));
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        for (size_t w = 1; w < numWorkers; w++) {
+            workers.push_back(std::thread(fn, count * w / numWorkers, count * (w + 1) / numWorkers, w));
+        }
+        fn(size_t(0), count / numWorkers, size_t(0));
+        for (size_t w = 0; w < workers.size(); w++) {
+            workers[w].join();
+        }
+    }
+
+}
+
+#endif /* defined(__Azurender__azParallel__) */
@@ -0,0 +1,184 @@
+//
+//  azPhotonGather.cpp
+//  Azurender
+//
+//  Leaf scan of photon gathers over the SoA position arrays
+//
+
+#include "azPhotonGather.hpp"
+
+#include "raytracer/Photon.hpp"
+#include "raytracer/Utils.h"
+
+#include <cstdio>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AZ_GATHER_X86 1
+#include <immintrin.h>
+#else
+#define AZ_GATHER_X86 0
+#endif
+
+namespace _462 {
+
+    void azGatherLeafScalar(const float *posx, const float *posy, const float *posz,
+                            const int *index, int head, int tail,
+                            const float query[3], azNearestPhotons &nearest)
+    {
+        for (int i = head; i < tail; i++)
+        {
+            float dx = posx[i] - query[0];
+            float dy = posy[i] - query[1];
+            float dz = posz[i] - query[2];
+            nearest.insert(index ? index[i] : i, dx * dx + dy * dy + dz * dz);
+        }
+    }
+
+#if AZ_GATHER_X86
+
+    // offer the photons of the set bits of mask, d holds their squared distances
+    static inline void gatherLanes(int mask, const float *d, const int *index, int base,
+                                   azNearestPhotons &nearest)
+    {
+        while (mask)
+        {
+            int lane = __builtin_ctz(mask);
+            // a photon of this group may have shrunk the radius, insert checks again
+            nearest.insert(index ? index[base + lane] : base + lane, d[lane]);
+            mask &= mask - 1;
+        }
+    }
+
+    __attribute__((target("sse2")))
+    static void gatherLeafSSE(const float *posx, const float *posy, const float *posz,
+                              const int *index, int head, int tail,
+                              const float query[3], azNearestPhotons &nearest)
+    {
+        __m128 qx = _mm_set1_ps(query[0]);
+        __m128 qy = _mm_set1_ps(query[1]);
+        __m128 qz = _mm_set1_ps(query[2]);
+
+        int i = head;
+        for (; i + 4 <= tail; i += 4)
+        {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(posx + i), qx);
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(posy + i), qy);
+            __m128 dz = _mm_sub_ps(_mm_loadu_ps(posz + i), qz);
+            __m128 d2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+
+            int mask = _mm_movemask_ps(_mm_cmple_ps(d2, _mm_set1_ps(nearest.sqrDist)));
+            if (mask)
+            {
+                float d[4];
+                _mm_storeu_ps(d, d2);
+                gatherLanes(mask, d, index, i, nearest);
+            }
+        }
+
+        azGatherLeafScalar(posx, posy, posz, index, i, tail, query, nearest);
+    }
+
+    __attribute__((target("avx")))
+    static void gatherLeafAVX(const float *posx, const float *posy, const float *posz,
+                              const int *index, int head, int tail,
+                              const float query[3], azNearestPhotons &nearest)
+    {
+        __m256 qx = _mm256_set1_ps(query[0]);
+        __m256 qy = _mm256_set1_ps(query[1]);
+        __m256 qz = _mm256_set1_ps(query[2]);
+
+        int i = head;
+        for (; i + 8 <= tail; i += 8)
+        {
+            __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(posx + i), qx);
+            __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(posy + i), qy);
+            __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(posz + i), qz);
+            __m256 d2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+                                      _mm256_mul_ps(dz, dz));
+
+            int mask = _mm256_movemask_ps(_mm256_cmp_ps(d2, _mm256_set1_ps(nearest.sqrDist), _CMP_LE_OQ));
+            if (mask)
+            {
+                float d[8];
+                _mm256_storeu_ps(d, d2);
+                gatherLanes(mask, d, index, i, nearest);
+            }
+        }
+
+        gatherLeafSSE(posx, posy, posz, index, i, tail, query, nearest);
+    }
+
+#endif
+
+    typedef void (*GatherLeafKernel)(const float *, const float *, const float *,
+                                     const int *, int, int, const float *, azNearestPhotons &);
+
+    // picked once from the cpu features, the widest kernel wins
+    static GatherLeafKernel selectGatherLeafKernel(const char **name)
+    {
+#if AZ_GATHER_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx")) {
+            *name = "avx";
+            return gatherLeafAVX;
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            *name = "sse2";
+            return gatherLeafSSE;
+        }
+#endif
+        *name = "scalar";
+        return azGatherLeafScalar;
+    }
+
+    static const char *gatherLeafKernelName = "scalar";
+    static const GatherLeafKernel gatherLeafKernel = selectGatherLeafKernel(&gatherLeafKernelName);
+
+    void azGatherLeaf(const float *posx, const float *posy, const float *posz,
+                      const int *index, int head, int tail,
+                      const float query[3], azNearestPhotons &nearest)
+    {
+        gatherLeafKernel(posx, posy, posz, index, head, tail, query, nearest);
+    }
+
+    const char *azGatherLeafKernel()
+    {
+        return gatherLeafKernelName;
+    }
+
+    void azBenchmarkGatherLeaf(const float *posx, const float *posy, const float *posz,
+                               const int *index, int size, int leafSize,
+                               size_t numQueries, float sqrRadius, size_t maxNum)
+    {
+        if (size < leafSize || numQueries == 0) {
+            return;
+        }
+
+        // the same leaves and queries for both kernels, spread over the whole array
+        std::vector<int> heads(numQueries);
+        for (size_t q = 0; q < numQueries; q++) {
+            heads[q] = int((q * 7919) % size_t(size - leafSize + 1));
+        }
+
+        const GatherLeafKernel kernels[2] = { azGatherLeafScalar, gatherLeafKernel };
+        const char *names[2] = { "scalar", gatherLeafKernelName };
+        size_t found[2] = { 0, 0 };
+        for (int k = 0; k < 2; k++)
+        {
+            unsigned int start = azGetTicks();
+            for (size_t q = 0; q < numQueries; q++)
+            {
+                int slot = heads[q] + leafSize / 2;
+                const float query[3] = { posx[slot], posy[slot], posz[slot] };
+                azNearestPhotons nearest(maxNum, sqrRadius);
+                kernels[k](posx, posy, posz, index, heads[q], heads[q] + leafSize, query, nearest);
+                found[k] += nearest.size();
+            }
+            unsigned int elapsed = std::max(azGetTicks() - start, 1u);
+            printf("Gather leaf scan (%s): %zu queries in %d ms, %.1f M photons/s, %zu found\n",
+                   names[k], numQueries, elapsed, double(numQueries) * leafSize / (elapsed * 1000.0), found[k]);
+        }
+    }
+
+}
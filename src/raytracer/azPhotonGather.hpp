@@ -0,0 +1,44 @@
+//
+//  azPhotonGather.hpp
+//  Azurender
+//
+//  Leaf scan of photon gathers over the SoA position arrays
+//
+
+#ifndef __Azurender__azPhotonGather__
+#define __Azurender__azPhotonGather__
+
+#include "raytracer/azNearestPhotons.hpp"
+
+#include <cstddef>
+
+namespace _462 {
+
+    /*!
+     @brief offer the photons in SoA slots [head, tail) to nearest, which stores
+            index[i] for slot i, or i itself when index is NULL. Tests
+            8 (AVX) or 4 (SSE) photons per instruction against the current radius.
+     */
+    void azGatherLeaf(const float *posx, const float *posy, const float *posz,
+                      const int *index, int head, int tail,
+                      const float query[3], azNearestPhotons &nearest);
+
+    // one photon at a time, fallback of azGatherLeaf and reference for the benchmark
+    void azGatherLeafScalar(const float *posx, const float *posy, const float *posz,
+                            const int *index, int head, int tail,
+                            const float query[3], azNearestPhotons &nearest);
+
+    // name of the kernel azGatherLeaf dispatches to on this cpu
+    const char *azGatherLeafKernel();
+
+    /*!
+     @brief time azGatherLeaf against azGatherLeafScalar on leaves of leafSize photons
+            around numQueries photons of the arrays and print photons tested per second
+     */
+    void azBenchmarkGatherLeaf(const float *posx, const float *posy, const float *posz,
+                               const int *index, int size, int leafSize,
+                               size_t numQueries, float sqrRadius, size_t maxNum);
+
+}
+
+#endif /* defined(__Azurender__azPhotonGather__) */
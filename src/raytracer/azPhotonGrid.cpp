@@ -0,0 +1,131 @@
+//
+//  azPhotonGrid.cpp
+//  Azurender
+//
+//  Hashed uniform grid for fixed radius photon gathers
+//
+
+#include "azPhotonGrid.hpp"
+#include "azPhotonGather.hpp"
+#include "azParallel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace _462 {
+
+    azPhotonGrid::azPhotonGrid()
+    : cellSize(1), invCellSize(1), bucketMask(0), bucketStart(2, 0) { }
+
+    int azPhotonGrid::cellOf(float x) const
+    {
+        return int(floorf(x * invCellSize));
+    }
+
+    size_t azPhotonGrid::bucketOf(int cx, int cy, int cz) const
+    {
+        // Teschner et al. 2003, primes spread neighbouring cells over the table
+        unsigned int h = (unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u ^ (unsigned int)cz * 83492791u;
+        return h & bucketMask;
+    }
+
+    void azPhotonGrid::build(const float *posx, const float *posy, const float *posz,
+                             int size, float cellSize, size_t numWorkers)
+    {
+        assert(cellSize > 0);
+        this->cellSize = cellSize;
+        invCellSize = 1.0f / cellSize;
+
+        // about one bucket per photon keeps collisions rare without an empty table scan
+        size_t numBuckets = 1;
+        while (numBuckets < size_t(size)) {
+            numBuckets <<= 1;
+        }
+        bucketMask = numBuckets - 1;
+
+        numWorkers = std::max(size_t(1), std::min(numWorkers, size_t(size)));
+        buckets.resize(size);
+        workerCounts.assign(numWorkers * numBuckets, 0);
+
+        // hash and count, every worker into its own histogram
+        azParallelChunks(size, numWorkers, [&](size_t begin, size_t end, size_t w) {
+            int *counts = &workerCounts[w * numBuckets];
+            for (size_t i = begin; i < end; i++) {
+                size_t b = bucketOf(cellOf(posx[i]), cellOf(posy[i]), cellOf(posz[i]));
+                buckets[i] = b;
+                counts[b]++;
+            }
+        });
+
+        // exclusive prefix over buckets then workers, so worker w writes
+        // its photons of a bucket after those of workers before it
+        bucketStart.resize(numBuckets + 1);
+        int offset = 0;
+        for (size_t b = 0; b < numBuckets; b++)
+        {
+            bucketStart[b] = offset;
+            for (size_t w = 0; w < numWorkers; w++)
+            {
+                int count = workerCounts[w * numBuckets + b];
+                workerCounts[w * numBuckets + b] = offset;
+                offset += count;
+            }
+        }
+        bucketStart[numBuckets] = offset;
+
+        // scatter, stable within a bucket
+        sortedx.resize(size);
+        sortedy.resize(size);
+        sortedz.resize(size);
+        sortedIndex.resize(size);
+        azParallelChunks(size, numWorkers, [&](size_t begin, size_t end, size_t w) {
+            int *next = &workerCounts[w * numBuckets];
+            for (size_t i = begin; i < end; i++) {
+                int slot = next[buckets[i]]++;
+                sortedx[slot] = posx[i];
+                sortedy[slot] = posy[i];
+                sortedz[slot] = posz[i];
+                sortedIndex[slot] = int(i);
+            }
+        });
+    }
+
+    void azPhotonGrid::locate(const float query[3], azNearestPhotons &nearest) const
+    {
+        if (sortedIndex.empty()) {
+            return;
+        }
+
+        float radius = sqrtf(nearest.sqrDist);
+        int lo[3], hi[3];
+        for (int a = 0; a < 3; a++) {
+            lo[a] = cellOf(query[a] - radius);
+            hi[a] = cellOf(query[a] + radius);
+            // the grid is built for this radius, at most 3 cells per axis
+            assert(hi[a] - lo[a] <= 2);
+        }
+
+        // distinct cells may share a bucket, scan every bucket once
+        size_t visited[27];
+        int numVisited = 0;
+        for (int z = lo[2]; z <= hi[2]; z++)
+        {
+            for (int y = lo[1]; y <= hi[1]; y++)
+            {
+                for (int x = lo[0]; x <= hi[0]; x++)
+                {
+                    size_t b = bucketOf(x, y, z);
+                    if (std::find(visited, visited + numVisited, b) != visited + numVisited) {
+                        continue;
+                    }
+                    visited[numVisited++] = b;
+
+                    azGatherLeaf(&sortedx[0], &sortedy[0], &sortedz[0], &sortedIndex[0],
+                                 bucketStart[b], bucketStart[b + 1], query, nearest);
+                }
+            }
+        }
+    }
+
+}
@@ -0,0 +1,73 @@
+//
+//  azPhotonGrid.hpp
+//  Azurender
+//
+//  Hashed uniform grid for fixed radius photon gathers
+//
+
+#ifndef __Azurender__azPhotonGrid__
+#define __Azurender__azPhotonGrid__
+
+#include <vector>
+#include <cstddef>
+
+#include "raytracer/azNearestPhotons.hpp"
+
+namespace _462 {
+
+    /*!
+     @brief photons bucketed by a spatial hash of their grid cell, an alternative
+            to the VVH kd-tree when every gather uses the same maximum radius.
+            With a cell size of at least twice that radius a query sphere overlaps
+            2 cells per axis, so a lookup scans the contiguous photons of at most
+            8 buckets (27 when the cell size is only the radius). Building is a
+            counting sort on the bucket, linear in the number of photons.
+     */
+    class azPhotonGrid
+    {
+    public:
+
+        azPhotonGrid();
+
+        /*!
+         @brief bucket photons [0, size) of the SoA arrays, gathers return the
+                slot of a photon in those arrays. Hashing, counting and scattering are split over numWorkers threads;
+                storage of the previous build is reused.
+         */
+        void build(const float *posx, const float *posy, const float *posz,
+                   int size, float cellSize, size_t numWorkers);
+
+        // offer the photons of every cell within sqrt(nearest.sqrDist) of query
+        void locate(const float query[3], azNearestPhotons &nearest) const;
+
+        size_t size() const { return sortedIndex.size(); }
+
+    private:
+
+        int cellOf(float x) const;
+
+        size_t bucketOf(int cx, int cy, int cz) const;
+
+        float cellSize;
+        float invCellSize;
+
+        // number of buckets - 1, the table size is a power of two
+        size_t bucketMask;
+
+        // photons of bucket b are [bucketStart[b], bucketStart[b + 1])
+        std::vector<int> bucketStart;
+
+        // photons in bucket order, SoA for the leaf scan
+        std::vector<float> sortedx;
+        std::vector<float> sortedy;
+        std::vector<float> sortedz;
+        std::vector<int> sortedIndex;        // slot in the arrays given to build
+
+        // build scratch: bucket of every photon, per worker counts
+        std::vector<size_t> buckets;
+        std::vector<int> workerCounts;
+    };
+
+}
+
+#endif /* defined(__Azurender__azPhotonGrid__) */
@@ -0,0 +1,65 @@
+//
+//  azPool.hpp
+//  Azurender
+//
+//  Fixed capacity object pool, reset between progressive passes
+//
+
+#ifndef __Azurender__azPool__
+#define __Azurender__azPool__
+
+#include <vector>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+
+namespace _462 {
+
+    /*!
+     @brief hands out objects from one block that is kept across passes. reset
+            drops every object at once and only reallocates when a pass needs
+            more than any pass before, so rebuilding a structure every pass does
+            not touch the heap. allocate may be called from several threads;
+            pointers stay valid until the next reset.
+     */
+    template <typename T>
+    class azPool
+    {
+    public:
+
+        azPool() : next(0) { }
+
+        // forget all objects handed out, room for capacity new ones
+        void reset(size_t capacity)
+        {
+            if (storage.size() < capacity) {
+                storage.resize(capacity);
+            }
+            next = 0;
+        }
+
+        // a value initialized object, the capacity given to reset must not be exceeded
+        T *allocate()
+        {
+            size_t i = next.fetch_add(1, std::memory_order_relaxed);
+            assert(i < storage.size());
+            storage[i] = T();
+            return &storage[i];
+        }
+
+        size_t size() const { return next.load(); }
+
+        size_t capacity() const { return storage.size(); }
+
+    private:
+
+        azPool(const azPool &);
+        azPool &operator=(const azPool &);
+
+        std::vector<T> storage;
+        std::atomic<size_t> next;
+    };
+
+}
+
+#endif /* defined(__Azurender__azPool__) */
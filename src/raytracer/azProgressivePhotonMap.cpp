@@ -0,0 +1,234 @@
+//
+//  azProgressivePhotonMap.cpp
+//  Azurender
+//
+//  Stochastic progressive photon mapping, Hachisuka & Jensen 2009
+//
+
+#include "azProgressivePhotonMap.hpp"
+#include "azParallel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+namespace _462 {
+
+    azProgressivePhotonMap::azProgressivePhotonMap()
+    : alpha(0.7), cellSize(1), invCellSize(1), bucketMask(0), bucketStart(2, 0) { }
+
+    void azProgressivePhotonMap::reset(size_t numPixels, real_t initialSqrRadius, real_t alpha)
+    {
+        this->alpha = alpha;
+
+        Pixel pixel;
+        pixel.position = Vector3::Zero();
+        pixel.normal = Vector3::Zero();
+        pixel.weight = Color3::Black();
+        pixel.isValid = false;
+        pixel.sqrRadius = initialSqrRadius;
+        pixel.photonCount = 0;
+        pixel.flux = Color3::Black();
+        pixels.assign(numPixels, pixel);
+
+        pixelPhotons.assign(numPixels, 0);
+        pixelFlux.assign(numPixels, Color3::Black());
+    }
+
+    void azProgressivePhotonMap::setVisiblePoint(size_t pixel, const Vector3 &position,
+                                                 const Vector3 &normal, const Color3 &weight)
+    {
+        Pixel &p = pixels[pixel];
+        p.position = position;
+        p.normal = normal;
+        p.weight = weight;
+        p.isValid = true;
+    }
+
+    void azProgressivePhotonMap::clearVisiblePoint(size_t pixel)
+    {
+        pixels[pixel].isValid = false;
+    }
+
+    int azProgressivePhotonMap::cellOf(real_t x) const
+    {
+        return int(floor(x * invCellSize));
+    }
+
+    size_t azProgressivePhotonMap::bucketOf(int cx, int cy, int cz) const
+    {
+        // same spatial hash as azPhotonGrid
+        unsigned int h = (unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u ^ (unsigned int)cz * 83492791u;
+        return h & bucketMask;
+    }
+
+    int azProgressivePhotonMap::pixelBuckets(const Pixel &pixel, size_t buckets[8]) const
+    {
+        if (!pixel.isValid) {
+            return 0;
+        }
+
+        real_t radius = sqrt(pixel.sqrRadius);
+        int lo[3], hi[3];
+        for (int a = 0; a < 3; a++) {
+            lo[a] = cellOf(pixel.position[a] - radius);
+            hi[a] = cellOf(pixel.position[a] + radius);
+            assert(hi[a] - lo[a] <= 1);
+        }
+
+        int numBuckets = 0;
+        for (int z = lo[2]; z <= hi[2]; z++)
+        {
+            for (int y = lo[1]; y <= hi[1]; y++)
+            {
+                for (int x = lo[0]; x <= hi[0]; x++)
+                {
+                    size_t b = bucketOf(x, y, z);
+                    if (std::find(buckets, buckets + numBuckets, b) == buckets + numBuckets) {
+                        buckets[numBuckets++] = b;
+                    }
+                }
+            }
+        }
+        return numBuckets;
+    }
+
+    void azProgressivePhotonMap::buildGrid(size_t numWorkers)
+    {
+        real_t maxSqrRadius = 0;
+        for (size_t i = 0; i < pixels.size(); i++) {
+            if (pixels[i].isValid) {
+                maxSqrRadius = std::max(maxSqrRadius, pixels[i].sqrRadius);
+            }
+        }
+        // a little over twice the largest radius, so no sphere spans more than 2 cells per axis
+        cellSize = std::max(2.01 * sqrt(maxSqrRadius), 1e-6);
+        invCellSize = 1.0 / cellSize;
+
+        size_t numBuckets = 1;
+        while (numBuckets < pixels.size()) {
+            numBuckets <<= 1;
+        }
+        bucketMask = numBuckets - 1;
+
+        workerCounts.assign(numWorkers * numBuckets, 0);
+
+        // count, every worker into its own histogram
+        azParallelChunks(pixels.size(), numWorkers, [&](size_t begin, size_t end, size_t w) {
+            int *counts = &workerCounts[w * numBuckets];
+            size_t buckets[8];
+            for (size_t i = begin; i < end; i++) {
+                int n = pixelBuckets(pixels[i], buckets);
+                for (int k = 0; k < n; k++) {
+                    counts[buckets[k]]++;
+                }
+            }
+        });
+
+        bucketStart.resize(numBuckets + 1);
+        int offset = 0;
+        for (size_t b = 0; b < numBuckets; b++)
+        {
+            bucketStart[b] = offset;
+            for (size_t w = 0; w < numWorkers; w++)
+            {
+                int count = workerCounts[w * numBuckets + b];
+                workerCounts[w * numBuckets + b] = offset;
+                offset += count;
+            }
+        }
+        bucketStart[numBuckets] = offset;
+
+        // scatter, pixels of a bucket stay in pixel order
+        bucketPixels.resize(offset);
+        azParallelChunks(pixels.size(), numWorkers, [&](size_t begin, size_t end, size_t w) {
+            int *next = &workerCounts[w * numBuckets];
+            size_t buckets[8];
+            for (size_t i = begin; i < end; i++) {
+                int n = pixelBuckets(pixels[i], buckets);
+                for (int k = 0; k < n; k++) {
+                    bucketPixels[next[buckets[k]]++] = int(i);
+                }
+            }
+        });
+    }
+
+    void azProgressivePhotonMap::addPhotonPass(const SPPMPhoton *photons, size_t count, size_t numWorkers)
+    {
+        if (pixels.empty()) {
+            return;
+        }
+        numWorkers = std::max(size_t(1), std::min(numWorkers, pixels.size()));
+
+        buildGrid(numWorkers);
+
+        // find the pixels of every photon, hits are kept by the worker owning the pixel
+        workerHits.resize(numWorkers * numWorkers);
+        size_t numPixels = pixels.size();
+        azParallelChunks(count, numWorkers, [&](size_t begin, size_t end, size_t w) {
+            for (size_t o = 0; o < numWorkers; o++) {
+                workerHits[w * numWorkers + o].clear();
+            }
+            for (size_t i = begin; i < end; i++)
+            {
+                const SPPMPhoton &photon = photons[i];
+                size_t b = bucketOf(cellOf(photon.position.x), cellOf(photon.position.y), cellOf(photon.position.z));
+                for (int k = bucketStart[b]; k < bucketStart[b + 1]; k++)
+                {
+                    int index = bucketPixels[k];
+                    const Pixel &pixel = pixels[index];
+                    if (squared_distance(photon.position, pixel.position) > pixel.sqrRadius) {
+                        continue;
+                    }
+
+                    // lambertian, the 1/pi is part of the density estimate
+                    real_t cosine = std::max(real_t(0), dot(pixel.normal, photon.direction));
+                    Hit hit = { index, pixel.weight * photon.flux * cosine };
+                    workerHits[w * numWorkers + index * numWorkers / numPixels].push_back(hit);
+                }
+            }
+        });
+
+        // every owner adds its hits in photon order, no pixel is touched by two threads
+        azParallelChunks(numPixels, numWorkers, [&](size_t /* begin */, size_t /* end */, size_t o) {
+            for (size_t w = 0; w < numWorkers; w++)
+            {
+                const std::vector<Hit> &hits = workerHits[w * numWorkers + o];
+                for (size_t h = 0; h < hits.size(); h++) {
+                    pixelPhotons[hits[h].pixel]++;
+                    pixelFlux[hits[h].pixel] += hits[h].flux;
+                }
+            }
+        });
+
+        // shrink radius and flux of every pixel by the share of photons kept
+        azParallelChunks(numPixels, numWorkers, [&](size_t begin, size_t end, size_t /* w */) {
+            for (size_t i = begin; i < end; i++)
+            {
+                Pixel &pixel = pixels[i];
+                int m = pixelPhotons[i];
+                if (m > 0)
+                {
+                    // keep a fraction alpha of the new photons at the same density
+                    real_t n = pixel.photonCount + alpha * m;
+                    real_t ratio = n / (pixel.photonCount + m);
+                    pixel.sqrRadius *= ratio;
+                    pixel.flux = (pixel.flux + pixelFlux[i]) * ratio;
+                    pixel.photonCount = n;
+                }
+                pixelPhotons[i] = 0;
+                pixelFlux[i] = Color3::Black();
+            }
+        });
+    }
+
+    Color3 azProgressivePhotonMap::radiance(size_t pixel, size_t numPasses) const
+    {
+        const Pixel &p = pixels[pixel];
+        if (numPasses == 0 || p.photonCount == 0) {
+            return Color3::Black();
+        }
+        return p.flux * real_t(1.0 / (PI * p.sqrRadius * numPasses));
+    }
+
+}
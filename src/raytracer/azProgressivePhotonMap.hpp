@@ -0,0 +1,120 @@
+//
+//  azProgressivePhotonMap.hpp
+//  Azurender
+//
+//  Stochastic progressive photon mapping, Hachisuka & Jensen 2009
+//
+
+#ifndef __Azurender__azProgressivePhotonMap__
+#define __Azurender__azProgressivePhotonMap__
+
+#include <vector>
+#include <cstddef>
+
+#include "math/color.hpp"
+#include "math/vector.hpp"
+
+namespace _462 {
+
+    /*!
+     @brief a photon of the current pass as the visible points see it
+     */
+    struct SPPMPhoton
+    {
+        Vector3 position;
+        Vector3 direction;      // towards where the photon came from
+        Color3 flux;
+    };
+
+    /*!
+     @brief per pixel statistics of stochastic progressive photon mapping. Every
+            camera pass stores one visible point per pixel; the photons of the
+            following photon pass are looked up in a hashed grid over those
+            points, not the other way round, so nothing of a pass is kept once
+            it is folded in. Each pixel then shrinks its own radius and rescales
+            its accumulated flux, the estimate converges as passes go on.
+     */
+    class azProgressivePhotonMap
+    {
+    public:
+
+        azProgressivePhotonMap();
+
+        // one visible point per pixel, all radii start at initialSqrRadius
+        void reset(size_t numPixels, real_t initialSqrRadius, real_t alpha);
+
+        // weight is the diffuse reflectance seen by the pixel, photon flux gets multiplied by it
+        void setVisiblePoint(size_t pixel, const Vector3 &position, const Vector3 &normal, const Color3 &weight);
+
+        // the pixel saw nothing a photon can land on this pass
+        void clearVisiblePoint(size_t pixel);
+
+        /*!
+         @brief build the grid over the visible points, add the photons of a pass
+                to every point whose radius they fall in, then update radius and
+                flux of the pixels. Split over numWorkers threads, the result does
+                not depend on the number of workers.
+         */
+        void addPhotonPass(const SPPMPhoton *photons, size_t count, size_t numWorkers);
+
+        // photon radiance of the pixel, averaged over numPasses photon passes
+        Color3 radiance(size_t pixel, size_t numPasses) const;
+
+        size_t size() const { return pixels.size(); }
+
+    private:
+
+        struct Pixel
+        {
+            // visible point of the current pass
+            Vector3 position;
+            Vector3 normal;
+            Color3 weight;
+            bool isValid;
+
+            real_t sqrRadius;
+            real_t photonCount;     // N of the paper, photons accumulated so far
+            Color3 flux;            // tau of the paper, over the current radius
+        };
+
+        // a photon within the radius of a pixel
+        struct Hit
+        {
+            int pixel;
+            Color3 flux;
+        };
+
+        void buildGrid(size_t numWorkers);
+
+        int cellOf(real_t x) const;
+
+        size_t bucketOf(int cx, int cy, int cz) const;
+
+        // distinct buckets of the cells overlapping the sphere of a pixel, returns their count
+        int pixelBuckets(const Pixel &pixel, size_t buckets[8]) const;
+
+        std::vector<Pixel> pixels;
+
+        real_t alpha;
+
+        // hashed grid over the visible points, a point is in every bucket its sphere overlaps
+        real_t cellSize;
+        real_t invCellSize;
+        size_t bucketMask;
+        std::vector<int> bucketStart;
+        std::vector<int> bucketPixels;
+
+        // photons and flux found this pass, folded into the pixels at its end
+        std::vector<int> pixelPhotons;
+        std::vector<Color3> pixelFlux;
+
+        // build scratch
+        std::vector<int> workerCounts;
+
+        // hits found by worker w for pixels owned by worker o, at [w * numWorkers + o]
+        std::vector<std::vector<Hit> > workerHits;
+    };
+
+}
+
+#endif /* defined(__Azurender__azProgressivePhotonMap__) */
@@ -0,0 +1,86 @@
+//
+//  azProjectionMap.cpp
+//  Azurender
+//
+//  Projection map of a point light, Jensen 1996
+//
+
+#include "azProjectionMap.hpp"
+#include "azParallel.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace _462 {
+
+    azProjectionMap::azProjectionMap() : rows(0), columns(0) { }
+
+    Vector3 azProjectionMap::cellDirection(size_t row, size_t column, real_t u, real_t v) const
+    {
+        // uniform in z = cos(theta) and in phi, so every cell spans the same solid angle
+        real_t z = 1 - 2 * (row + u) / rows;
+        real_t phi = 2 * PI * (column + v) / columns;
+        real_t r = sqrt(std::max(real_t(0), 1 - z * z));
+        return Vector3(r * cos(phi), r * sin(phi), z);
+    }
+
+    void azProjectionMap::build(size_t rows, size_t samples, size_t numWorkers,
+                                const std::function<bool(const Vector3 &)> &isTarget)
+    {
+        this->rows = std::max(rows, size_t(1));
+        columns = 2 * this->rows;
+        samples = std::max(samples, size_t(1));
+
+        size_t numCells = this->rows * columns;
+        numWorkers = std::max(size_t(1), std::min(numWorkers, numCells));
+
+        // every cell is written by one worker only
+        std::vector<char> hit(numCells, 0);
+        azParallelChunks(numCells, numWorkers, [&](size_t begin, size_t end, size_t /* w */) {
+            for (size_t c = begin; c < end; c++)
+            {
+                size_t row = c / columns, column = c % columns;
+                for (size_t k = 0; k < samples * samples && !hit[c]; k++)
+                {
+                    real_t u = (k / samples + real_t(0.5)) / samples;
+                    real_t v = (k % samples + real_t(0.5)) / samples;
+                    hit[c] = isTarget(cellDirection(row, column, u, v));
+                }
+            }
+        });
+
+        // grow the marks by one cell, phi wraps around
+        marked.clear();
+        for (size_t c = 0; c < numCells; c++)
+        {
+            int row = int(c / columns), column = int(c % columns);
+            bool mark = false;
+            for (int dr = -1; dr <= 1 && !mark; dr++)
+            {
+                int r = row + dr;
+                if (r < 0 || r >= int(this->rows)) {
+                    continue;
+                }
+                for (int dc = -1; dc <= 1 && !mark; dc++) {
+                    int col = (column + dc + int(columns)) % int(columns);
+                    mark = hit[r * columns + col] != 0;
+                }
+            }
+            if (mark) {
+                marked.push_back(int(c));
+            }
+        }
+    }
+
+    Vector3 azProjectionMap::sampleDirection(real_t u0, real_t u1, real_t u2) const
+    {
+        size_t i = std::min(size_t(u0 * marked.size()), marked.size() - 1);
+        return cellDirection(marked[i] / columns, marked[i] % columns, u1, u2);
+    }
+
+    real_t azProjectionMap::coverage() const
+    {
+        return rows > 0 ? real_t(marked.size()) / (rows * columns) : 0;
+    }
+
+}
@@ -0,0 +1,65 @@
+//
+//  azProjectionMap.hpp
+//  Azurender
+//
+//  Projection map of a point light, Jensen 1996
+//
+
+#ifndef __Azurender__azProjectionMap__
+#define __Azurender__azProjectionMap__
+
+#include <vector>
+#include <cstddef>
+#include <functional>
+
+#include "math/vector.hpp"
+
+namespace _462 {
+
+    /*!
+     @brief the directions a point light sends photons to, split into cells of
+            equal solid angle, rows in cos(theta) and columns in phi. A cell is
+            marked when a ray through it reaches a target, e.g. a specular
+            surface, then the marks grow by one cell so objects smaller than the
+            sampling pattern are not lost at their silhouette. Photons sent
+            uniformly into the marked cells see the same directions as uniform
+            emission that happens to reach a target.
+     */
+    class azProjectionMap
+    {
+    public:
+
+        azProjectionMap();
+
+        /*!
+         @brief mark the cells of a rows x 2 rows map, isTarget tells whether a
+                ray leaving in a normalized direction reaches a target. It is
+                called samples x samples times per cell from numWorkers threads.
+         */
+        void build(size_t rows, size_t samples, size_t numWorkers,
+                   const std::function<bool(const Vector3 &)> &isTarget);
+
+        // uniform direction in a uniformly chosen marked cell, u0..u2 in [0, 1)
+        Vector3 sampleDirection(real_t u0, real_t u1, real_t u2) const;
+
+        // no marked cell, nothing to aim at
+        bool empty() const { return marked.empty(); }
+
+        // share of the sphere covered by the marked cells
+        real_t coverage() const;
+
+    private:
+
+        // direction through (row + u, column + v) of the map
+        Vector3 cellDirection(size_t row, size_t column, real_t u, real_t v) const;
+
+        size_t rows;
+        size_t columns;
+
+        // marked cells as row * columns + column, ascending
+        std::vector<int> marked;
+    };
+
+}
+
+#endif /* defined(__Azurender__azProjectionMap__) */
@@ -0,0 +1,180 @@
+//
+//  azRayExchange.cpp
+//  Azurender
+//
+//  Streamed ray exchange between MPI nodes with non-blocking sends
+//
+
+#include "azRayExchange.hpp"
+
+#include <cstdio>
+#include <exception>
+
+namespace _462 {
+
+    // tags of the exchanges made so far, the same sequence on every node
+    static int exchangeCount = 0;
+
+    // MPI guarantees tags up to 32767
+    static const int EXCHANGE_TAG_BASE = 1000;
+    static const int EXCHANGE_TAG_RANGE = 30000;
+
+    azRayExchange::azRayExchange(int procs, int procId, size_t batchSize, RayWireFormat format, const Consumer &consumer)
+    : procs(procs), procId(procId), batchSize(batchSize > 0 ? batchSize : 1), format(format),
+      raySize(azRayWireSize(format)), consumer(consumer), outgoing(procs), ended(0), waited(0), numSent(0)
+    {
+        tag = EXCHANGE_TAG_BASE + exchangeCount++ % EXCHANGE_TAG_RANGE;
+        for (int i = 0; i < procs; i++) {
+            outgoing[i].reserve(this->batchSize * raySize);
+        }
+    }
+
+    azRayExchange::~azRayExchange()
+    {
+        // finish was not called, the buffers must stay until the sends are done
+        for (std::list<Pending>::iterator it = inFlight.begin(); it != inFlight.end(); ++it) {
+            MPI_Wait(&it->request, MPI_STATUS_IGNORE);
+        }
+    }
+
+    void azRayExchange::push_back(int rank, const Ray &ray)
+    {
+        std::vector<unsigned char> &batch = outgoing[rank];
+        batch.resize(batch.size() + raySize);
+        azPackRay(format, ray, &batch[batch.size() - raySize]);
+        if (batch.size() >= batchSize * raySize) {
+            send(rank);
+        }
+    }
+
+    void azRayExchange::send(int rank)
+    {
+        // an empty batch would read as the end of this node
+        if (outgoing[rank].empty()) {
+            return;
+        }
+
+        if (rank == procId)
+        {
+            local.push_back(std::vector<unsigned char>());
+            local.back().swap(outgoing[rank]);
+            refill(rank);
+            return;
+        }
+
+        // the buffer has to live until the send completes
+        inFlight.push_back(Pending());
+        Pending &pending = inFlight.back();
+        pending.rays.swap(outgoing[rank]);
+        refill(rank);
+
+        int status = MPI_Isend(pending.rays.data(), int(pending.rays.size()), MPI_BYTE,
+                               rank, tag, MPI_COMM_WORLD, &pending.request);
+        if (status != 0) {
+            printf("Fail to send a ray batch!\n");
+            throw std::exception();
+        }
+        numSent++;
+    }
+
+    void azRayExchange::refill(int rank)
+    {
+        if (spare.empty()) {
+            outgoing[rank].reserve(batchSize * raySize);
+            return;
+        }
+        outgoing[rank].swap(spare.back());
+        spare.pop_back();
+    }
+
+    void azRayExchange::recycle(std::vector<unsigned char> &batch)
+    {
+        // end batches have no buffer to keep
+        if (batch.capacity() == 0) {
+            return;
+        }
+        batch.clear();
+        spare.push_back(std::vector<unsigned char>());
+        spare.back().swap(batch);
+    }
+
+    bool azRayExchange::testSends()
+    {
+        std::list<Pending>::iterator it = inFlight.begin();
+        while (it != inFlight.end())
+        {
+            int done = 0;
+            MPI_Test(&it->request, &done, MPI_STATUS_IGNORE);
+            if (done) {
+                recycle(it->rays);
+            }
+            it = done ? inFlight.erase(it) : ++it;
+        }
+        return inFlight.empty();
+    }
+
+    void azRayExchange::deliver(const std::vector<unsigned char> &batch)
+    {
+        unpacked.clear();
+        azUnpackRays(format, batch.data(), batch.size(), &unpacked);
+        consumer(unpacked.data(), unpacked.size());
+    }
+
+    void azRayExchange::poll()
+    {
+        std::vector<std::vector<unsigned char> > batches;
+        batches.swap(local);
+        for (size_t i = 0; i < batches.size(); i++) {
+            deliver(batches[i]);
+            recycle(batches[i]);
+        }
+
+        while (true)
+        {
+            int arrived = 0;
+            MPI_Status status;
+            MPI_Iprobe(MPI_ANY_SOURCE, tag, MPI_COMM_WORLD, &arrived, &status);
+            if (!arrived) {
+                break;
+            }
+
+            int bytes = 0;
+            MPI_Get_count(&status, MPI_BYTE, &bytes);
+            incoming.resize(bytes);
+            MPI_Recv(incoming.data(), bytes, MPI_BYTE, status.MPI_SOURCE, tag, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+            // an empty batch ends a node, messages between two nodes keep their order
+            if (incoming.empty()) {
+                ended++;
+            }
+            else {
+                deliver(incoming);
+            }
+        }
+
+        testSends();
+    }
+
+    void azRayExchange::finish()
+    {
+        for (int rank = 0; rank < procs; rank++) {
+            send(rank);
+        }
+        for (int rank = 0; rank < procs; rank++)
+        {
+            if (rank == procId) {
+                continue;
+            }
+            inFlight.push_back(Pending());
+            MPI_Isend(NULL, 0, MPI_BYTE, rank, tag, MPI_COMM_WORLD, &inFlight.back().request);
+        }
+
+        double start = MPI_Wtime();
+        poll();
+        while (ended < procs - 1 || !testSends() || !local.empty()) {
+            poll();
+        }
+        waited += MPI_Wtime() - start;
+    }
+
+}
@@ -0,0 +1,114 @@
+//
+//  azRayExchange.hpp
+//  Azurender
+//
+//  Streamed ray exchange between MPI nodes with non-blocking sends
+//
+
+#ifndef __Azurender__azRayExchange__
+#define __Azurender__azRayExchange__
+
+#include <mpi.h>
+#include <vector>
+#include <list>
+#include <cstddef>
+#include <functional>
+
+#include "scene/ray.hpp"
+#include "raytracer/azRayWire.hpp"
+
+namespace _462 {
+
+    /*!
+     @brief sends rays to other nodes in batches of a fixed size while the caller
+            keeps producing them, instead of one MPI_Alltoallv once all are made.
+            A batch goes out with MPI_Isend as soon as it is full; poll hands the
+            batches that arrived meanwhile to the consumer, so a node traces
+            incoming rays while its own are still in flight. Rays for the node
+            itself skip MPI. Rays are packed in format as they are queued, so a
+            batch is sent as it is, and the buffers of sent or delivered batches
+            are reused for the next ones. Every node has to create its exchanges in
+            the same order, each one gets its own tag.
+     */
+    class azRayExchange
+    {
+    public:
+
+        typedef std::function<void(const Ray *rays, size_t count)> Consumer;
+
+        azRayExchange(int procs, int procId, size_t batchSize, RayWireFormat format, const Consumer &consumer);
+
+        ~azRayExchange();
+
+        // queue a ray for node rank, its batch is sent once full
+        void push_back(int rank, const Ray &ray);
+
+        // hand every batch that arrived to the consumer, does not wait
+        void poll();
+
+        /*!
+         @brief send what is left and an empty end batch to every node, then
+                keep handing batches to the consumer until every node sent its
+                end and all sends of this node completed
+         */
+        void finish();
+
+        // seconds finish spent waiting for other nodes
+        double waitTime() const { return waited; }
+
+        size_t batchesSent() const { return numSent; }
+
+    private:
+
+        struct Pending
+        {
+            MPI_Request request;
+            std::vector<unsigned char> rays;
+        };
+
+        void send(int rank);
+
+        // unpack a batch and hand it to the consumer
+        void deliver(const std::vector<unsigned char> &batch);
+
+        // give node rank an empty batch buffer, a spare one if there is
+        void refill(int rank);
+
+        // keep the buffer of a batch that is done with for refill
+        void recycle(std::vector<unsigned char> &batch);
+
+        // drop the buffers of completed sends, true when none is left
+        bool testSends();
+
+        azRayExchange(const azRayExchange &);
+        azRayExchange &operator=(const azRayExchange &);
+
+        int procs;
+        int procId;
+        int tag;
+        size_t batchSize;
+        RayWireFormat format;
+        size_t raySize;             // bytes of a packed ray
+        Consumer consumer;
+
+        // packed rays queued per node, and sends still in flight
+        std::vector<std::vector<unsigned char> > outgoing;
+        std::list<Pending> inFlight;
+
+        // full batches for this node itself, handed over by the next poll
+        std::vector<std::vector<unsigned char> > local;
+
+        // emptied batch buffers, capacity kept
+        std::vector<std::vector<unsigned char> > spare;
+
+        std::vector<unsigned char> incoming;
+        std::vector<Ray> unpacked;
+        int ended;              // nodes whose end batch arrived
+
+        double waited;
+        size_t numSent;
+    };
+
+}
+
+#endif /* defined(__Azurender__azRayExchange__) */
@@ -0,0 +1,295 @@
+//
+//  azRayWire.cpp
+//  Azurender
+//
+//  Packed records for rays sent between MPI nodes
+//
+
+#include "azRayWire.hpp"
+
+#include "scene/ray.hpp"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
+namespace _462 {
+
+    struct EyeRayWire
+    {
+        float e[3];
+        unsigned short d[2];
+        float maxt;
+        unsigned int visited;
+        unsigned short x, y;
+        signed char depth;
+        char pad[3];
+    };
+
+    struct ShadowRayWire
+    {
+        float e[3];
+        unsigned short d[2];
+        float maxt;
+        float time;
+        unsigned short x, y;
+        unsigned short color[3];
+        signed char depth;
+        unsigned char lightIndex;
+    };
+
+    struct GIRayWire
+    {
+        float e[3];
+        unsigned short d[2];
+        float maxt;
+        unsigned int visited;
+        float time;
+        unsigned short x, y;
+        unsigned short color[3];
+        signed char depth;
+        char pad;
+    };
+
+    // IEEE half, rounded to nearest; NaN drops to zero, beyond the range clamps to the largest half
+    static unsigned short floatToHalf(float f)
+    {
+        if (!(f == f)) {
+            return 0;
+        }
+        unsigned short sign = f < 0 ? 0x8000 : 0;
+        float a = fabsf(f);
+        if (a >= 65504.0f) {
+            return sign | 0x7bff;
+        }
+        if (a < 6.103515625e-05f) {
+            // subnormal, steps of 2^-24
+            return sign | (unsigned short)floorf(a * 16777216.0f + 0.5f);
+        }
+
+        int exp;
+        float m = frexpf(a, &exp);              // a = m * 2^exp, 0.5 <= m < 1
+        unsigned int mantissa = (unsigned int)floorf((m * 2 - 1) * 1024 + 0.5f);
+        int biased = exp - 1 + 15;
+        if (mantissa == 1024) {
+            mantissa = 0;
+            biased++;
+        }
+        if (biased >= 31) {
+            return sign | 0x7bff;
+        }
+        return sign | (unsigned short)(biased << 10) | (unsigned short)mantissa;
+    }
+
+    static float halfToFloat(unsigned short h)
+    {
+        float sign = (h & 0x8000) ? -1.0f : 1.0f;
+        int biased = (h >> 10) & 0x1f;
+        int mantissa = h & 0x3ff;
+        if (biased == 0) {
+            return sign * ldexpf(float(mantissa), -24);
+        }
+        return sign * ldexpf(float(mantissa + 1024), biased - 25);
+    }
+
+    static void packColor(const Color3 &c, unsigned short out[3])
+    {
+        out[0] = floatToHalf(c.r);
+        out[1] = floatToHalf(c.g);
+        out[2] = floatToHalf(c.b);
+    }
+
+    static Color3 unpackColor(const unsigned short in[3])
+    {
+        return Color3(halfToFloat(in[0]), halfToFloat(in[1]), halfToFloat(in[2]));
+    }
+
+    // octahedral map as in Photon::setDirection, 16 bits per coordinate
+    static void packDirection(const Vector3 &dir, unsigned short out[2])
+    {
+        real_t l1 = fabs(dir.x) + fabs(dir.y) + fabs(dir.z);
+        real_t u = l1 > 0 ? dir.x / l1 : 0;
+        real_t v = l1 > 0 ? dir.y / l1 : 0;
+        if (dir.z < 0) {
+            // fold the lower half over the diagonals
+            real_t fu = (1 - fabs(v)) * (u >= 0 ? 1 : -1);
+            real_t fv = (1 - fabs(u)) * (v >= 0 ? 1 : -1);
+            u = fu;
+            v = fv;
+        }
+        out[0] = (unsigned short)floor((u * 0.5 + 0.5) * 65535 + 0.5);
+        out[1] = (unsigned short)floor((v * 0.5 + 0.5) * 65535 + 0.5);
+    }
+
+    static Vector3 unpackDirection(const unsigned short in[2])
+    {
+        real_t u = in[0] * (2.0 / 65535) - 1;
+        real_t v = in[1] * (2.0 / 65535) - 1;
+        real_t z = 1 - fabs(u) - fabs(v);
+        if (z < 0) {
+            real_t fu = (1 - fabs(v)) * (u >= 0 ? 1 : -1);
+            real_t fv = (1 - fabs(u)) * (v >= 0 ? 1 : -1);
+            u = fu;
+            v = fv;
+        }
+        return normalize(Vector3(u, v, z));
+    }
+
+    static void packOrigin(const Vector3 &e, float out[3])
+    {
+        out[0] = float(e.x);
+        out[1] = float(e.y);
+        out[2] = float(e.z);
+    }
+
+    static float packTime(real_t time)
+    {
+        return time < std::numeric_limits<float>::max() ? float(time) : std::numeric_limits<float>::infinity();
+    }
+
+    static real_t unpackTime(float time)
+    {
+        return std::isinf(time) ? std::numeric_limits<real_t>::max() : real_t(time);
+    }
+
+    // the float origin is off by less than 2^-23 of its largest coordinate, the
+    // offset is 4 times that, across the surface so no geometry along d is skipped
+    Vector3 azRayWireOrigin(const Vector3 &p, const Vector3 &n, const Vector3 &d)
+    {
+        real_t m = std::max(fabs(p.x), std::max(fabs(p.y), fabs(p.z)));
+        real_t offset = ldexp(m, -21);
+        return dot(n, d) < 0 ? p - n * offset : p + n * offset;
+    }
+
+    size_t azRayWireSize(RayWireFormat format)
+    {
+        switch (format)
+        {
+            case RayWire_Eye:       return sizeof(EyeRayWire);
+            case RayWire_Shadow:    return sizeof(ShadowRayWire);
+            case RayWire_GI:        return sizeof(GIRayWire);
+            default:                return sizeof(Ray);
+        }
+    }
+
+    void azPackRay(RayWireFormat format, const Ray &ray, unsigned char *out)
+    {
+        assert(format == RayWire_Full || (ray.x >= 0 && ray.x < 65536 && ray.y >= 0 && ray.y < 65536));
+        assert(format != RayWire_Shadow || (ray.lightIndex >= 0 && ray.lightIndex < 256));
+        switch (format)
+        {
+            case RayWire_Eye:
+            {
+                EyeRayWire w;
+                packOrigin(ray.e, w.e);
+                packDirection(ray.d, w.d);
+                w.maxt = ray.maxt;
+                w.visited = ray.visited;
+                w.x = (unsigned short)ray.x;
+                w.y = (unsigned short)ray.y;
+                w.depth = (signed char)ray.depth;
+                w.pad[0] = w.pad[1] = w.pad[2] = 0;
+                memcpy(out, &w, sizeof(w));
+                break;
+            }
+            case RayWire_Shadow:
+            {
+                ShadowRayWire w;
+                packOrigin(ray.e, w.e);
+                packDirection(ray.d, w.d);
+                w.maxt = ray.maxt;
+                w.time = packTime(ray.time);
+                w.x = (unsigned short)ray.x;
+                w.y = (unsigned short)ray.y;
+                packColor(ray.color, w.color);
+                w.depth = (signed char)ray.depth;
+                w.lightIndex = (unsigned char)ray.lightIndex;
+                memcpy(out, &w, sizeof(w));
+                break;
+            }
+            case RayWire_GI:
+            {
+                GIRayWire w;
+                packOrigin(ray.e, w.e);
+                packDirection(ray.d, w.d);
+                w.maxt = ray.maxt;
+                w.visited = ray.visited;
+                w.time = packTime(ray.time);
+                w.x = (unsigned short)ray.x;
+                w.y = (unsigned short)ray.y;
+                packColor(ray.color, w.color);
+                w.depth = (signed char)ray.depth;
+                w.pad = 0;
+                memcpy(out, &w, sizeof(w));
+                break;
+            }
+            default:
+                memcpy(out, &ray, sizeof(Ray));
+                break;
+        }
+    }
+
+    void azUnpackRays(RayWireFormat format, const unsigned char *in, size_t bytes, std::vector<Ray> *rays)
+    {
+        size_t size = azRayWireSize(format);
+        size_t count = bytes / size;
+        size_t first = rays->size();
+        rays->resize(first + count);
+
+        if (format == RayWire_Full) {
+            memcpy(&(*rays)[first], in, count * size);
+            return;
+        }
+
+        for (size_t i = 0; i < count; i++, in += size)
+        {
+            Ray &ray = (*rays)[first + i];
+            switch (format)
+            {
+                case RayWire_Eye:
+                {
+                    EyeRayWire w;
+                    memcpy(&w, in, sizeof(w));
+                    ray = Ray(Vector3(w.e[0], w.e[1], w.e[2]), unpackDirection(w.d));
+                    ray.maxt = w.maxt;
+                    ray.visited = w.visited;
+                    ray.x = w.x;
+                    ray.y = w.y;
+                    ray.depth = w.depth;
+                    break;
+                }
+                case RayWire_Shadow:
+                {
+                    ShadowRayWire w;
+                    memcpy(&w, in, sizeof(w));
+                    ray = Ray(Vector3(w.e[0], w.e[1], w.e[2]), unpackDirection(w.d));
+                    ray.maxt = w.maxt;
+                    ray.time = unpackTime(w.time);
+                    ray.x = w.x;
+                    ray.y = w.y;
+                    ray.color = unpackColor(w.color);
+                    ray.depth = w.depth;
+                    ray.lightIndex = w.lightIndex;
+                    break;
+                }
+                default:
+                {
+                    GIRayWire w;
+                    memcpy(&w, in, sizeof(w));
+                    ray = Ray(Vector3(w.e[0], w.e[1], w.e[2]), unpackDirection(w.d));
+                    ray.maxt = w.maxt;
+                    ray.visited = w.visited;
+                    ray.time = unpackTime(w.time);
+                    ray.x = w.x;
+                    ray.y = w.y;
+                    ray.color = unpackColor(w.color);
+                    ray.depth = w.depth;
+                    break;
+                }
+            }
+        }
+    }
+
+}
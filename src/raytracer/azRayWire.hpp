@@ -0,0 +1,59 @@
+//
+//  azRayWire.hpp
+//  Azurender
+//
+//  Packed records for rays sent between MPI nodes
+//
+
+#ifndef __Azurender__azRayWire__
+#define __Azurender__azRayWire__
+
+#include "math/vector.hpp"
+
+#include <vector>
+#include <cstddef>
+
+namespace _462 {
+
+    struct Ray;
+
+    /*!
+     @brief what a ray carries between nodes. A Ray is 120 bytes, double
+            origin and direction, a photon and fields most stages never read.
+            The packed formats keep a float origin, an octahedral direction
+            with 16 bits per coordinate, the pixel as two 16 bit ints and a
+            half float color:
+            Eye     32 bytes   origin, direction, pixel, depth, maxt, visited
+            Shadow  36 bytes   origin, direction, pixel, depth, maxt, time,
+                               color, light index
+            GI      40 bytes   as Eye and time, color
+            Full    the Ray as it is, for photons and gather queries
+            Unpacked rays get the defaults of Ray(e, d) for what is not sent.
+            The pixel has to fit in 16 bits and the light index in 8.
+            Shadow and gi rays start on a surface, a float origin may land on
+            its other side, so their origin comes from azRayWireOrigin.
+     */
+    enum RayWireFormat
+    {
+        RayWire_Full,
+        RayWire_Eye,
+        RayWire_Shadow,
+        RayWire_GI
+    };
+
+    // origin of a ray leaving surface point p with normal n along d, moved along n
+    // past the float rounding of p so the packed origin stays on the side d points to
+    Vector3 azRayWireOrigin(const Vector3 &p, const Vector3 &n, const Vector3 &d);
+
+    // bytes of one ray in format
+    size_t azRayWireSize(RayWireFormat format);
+
+    // write ray into the azRayWireSize(format) bytes at out
+    void azPackRay(RayWireFormat format, const Ray &ray, unsigned char *out);
+
+    // append the rays packed in bytes bytes at in to rays
+    void azUnpackRays(RayWireFormat format, const unsigned char *in, size_t bytes, std::vector<Ray> *rays);
+
+}
+
+#endif /* defined(__Azurender__azRayWire__) */
@@ -0,0 +1,206 @@
+//
+//  headless_main.cpp
+//  Azurender
+//
+//  Batch entry for render nodes: loads the scene, runs the distributed
+//  raytrace and writes the image, without SDL, a window or any GL data.
+//
+
+#include "application/imageio.hpp"
+#include "application/scene_loader.hpp"
+#include "scene/scene.hpp"
+#include "raytracer/raytracer.hpp"
+#include "raytracer/options.hpp"
+#include "raytracer/Utils.h"
+
+#include <stdlib.h>
+#include <iostream>
+#include <string>
+#include <chrono>
+
+#include <mpi.h>
+
+using namespace _462;
+
+/**
+ * Prints program usage.
+ */
+static void print_usage( const char* progname )
+{
+    std::cout << "Usage: " << progname <<
+    " input_scene [-n num_samples] [-d width height] [-o output_file]\n"
+    "\n" \
+    "Options:\n" \
+    "\n" \
+    "\t-d width height\n" \
+    "\t\tThe dimensions of image to raytrace. Defaults to width=800,\n" \
+    "\t\theight=600.\n" \
+    "\toutput_file:\n" \
+    "\t\tThe output file in which to write the rendered image.\n" \
+    "\t\tIf not specified, a default timestamped filename is used.\n" \
+    "\n";
+}
+
+/**
+ * Parses args into an Options struct. Returns true on success, false on failure.
+ * -r is accepted for compatibility with the windowed raytracer and ignored.
+ */
+static bool parse_args( Options* opt, int argc, char* argv[] )
+{
+    if ( argc < 2 ) {
+        print_usage( argv[0] );
+        return false;
+    }
+
+    opt->input_filename = argv[1];
+    opt->output_filename = NULL;
+    opt->open_window = false;
+    opt->width = DEFAULT_WIDTH;
+    opt->height = DEFAULT_HEIGHT;
+    opt->num_samples = 1;
+    for (int i = 2; i < argc; i++)
+    {
+        switch (argv[i][1])
+        {
+            case 'd':
+                if (i >= argc - 2) return false;
+                opt->width = atoi(argv[++i]);
+                opt->height = atoi(argv[++i]);
+                // check for valid width/height
+                if ( opt->width < 1 || opt->height < 1 )
+                {
+                    std::cout << "Invalid image dimensions\n";
+                    return false;
+                }
+                break;
+            case 'r':
+                break;
+            case 'n':
+                if (i < argc - 1)
+                    opt->num_samples = atoi(argv[++i]);
+                break;
+            case 'o':
+                if (i < argc - 1)
+                    opt->output_filename = argv[++i];
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Loads texture and mesh data only, create_gl_data is never called here.
+ */
+static bool load_scene_data( Scene* scene )
+{
+    try {
+        Material* const* materials = scene->get_materials();
+        Mesh* const* meshes = scene->get_meshes();
+
+        for ( size_t i = 0; i < scene->num_materials(); ++i )
+        {
+            if ( !materials[i]->load() )
+            {
+                std::cout << "Error loading texture, aborting.\n";
+                return false;
+            }
+        }
+
+        for ( size_t i = 0; i < scene->num_meshes(); ++i )
+        {
+            if ( !meshes[i]->load() )
+            {
+                std::cout << "Error loading mesh, aborting.\n";
+                return false;
+            }
+        }
+    }
+    catch ( std::bad_alloc const& )
+    {
+        std::cout << "Out of memory error while initializing scene\n.";
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    Options opt;
+
+    MPI_Init(NULL, NULL);
+
+    int world_size;
+    MPI_Comm_size(MPI_COMM_WORLD, & world_size);
+
+    int world_rank;
+    MPI_Comm_rank(MPI_COMM_WORLD, & world_rank);
+
+    if ( !parse_args( &opt, argc, argv ) ) {
+        MPI_Finalize();
+        return 1;
+    }
+
+    Scene scene;
+    if (world_size > 1)
+    {
+        scene.node_size = world_size;
+        scene.node_rank = world_rank;
+    }
+
+    if ( !load_scene( &scene, opt.input_filename ) || !load_scene_data( &scene ) ) {
+        std::cout << "Error loading scene "
+        << opt.input_filename << ". Aborting.\n";
+        MPI_Finalize();
+        return 1;
+    }
+
+    FrameBuffer buffer;
+    buffer.init();
+    buffer.alloc(opt.width, opt.height);
+
+    scene.camera.aspect = real_t( opt.width ) / real_t( opt.height );
+
+    Raytracer raytracer;
+    if ( !raytracer.initialize( &scene, opt.num_samples, opt.width, opt.height ) ) {
+        std::cout << "Raytracer initialization failed.\n";
+        buffer.dealloc();
+        MPI_Finalize();
+        return 1;
+    }
+
+    unsigned char *dibuffer = (unsigned char *)malloc(BUFFER_SIZE(opt.width, opt.height));
+    unsigned char *gibuffer = (unsigned char *)malloc(BUFFER_SIZE(opt.width, opt.height));
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    raytracer.mpiTrace( buffer, dibuffer, gibuffer, 0 );
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    printf("Total Time = %f seconds\n", std::chrono::duration<double>(end - start).count());
+
+    if (scene.node_rank == 0)
+    {
+        static const size_t MAX_LEN = 256;
+        char buf[MAX_LEN];
+        std::string filename;
+        if (opt.output_filename) {
+            filename = opt.output_filename;
+        }
+        else {
+            imageio_gen_name(buf, MAX_LEN);
+            filename = buf;
+        }
+
+        if (imageio_save_image(filename.c_str(), dibuffer, opt.width, opt.height)) {
+            std::cout << "Saved raytraced image to '" << filename << "'.\n";
+        } else {
+            std::cout << "Error saving raytraced image to '" << filename << "'.\n";
+        }
+    }
+
+    free(dibuffer);
+    free(gibuffer);
+    buffer.dealloc();
+
+    MPI_Finalize();
+    return 0;
+}
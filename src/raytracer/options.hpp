@@ -0,0 +1,34 @@
+//
+//  options.hpp
+//  Azurender
+//
+//  Command line options shared by the windowed and the headless raytracer
+//
+
+#ifndef __Azurender__options__
+#define __Azurender__options__
+
+namespace _462 {
+
+#define DEFAULT_WIDTH 800
+#define DEFAULT_HEIGHT 600
+
+    /**
+     * Struct of the program options.
+     */
+    struct Options
+    {
+        // whether to open a window or just render without one
+        bool open_window;
+        // not allocated, pointed it to something static
+        const char* input_filename;
+        // not allocated, pointed it to something static
+        const char* output_filename;
+        // window dimensions
+        int width, height;
+        int num_samples;
+    };
+
+}
+
+#endif /* defined(__Azurender__options__) */
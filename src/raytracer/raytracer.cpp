@@ -9,6 +9,9 @@
 #include "math/math.hpp"
 
 #include "raytracer/azReflection.hpp"
+#include "raytracer/azPhotonGather.hpp"
+#include "raytracer/azMorton.hpp"
+#include "raytracer/azParallel.hpp"
 #include "raytracer/constants.h"
 
 #include "scene/scene.hpp"
@@ -19,8 +22,9 @@
 #include "utils/Parallel.h"
 #include <mpi.h>
 
-#include <SDL_timer.h>
 #include <iostream>
+#include <algorithm>
+#include <functional>
 
 #include "ray_list.hpp"
 
@@ -35,6 +39,36 @@
 #define INDIRECT_PHOTON_NEEDED      500000      // 200000   // 500000
 #define CAUSTICS_PHOTON_NEEDED      200000      // 50000    // 200000
 
+// photon scatter hands out emissions in batches, each traced with its own seed
+#define PHOTON_BATCH_SIZE           256         // emissions per light and batch
+#define PHOTON_EMISSION_LIMIT       (4 * (INDIRECT_PHOTON_NEEDED + CAUSTICS_PHOTON_NEEDED))
+
+// caustic photons of point lights only go where a projection map saw specular surfaces.
+// Off until measured: the targeted half comes on top of the uniform one, on dragon_glass
+// a scatter took 26 s instead of 16.8 s and no quality gain was recorded
+#define ENABLE_PROJECTION_MAPS      false
+#define PROJECTION_MAP_ROWS         (64)        // cells in cos(theta), twice as many in phi
+#define PROJECTION_MAP_SAMPLES      (3)         // rays per cell and axis
+
+// emissions pick their light by the flux of its photons instead of going round the lights
+#define ENABLE_LIGHT_POWER_CDF      true
+
+// photon emissions per light and node in a round of the distributed scatter
+#define MPI_PHOTON_ROUND_SIZE       (16 * PHOTON_BATCH_SIZE)
+
+// mpiTrace streams rays between the nodes in batches with non-blocking sends
+// and traces them as they arrive, instead of one blocking exchange per stage
+#define ENABLE_ASYNC_RAY_EXCHANGE   true
+#define MPI_RAY_BATCH_SIZE          (256)       // rays per batch and node
+
+// eye and gi rays go to the node whose box they enter first and move on only
+// while a box not traced yet is entered before the nearest hit, instead of a
+// copy for every node they cross; needs at most 32 nodes, see Ray::visited.
+// Gi comes out brighter than broadcast (dragon_glass mean 27.0 vs 26.5):
+// broadcast also shades hits behind the nearest one, their shadow rays tie on
+// depth and the merge takes the shadowed one of a tie
+#define ENABLE_RAY_FORWARDING       true
+
 #define NUM_SAMPLE_PER_LIGHT        1           // if I do so many times of raytracing, i dont need high number of samples
 
 // Gaussian filter constants
@@ -45,8 +79,37 @@
 
 #define TOTAL_ITERATION                 100  // 300
 #define SMALL_NODE_GRANULARITY          128
+#define VVH_BINS                        32      // split candidates per axis for small nodes
+#define VVH_PARALLEL_GRANULARITY        16384   // photons per worker before a level is split up
+#define BALANCE_PARALLEL_GRANULARITY    65536   // photons in a subtree before it gets its own thread
 
 #define PHOTON_QUERY_RADIUS             (0.000375)     // 0.000272
+#define PHOTON_GATHER_NUM               (64)           // k of the nearest neighbour gather
+#define ENABLE_GATHER_BENCHMARK         false          // time the SIMD leaf scan after each kd-tree build
+
+// gather photons from hashed grids instead of the VVH kd-trees, the cells are
+// sized for PHOTON_QUERY_RADIUS so a gather scans at most 8 of them
+#define ENABLE_PHOTON_GRID              false
+#define PHOTON_GRID_CELL_SIZE           (2 * sqrt(PHOTON_QUERY_RADIUS))
+
+// sort photons in Morton order before the grids are built, so the colour and direction
+// fetched for a cell are close; the kd-tree build leaves them in leaf order anyway.
+// Costs about 150 ms per build, no gain measured yet
+#define ENABLE_PHOTON_REORDER           false
+
+// Christensen's precomputed irradiance: after the trees are built, the photon estimate
+// of both maps is stored at every IRRADIANCE_PHOTON_STRIDE-th photon, shading then
+// takes the nearest of those instead of gathering PHOTON_GATHER_NUM photons per map
+#define ENABLE_PRECOMPUTED_IRRADIANCE   false
+#define IRRADIANCE_PHOTON_STRIDE        (4)
+#define IRRADIANCE_LOOKUP_NUM           (4)     // candidates for one facing the normal
+
+// stochastic progressive photon mapping, with ENABLE_PHOTON_MAPPING: the photons of a
+// pass go to per pixel visible points whose radius shrinks, PHOTON_QUERY_RADIUS is
+// only the initial radius
+#define ENABLE_SPPM                     false
+#define SPPM_ALPHA                      (0.7)   // fraction of new photons kept each pass
+#define SPPM_FLUX_SCALE                 (2.0 * 25 / (CAUSTICS_PHOTON_NEEDED + INDIRECT_PHOTON_NEEDED))  // as in shade
 #define TWO_MUL_RADIUS                  (0.00075)
 #define FOUR_BY_THREE                   (1.333333)
 #define SPHERE_VOLUME                   (2.21e-10)
@@ -57,10 +120,31 @@
 #define ENABLE_PATH_TRACING_GI          false
 #define PT_GI_SAMPLE                    (1)
 
+// interpolate first bounce diffuse GI from sparse irradiance records
+#define ENABLE_IRRADIANCE_CACHE         false
+#define IRRADIANCE_CACHE_THETA          (8)     // hemisphere strata in theta
+#define IRRADIANCE_CACHE_PHI            (24)    // hemisphere strata in phi, about PI * theta
+
 #define ENABLE_PHOTON_MAPPING           false
 #define C_PHOTON_MODE                   1
 #define SIMPLE_SMALL_NODE               1
 
+// reuse primary hits across progressive passes, only valid for a static camera
+#define ENABLE_GBUFFER_CACHE            false
+
+// progressive passes trace a row or tile of pixels at once and gather the photons
+// of all their primary hits in one shade_cphotons_batch sweep
+#define BATCH_PRIMARY_GATHER            (ENABLE_PHOTON_MAPPING && C_PHOTON_MODE && !ENABLE_SPPM && !ENABLE_DOF)
+
+// edge-aware a-trous filter on the progressive and MPI output buffers
+#define ENABLE_DENOISER                 false
+
+// interactive preview: the first pass goes from 1/(step*step) of the pixels to full
+// resolution, tiles are traced centre first and published in chunks
+#define PREVIEW_COARSE_STEP             (4)     // 1/16th of the pixels, must divide the tile size
+#define PREVIEW_TILE_SIZE               (32)
+#define PREVIEW_PUBLISH_CHUNKS          (4)     // publishes per stage
+
 #define ENABLE_DOF                      false
 #define DOF_T                           (9.2f)
 #define DOF_R                           (0.6f)
@@ -79,15 +163,22 @@ namespace _462 {
     static const unsigned STEP_SIZE = 16;
 
     Raytracer::Raytracer()
-    : scene(0), width(0), height(0) { }
+    : acc_cphoton_search_time(0), acc_iphoton_search_time(0), raytraceColorBuffer(0),
+      previewCancel(false), previewRestart(false), previewRunning(false), previewNextTile(0), previewChunkEnd(0),
+      previewChunk(0), previewBusy(0), previewPoolStop(false), previewFrame(0), previewStep(1), previewRefine(false),
+      previewBack(0), previewFront(0), previewMiddle(0),
+      scene(0), width(0), height(0) { }
 
     // random real_t in [0, 1)
     static inline real_t random()
     {
-        return real_t(rand())/RAND_MAX;
+        return random_uniform();
     }
 
-    Raytracer::~Raytracer() { }
+    Raytracer::~Raytracer()
+    {
+        stopPreview();
+    }
 
     /**
      * Initializes the raytracer for the given scene. Overrides any previous
@@ -117,24 +208,17 @@ namespace _462 {
 
         current_row = 0;
         num_iteration = 1;  //
+        num_scatter = 0;
+        photon_trees_stale = false;
+
+        // built again by the first scatter, for the lights and geometry of this scene
+        projection_maps.clear();
 
         Ray::init(scene->camera);
         scene->initialize();
 
-        //----------------------------------------
-        // initialize direction conversion tables, from Jensen's implementation
-        //----------------------------------------
-        for (int i = 0; i < 256; i++)
-        {
-            double angle = double(i) * (1.0/256.0) * M_PI;
-            costheta[i] = cos( angle );
-            sintheta[i] = sin( angle );
-            cosphi[i]   = cos( 2.0 * angle );
-            sinphi[i]   = sin( 2.0 * angle );
-        }
-
         // Construction of BVH tree and bounding volumes
-        int start_time = SDL_GetTicks();
+        int start_time = azGetTicks();
 
         // Initialization of bounding boxes
         for (size_t i = 0; i < scene->num_geometries(); i++) {
@@ -153,7 +237,7 @@ namespace _462 {
         acc_kdtree_cons = 0;
 
 
-        int end_time = SDL_GetTicks();
+        int end_time = azGetTicks();
         int time_diff = end_time - start_time;
         printf("construct BVH time: %d ms\n", time_diff);
 
@@ -163,21 +247,62 @@ namespace _462 {
             raytraceColorBuffer[i] = Color3::Black();
         }
 
+#if ENABLE_GBUFFER_CACHE
+        // fixed set of jitter patterns, every pass cycles through them
+        gbufferJitter.resize(2 * GBUFFER_JITTER_PATTERNS);
+        for (size_t i = 0; i < gbufferJitter.size(); i++) {
+            gbufferJitter[i] = random();
+        }
+        gbuffer.resize(GBUFFER_JITTER_PATTERNS * width * height);
+        invalidateGBuffer();
+#endif
+
+#if ENABLE_DENOISER
+        denoiser.resize(width, height);
+#endif
+
+#if ENABLE_IRRADIANCE_CACHE
+        // octree covers the whole scene, radii are relative to its extent
+        BndBox sceneBndBox;
+        for (size_t i = 0; i < scene->num_geometries(); i++) {
+            sceneBndBox.include(scene->get_geometries()[i]->bbox_world);
+        }
+        real_t sceneExtent = length(sceneBndBox.pMax - sceneBndBox.pMin);
+        irradianceCache.minRadius = sceneExtent * 0.001;
+        irradianceCache.maxRadius = sceneExtent * 0.1;
+        irradianceCache.reset(sceneBndBox);
+#endif
+
 
 
 //        cout<<sizeof(Intersection)<<endl;
 
 
         // test:
-        printf("c photon size = %ld, photon size = %ld, Vector3 size = %ld, Color size = %ld, TP size = %ld\n", sizeof(cPhoton),sizeof(Photon), sizeof(Vector3), sizeof(Color3), sizeof(unsigned char));
+        printf("photon size = %ld, Vector3 size = %ld, Color size = %ld, TP size = %ld\n", sizeof(Photon), sizeof(Vector3), sizeof(Color3), sizeof(unsigned char));
         // test end
 
 #if ENABLE_PHOTON_MAPPING
+    #if ENABLE_SPPM
+            // photons are scattered after each camera pass, once its visible points are known
+            sppm.reset(width * height, PHOTON_QUERY_RADIUS, SPPM_ALPHA);
+    #else
+        #if C_PHOTON_MODE
+            // with more than one node every node holds only part of the geometry
+            if (scene->node_size > 1) {
+                mpiStagePhotonScatter(scene->node_size, scene->node_rank);
+            }
+            else {
+                parallelPhotonScatter(scene);
+            }
+        #else
             parallelPhotonScatter(scene);
-    #if C_PHOTON_MODE
+        #endif
+        #if C_PHOTON_MODE
             cPhotonKDTreeConstruction();
-    #else
+        #else
             kdtreeConstruction();
+        #endif
     #endif
 
 #endif
@@ -187,182 +312,596 @@ namespace _462 {
     // scatter photons
     void Raytracer::photonScatter(const Scene* scene)
     {
-        photon_indirect_list.clear();
-        photon_caustic_list.clear();
+        unsigned int start = azGetTicks();
 
-        // assuming there is only one light source
-//        SphereLight l = scene->get_lights()[0];
+        scatterPhotonBatches(scene, 1);
 
-        unsigned int start = SDL_GetTicks();
+        unsigned int end = azGetTicks();
+        printf("Finished Scattering : %d ms, indirect num = %ld, caustic num = %ld\n",
+               end - start, photon_indirect_list.size(), photon_caustic_list.size());
 
-        // scatter indirect
-        while ((photon_indirect_list.size() < INDIRECT_PHOTON_NEEDED))
-        {
-            //            Vector3 p = samplePointOnUnitSphere();
-            //            Ray photonRay = Ray(p + l.position, p);
-            for (size_t i = 0; i < scene->num_lights(); i++) {
-                Light *aLight = scene->get_lights()[i];
-                Ray photonRay = aLight->getRandomRayFromLight();
-                photonRay.photon.mask = 0;
-                photonRay.photon.setColor(aLight->color);
-                photonTrace(photonRay, EPSILON, TMAX, PHOTON_TRACE_DEPTH);
+        // balance straight into the trees, their storage is reused from the last pass
+        kdtree_photon_indirect_list.resize(photon_indirect_list.size() + 1);
+        kdtree_photon_caustic_list.resize(photon_caustic_list.size() + 1);
+
+        start = azGetTicks();
+        balance(1, kdtree_photon_indirect_list, photon_indirect_list, 0, photon_indirect_list.size());
+        end = azGetTicks();
+        printf("Finished Balancing Indirect : %d ms\n", end - start);
+
+        start = azGetTicks();
+        balance(1, kdtree_photon_caustic_list, photon_caustic_list, 0, photon_caustic_list.size());
+        end = azGetTicks();
+        printf("Finished Balancing Caustics : %d ms\n", end - start);
+
+        printf("Finished Balancing!\n");
+    }
+
+    bool Raytracer::parallelPhotonScatter(const Scene* scene)
+    {
+        unsigned int start = azGetTicks();
+
+        if (!scatterPhotonBatches(scene, MAX_THREADS_SCATTER)) {
+            printf("Parallel Scattering interrupted after %d ms\n", azGetTicks() - start);
+            return false;
+        }
+
+        unsigned int end = azGetTicks();
+        printf("Finished Parallel Scattering : %d ms, indirect num = %ld, caustic num = %ld\n",
+               end - start, photon_indirect_list.size(), photon_caustic_list.size());
+        return true;
+    }
+
+    // mix scatter and batch index into a seed, neighbouring batches get unrelated streams
+    static inline unsigned int photonBatchSeed(unsigned int seed, unsigned int batch)
+    {
+        unsigned int h = seed * 0x9E3779B9u ^ batch;
+        h ^= h >> 16;
+        h *= 0x85EBCA6Bu;
+        h ^= h >> 13;
+        h *= 0xC2B2AE35u;
+        h ^= h >> 16;
+        return h;
+    }
+
+    /**
+     * Scatter photons until both maps are full. Workers claim batches of emissions
+     * and store into their own lists; a batch only stores what the finished batches
+     * before it leave missing, the merge then concatenates batches in index order.
+     */
+    bool Raytracer::scatterPhotonBatches(const Scene* scene, size_t num_workers)
+    {
+        PhotonScatterQuota quota;
+        quota.next_batch = 0;
+        quota.done = false;
+        quota.seed = ++num_scatter;
+
+        size_t emissions_per_batch = PHOTON_BATCH_SIZE * std::max(scene->num_lights(), size_t(1));
+        quota.batch_limit = (PHOTON_EMISSION_LIMIT + emissions_per_batch - 1) / emissions_per_batch;
+        quota.batch_indirect.assign(quota.batch_limit, 0);
+        quota.batch_caustics.assign(quota.batch_limit, 0);
+        quota.batch_finished.assign(quota.batch_limit, false);
+        quota.prefix_batches = 0;
+        quota.prefix_indirect = 0;
+        quota.prefix_caustics = 0;
+
+#if ENABLE_PROJECTION_MAPS
+        // lights and geometry do not move, the maps of the first scatter are kept
+        if (projection_maps.size() != scene->num_lights()) {
+            buildProjectionMaps(scene);
+        }
+#endif
+
+#if ENABLE_LIGHT_POWER_CDF
+        buildLightDistributions(scene);
+#endif
+
+        std::vector<PhotonScatterData> workerData(num_workers);
+        for (size_t i = 0; i < num_workers; i++) {
+            workerData[i].worker_lights_copy.assign(scene->get_lights(), scene->get_lights() + scene->num_lights());
+            workerData[i].quota = &quota;
+        }
+
+        if (num_workers == 1) {
+            photonScatterWorker(&workerData[0]);
+        }
+        else {
+            std::vector<std::thread> workers;
+            for (size_t i = 0; i < num_workers; i++) {
+                workers.push_back(std::thread(&Raytracer::photonScatterWorker, this, &workerData[i]));
+            }
+            for (size_t i = 0; i < num_workers; i++) {
+                workers[i].join();
             }
         }
 
+        // the photons of an interrupted scatter are incomplete, the old lists and trees stay in use
+        if (previewInterrupted()) {
+            return false;
+        }
+
+        if (quota.prefix_indirect < INDIRECT_PHOTON_NEEDED || quota.prefix_caustics < CAUSTICS_PHOTON_NEEDED) {
+            printf("Photon scatter stopped after %d emissions, indirect = %ld, caustics = %ld\n",
+                   PHOTON_EMISSION_LIMIT, quota.prefix_indirect, quota.prefix_caustics);
+        }
 
-        unsigned int end = SDL_GetTicks();
-        printf("Finished Scattering Indirect : %d ms\n", end - start);
+        // (batch index, worker) of every traced batch, merged in batch order
+        std::vector<std::pair<unsigned int, size_t> > order;
+        for (size_t i = 0; i < num_workers; i++) {
+            for (size_t j = 0; j < workerData[i].worker_batches.size(); j++) {
+                order.push_back(std::make_pair(workerData[i].worker_batches[j].index, i * quota.batch_limit + j));
+            }
+        }
+        std::sort(order.begin(), order.end());
 
-        start = SDL_GetTicks();
+        photon_trees_stale = true;
+        photon_indirect_list.clear();
+        photon_caustic_list.clear();
+        photon_indirect_list.reserve(std::min(quota.prefix_indirect, size_t(INDIRECT_PHOTON_NEEDED)));
+        photon_caustic_list.reserve(std::min(quota.prefix_caustics, size_t(CAUSTICS_PHOTON_NEEDED)));
 
-        // scatter cautics
-        while ((photon_caustic_list.size() < CAUSTICS_PHOTON_NEEDED))
+        for (size_t k = 0; k < order.size(); k++)
         {
-            for (size_t i = 0; i < scene->num_lights(); i++) {
-                Light *aLight = scene->get_lights()[i];
-                Ray photonRay = aLight->getRandomRayFromLight();//getPhotonEmissionRayFromLight(aLight);
-                photonRay.photon.mask = 0;
-                photonRay.photon.setColor(aLight->color);
-                photonTrace(photonRay, EPSILON, TMAX, PHOTON_TRACE_DEPTH);
+            PhotonScatterData &data = workerData[order[k].second / quota.batch_limit];
+            size_t j = order[k].second % quota.batch_limit;
+            const PhotonBatch &batch = data.worker_batches[j];
+            size_t indirectBegin = j > 0 ? data.worker_batches[j - 1].indirect_end : 0;
+            size_t causticsBegin = j > 0 ? data.worker_batches[j - 1].caustics_end : 0;
+
+            size_t indirectEnd = std::min(batch.indirect_end,
+                                          indirectBegin + (INDIRECT_PHOTON_NEEDED - photon_indirect_list.size()));
+            size_t causticsEnd = std::min(batch.caustics_end,
+                                          causticsBegin + (CAUSTICS_PHOTON_NEEDED - photon_caustic_list.size()));
+            photon_indirect_list.insert(photon_indirect_list.end(),
+                                        data.worker_photon_indirect.begin() + indirectBegin,
+                                        data.worker_photon_indirect.begin() + indirectEnd);
+            photon_caustic_list.insert(photon_caustic_list.end(),
+                                       data.worker_photon_caustics.begin() + causticsBegin,
+                                       data.worker_photon_caustics.begin() + causticsEnd);
+        }
+        return true;
+    }
+
+    void Raytracer::photonScatterWorker(PhotonScatterData *data)
+    {
+        PhotonScatterQuota *quota = data->quota;
 
+        while (!quota->done)
+        {
+            // the camera of the preview moved or it was stopped, no point in finishing
+            if (previewInterrupted()) {
+                quota->done = true;
+                break;
             }
-            //            Vector3 p = samplePointOnUnitSphere();
-            //            Ray photonRay = Ray(p + l.position, p);
-//            Ray photonRay = getPhotonEmissionRayFromLight(scene->get_lights()[0]);
-//            // Make color only the portion of light
-//            photonRay.photon.mask = 0;
-//            photonRay.photon.setColor(l->color);// * (real_t(1)/(real_t)(CAUSTICS_PHOTON_NEEDED + INDIRECT_PHOTON_NEEDED));
-//            photonTrace(photonRay, EPSILON, TMAX, PHOTON_TRACE_DEPTH);
-        }
 
+            unsigned int batch = quota->next_batch.fetch_add(1);
+            if (batch >= quota->batch_limit) {
+                quota->done = true;
+                break;
+            }
+
+            // the finished prefix stores at most what all batches before this one do,
+            // so capping here never drops a photon the merge keeps
+            {
+                std::lock_guard<std::mutex> guard(quota->lock);
+                data->indirect_needed = quota->prefix_indirect < INDIRECT_PHOTON_NEEDED ?
+                                        INDIRECT_PHOTON_NEEDED - quota->prefix_indirect : 0;
+                data->caustics_needed = quota->prefix_caustics < CAUSTICS_PHOTON_NEEDED ?
+                                        CAUSTICS_PHOTON_NEEDED - quota->prefix_caustics : 0;
+            }
+            if (data->indirect_needed == 0 && data->caustics_needed == 0) {
+                quota->done = true;
+                break;
+            }
 
-        end = SDL_GetTicks();
-        printf("Finished Scattering Caustics : %d ms\n", end - start);
+            size_t indirectBegin = data->worker_photon_indirect.size();
+            size_t causticsBegin = data->worker_photon_caustics.size();
+            size_t numLights = data->worker_lights_copy.size();
+
+#if ENABLE_PROJECTION_MAPS
+            // uniform emissions fill the indirect map, and the caustics map for lights
+            // without a projection map; targeted emissions then fill the caustics map.
+            // Each half has its own seed and is skipped once the finished batches before
+            // it filled its map, the merge would drop all it stores anyway.
+            std::vector<size_t> targeted;
+            for (size_t i = 0; i < projection_maps.size(); i++) {
+                if (!projection_maps[i].empty()) {
+                    targeted.push_back(i);
+                }
+            }
+            bool untargeted = targeted.size() < numLights;
+            if (data->indirect_needed > 0 || (data->caustics_needed > 0 && untargeted))
+            {
+                random_seed(photonBatchSeed(quota->seed, batch));
+                for (size_t e = 0; e < PHOTON_BATCH_SIZE * numLights; e++)
+                {
+                    real_t fluxScale;
+                    size_t i = pickEmissionLight(e, numLights, &fluxScale);
+                    Light *aLight = data->worker_lights_copy[i];
+                    Ray photonRay = aLight->getRandomRayFromLight();
+                    photonRay.photon.mask = 0;
+                    photonRay.photon.setColor(aLight->color * fluxScale);
+
+                    unsigned int causticsNeeded = data->caustics_needed;
+                    if (!projection_maps[i].empty()) {
+                        data->caustics_needed = 0;
+                    }
+                    photonTrace(photonRay, EPSILON, TMAX, PHOTON_TRACE_DEPTH, data);
+                    if (!projection_maps[i].empty()) {
+                        data->caustics_needed = causticsNeeded;
+                    }
+                }
+            }
 
-        printf("Finished Scattering, indirect num = %ld, caustic num = %ld\n", photon_indirect_list.size(), photon_caustic_list.size());
+            unsigned int indirectNeeded = data->indirect_needed;
+            if (data->caustics_needed > 0 && !targeted.empty())
+            {
+                // a targeted photon has the flux of a uniform one: its direction is uniform
+                // over the marked cells, so the caustic photons it stores are distributed
+                // as those of uniform emission, only 1 / coverage times fewer emissions
+                // are needed for them. Both maps are estimated by flux over area, not
+                // normalized by emission count, so no further weight applies.
+                random_seed(photonBatchSeed(~quota->seed, batch));
+                data->indirect_needed = 0;
+                for (size_t e = 0; e < PHOTON_BATCH_SIZE * targeted.size(); e++)
+                {
+    #if ENABLE_LIGHT_POWER_CDF
+                    size_t i = caustic_lights.sample(random());
+                    real_t fluxScale = real_t(1) / (targeted.size() * caustic_lights.pmf(i));
+    #else
+                    size_t i = targeted[e % targeted.size()];
+                    real_t fluxScale = 1;
+    #endif
+                    Light *aLight = data->worker_lights_copy[i];
+                    real_t u0 = random(), u1 = random(), u2 = random();
+                    Ray photonRay = Ray(aLight->position, projection_maps[i].sampleDirection(u0, u1, u2));
+                    photonRay.photon.mask = 0;
+                    photonRay.photon.setColor(aLight->color * fluxScale);
+                    photonTrace(photonRay, EPSILON, TMAX, PHOTON_TRACE_DEPTH, data);
+                }
+                data->indirect_needed = indirectNeeded;
+            }
+#else
+            random_seed(photonBatchSeed(quota->seed, batch));
 
-        std::vector<Photon> tmp_indirect(photon_indirect_list.size() + 1);
-        std::vector<Photon> tmp_caustic(photon_caustic_list.size() + 1);
+            for (size_t e = 0; e < PHOTON_BATCH_SIZE * numLights; e++)
+            {
+                real_t fluxScale;
+                size_t i = pickEmissionLight(e, numLights, &fluxScale);
+                Light *aLight = data->worker_lights_copy[i];
+                Ray photonRay = aLight->getRandomRayFromLight();
+                photonRay.photon.mask = 0;
+                photonRay.photon.setColor(aLight->color * fluxScale);
+                photonTrace(photonRay, EPSILON, TMAX, PHOTON_TRACE_DEPTH, data);
+            }
+#endif
 
-        start = SDL_GetTicks();
-        balance(1, tmp_indirect, photon_indirect_list);
-        end = SDL_GetTicks();
-        printf("Finished Balancing Indirect : %d ms\n", end - start);
+            PhotonBatch record;
+            record.index = batch;
+            record.indirect_end = data->worker_photon_indirect.size();
+            record.caustics_end = data->worker_photon_caustics.size();
+            data->worker_batches.push_back(record);
+
+            std::lock_guard<std::mutex> guard(quota->lock);
+            quota->batch_indirect[batch] = record.indirect_end - indirectBegin;
+            quota->batch_caustics[batch] = record.caustics_end - causticsBegin;
+            quota->batch_finished[batch] = true;
+            while (quota->prefix_batches < quota->batch_limit && quota->batch_finished[quota->prefix_batches])
+            {
+                quota->prefix_indirect += quota->batch_indirect[quota->prefix_batches];
+                quota->prefix_caustics += quota->batch_caustics[quota->prefix_batches];
+                quota->prefix_batches++;
+            }
+            if (quota->prefix_indirect >= INDIRECT_PHOTON_NEEDED && quota->prefix_caustics >= CAUSTICS_PHOTON_NEEDED) {
+                quota->done = true;
+            }
+        }
+    }
 
-        start = SDL_GetTicks();
-        balance(1, tmp_caustic, photon_caustic_list);
-        end = SDL_GetTicks();
-        printf("Finished Balancing Caustics : %d ms\n", end - start);
+    // mean color of a light, the flux its photons start with, lights without any still get an equal share
+    void Raytracer::buildLightDistributions(const Scene* scene)
+    {
+        std::vector<real_t> lightPower(scene->num_lights()), causticPower(scene->num_lights(), 0);
+        for (size_t i = 0; i < scene->num_lights(); i++)
+        {
+            // photons carry the color only, not Power(), so the pdf must not weigh the intensity in
+            const Light *light = scene->get_lights()[i];
+            lightPower[i] = (light->color.r + light->color.g + light->color.b) * (real_t(1) / 3);
+            // targeted emissions only cover the marked directions of the light
+            if (i < projection_maps.size()) {
+                causticPower[i] = lightPower[i] * projection_maps[i].coverage();
+            }
+        }
+        emission_lights.build(lightPower);
+        if (emission_lights.empty()) {
+            emission_lights.build(std::vector<real_t>(scene->num_lights(), 1));
+        }
+        caustic_lights.build(causticPower);
+    }
 
+    /**
+     * Light of emission e of a batch of numLights emissions per step, and the
+     * scale of its photon flux. By flux, a light of probability p carries
+     * 1 / (numLights * p) of its color so every light keeps its share of flux,
+     * and each step of numLights emissions samples the CDF in as many strata;
+     * otherwise the lights take turns.
+     */
+    size_t Raytracer::pickEmissionLight(size_t e, size_t numLights, real_t *fluxScale)
+    {
+#if ENABLE_LIGHT_POWER_CDF
+        size_t i = emission_lights.sample(((e % numLights) + random()) / numLights);
+        *fluxScale = real_t(1) / (numLights * emission_lights.pmf(i));
+        return i;
+#else
+        *fluxScale = 1;
+        return e % numLights;
+#endif
+    }
+
+    /**
+     * Build a projection map for every point light: a cell is marked when its first
+     * hit is refractive or reflects specularly, only such paths store caustic photons.
+     */
+    void Raytracer::buildProjectionMaps(const Scene* scene)
+    {
+        unsigned int start = azGetTicks();
 
-        kdtree_photon_indirect_list = tmp_indirect;
-        kdtree_photon_caustic_list = tmp_caustic;
+        projection_maps.assign(scene->num_lights(), azProjectionMap());
+        for (size_t i = 0; i < scene->num_lights(); i++)
+        {
+            const PointLight *light = dynamic_cast<const PointLight *>(scene->get_lights()[i]);
+            if (!light) {
+                continue;
+            }
+            Vector3 origin = light->position;
+            projection_maps[i].build(PROJECTION_MAP_ROWS, PROJECTION_MAP_SAMPLES, MAX_THREADS_SCATTER,
+                                     [&](const Vector3 &direction) {
+                bool isHit = false;
+                HitRecord record = getClosestHit(Ray(origin, direction), EPSILON, TMAX, &isHit, Layer_All);
+                return isHit && (record.refractive_index > 0 || record.specular != Color3::Black());
+            });
+            printf("Projection map of light %ld covers %.2f%% of its directions\n",
+                   i, 100 * projection_maps[i].coverage());
+        }
 
-        printf("Finished Balancing!\n");
+        unsigned int end = azGetTicks();
+        printf("Finished Projection Maps : %d ms\n", end - start);
     }
 
     void Raytracer::kdtreeConstruction()
     {
         unsigned int start = 0, end = 0, acc = 0;
 
-        // balancing kdtree and copy back
-        std::vector<Photon> tmp_indirect(photon_indirect_list.size() + 1);
-        std::vector<Photon> tmp_caustic(photon_caustic_list.size() + 1);
+        // balancing kdtree straight into the tree lists, their storage is reused from the last pass
+        kdtree_photon_indirect_list.resize(photon_indirect_list.size() + 1);
+        kdtree_photon_caustic_list.resize(photon_caustic_list.size() + 1);
 
-        start = SDL_GetTicks();
-        balance(1, tmp_indirect, photon_indirect_list);
-        end = SDL_GetTicks();
+        start = azGetTicks();
+        balance(1, kdtree_photon_indirect_list, photon_indirect_list, 0, photon_indirect_list.size());
+        end = azGetTicks();
         acc += end - start;
         printf("Finished Construct Indirect KD-Tree : %d ms\n", end - start);
 
-        start = SDL_GetTicks();
-        balance(1, tmp_caustic, photon_caustic_list);
-        end = SDL_GetTicks();
+        start = azGetTicks();
+        balance(1, kdtree_photon_caustic_list, photon_caustic_list, 0, photon_caustic_list.size());
+        end = azGetTicks();
         acc += end - start;
         printf("Finished Construct Caustics KD-Tree : %d ms\n", end - start);
 
-        kdtree_photon_indirect_list = tmp_indirect;
-        kdtree_photon_caustic_list = tmp_caustic;
-
         printf("Finished KD-Tree Construction! Total time = %d ms\n", acc);
     }
 
+    // SoA copy of the photon positions, slot i is list[i]
+    static void bindPhotonPositions(const std::vector<Photon> &list, ispcCPhotonStorage &storage, ispcCPhotonData &data)
+    {
+        storage.bind(data, list.size());
+        for (size_t i = 0; i < list.size(); i++)
+        {
+            data.posx[i] = list[i].position[0];
+            data.posy[i] = list[i].position[1];
+            data.posz[i] = list[i].position[2];
+            data.bitmap[i] = 0;
+        }
+    }
+
     // c style photon kdtree construction
     void Raytracer::cPhotonKDTreeConstruction()
     {
         unsigned int start = 0, end = 0;
 
-        start = SDL_GetTicks();
-        // clear old c style kdtree
-//        kdtree_cphoton_indirect.clear();
-//        kdtree_cphoton_caustics.clear();
+        start = azGetTicks();
 
-        cphoton_indirect_data.clear();
-        cphoton_caustics_data.clear();
+        // stays set if the preview interrupts the build, the next pass rebuilds first
+        photon_trees_stale = true;
 
-        std::vector<cPhoton> c_indirect(photon_indirect_list.size());
-        std::vector<cPhoton> c_caustics(photon_caustic_list.size());
+#if ENABLE_PHOTON_GRID && ENABLE_PHOTON_REORDER
+        // a bucket holds the photons of a few cells, Morton order keeps them close in the list
+        mortonSortPhotons(photon_indirect_list);
+        mortonSortPhotons(photon_caustic_list);
+#endif
 
-        // copy from normal photon to c photon
-        for (size_t i = 0; i < photon_indirect_list.size(); i++)
-        {
-            photon_indirect_list[i].position.to_array(c_indirect[i].position);
-            c_indirect[i].index = i;
-            c_indirect[i].splitAxis = -1;
+#if !ENABLE_PHOTON_GRID
+        // every split takes one photon out of the children, a tree has at most 2n + 1 nodes
+        vvh_indirect_nodes.reset(2 * photon_indirect_list.size() + 1);
+        vvh_caustics_nodes.reset(2 * photon_caustic_list.size() + 1);
+        vvh_indirect_root = vvh_indirect_nodes.allocate();
+        vvh_caustics_root = vvh_caustics_nodes.allocate();
+
+        // construct vvh based kd-trees over the photon lists, the caustics tree on a second
+        // thread. The build partitions the lists in place, so the photons of every leaf end
+        // up in one range of them
+        std::thread causticsBuild(&Raytracer::vvhKDTreeConstruction, this,
+                                  std::ref(photon_caustic_list), vvh_caustics_root, std::ref(vvh_caustics_nodes));
+        vvhKDTreeConstruction(photon_indirect_list, vvh_indirect_root, vvh_indirect_nodes);
+        causticsBuild.join();
+#endif
+        if (previewInterrupted()) {
+            printf("c photon KDTree Construction interrupted after %d ms\n", azGetTicks() - start);
+            return;
         }
 
-        for (size_t i = 0; i < photon_caustic_list.size(); i++)
-        {
-            photon_caustic_list[i].position.to_array(c_caustics[i].position);
-            c_caustics[i].index = i;
-            c_caustics[i].splitAxis = -1;
+        // construct ispc friendly photon positions
+        bindPhotonPositions(photon_indirect_list, ispc_cphoton_indirect_storage, ispc_cphoton_indirect_data);
+        bindPhotonPositions(photon_caustic_list, ispc_cphoton_caustics_storage, ispc_cphoton_caustics_data);
+
+#if ENABLE_PHOTON_GRID
+        photon_indirect_grid.build(ispc_cphoton_indirect_data.posx, ispc_cphoton_indirect_data.posy,
+                                   ispc_cphoton_indirect_data.posz,
+                                   ispc_cphoton_indirect_data.size, PHOTON_GRID_CELL_SIZE, MAX_THREADS_SCATTER);
+        photon_caustics_grid.build(ispc_cphoton_caustics_data.posx, ispc_cphoton_caustics_data.posy,
+                                   ispc_cphoton_caustics_data.posz,
+                                   ispc_cphoton_caustics_data.size, PHOTON_GRID_CELL_SIZE, MAX_THREADS_SCATTER);
+#endif
+
+        end = azGetTicks();
+        acc_kdtree_cons += end - start;
+        printf("c photon KDTree Construction Time = %d ms\n", end - start);
+
+#if ENABLE_GATHER_BENCHMARK
+        azBenchmarkGatherLeaf(ispc_cphoton_indirect_data.posx, ispc_cphoton_indirect_data.posy,
+                              ispc_cphoton_indirect_data.posz, NULL,
+                              ispc_cphoton_indirect_data.size, SMALL_NODE_GRANULARITY, 100000,
+                              PHOTON_QUERY_RADIUS, PHOTON_GATHER_NUM);
+#endif
+
+#if ENABLE_PRECOMPUTED_IRRADIANCE
+        precomputeIrradiance();
+        if (previewInterrupted()) {
+            return;
         }
+#endif
+        photon_trees_stale = false;
+    }
 
+    /**
+     * @brief Precomputed irradiance, Christensen 1999. The photon estimate of
+     *        shade_cphotons is evaluated at a subset of the photons of both maps,
+     *        spread over MAX_THREADS_SCATTER threads, and kept as one photon each
+     *        in irradiance_photon_list with its own vvh tree. Photons carry no
+     *        normal, so the cosine of the estimate is kept as the flux weighted
+     *        mean incident direction d: sum(flux * dot(n, l)) is dot(n, sum(flux *
+     *        l)) while all photons come from above the surface, the stored photon
+     *        gets flux |d| * sum(flux) and direction d / |d|. Exact for photons of
+     *        one chromaticity, close otherwise.
+     */
+    void Raytracer::precomputeIrradiance()
+    {
+        unsigned int start = azGetTicks();
 
-        cphoton_indirect_data = c_indirect;
-        cphoton_caustics_data = c_caustics;
+        size_t numIndirect = (photon_indirect_list.size() + IRRADIANCE_PHOTON_STRIDE - 1) / IRRADIANCE_PHOTON_STRIDE;
+        size_t numCaustics = (photon_caustic_list.size() + IRRADIANCE_PHOTON_STRIDE - 1) / IRRADIANCE_PHOTON_STRIDE;
+        irradiance_photon_list.resize(numIndirect + numCaustics);
 
-        vvh_indirect_root = new KDNode;
-        vvh_caustics_root = new KDNode;
+        azParallelChunks(irradiance_photon_list.size(), MAX_THREADS_SCATTER, [&](size_t begin, size_t end, size_t /* w */) {
+            azNearestPhotons nearest(PHOTON_GATHER_NUM, PHOTON_QUERY_RADIUS);
+            for (size_t i = begin; i < end && !previewInterrupted(); i++)
+            {
+                const Photon &source = i < numIndirect ? photon_indirect_list[i * IRRADIANCE_PHOTON_STRIDE]
+                                                       : photon_caustic_list[(i - numIndirect) * IRRADIANCE_PHOTON_STRIDE];
+                Vector3 position = source.getPosition();
+
+                Color3 flux = Color3::Black();
+                Vector3 direction = Vector3::Zero();
+                real_t luminance = 0;
+                for (int map = 0; map < 2; map++)
+                {
+                    bool caustics = map == 1;
+                    std::vector<Photon> &list = caustics ? photon_caustic_list : photon_indirect_list;
 
-        // construct vvh based kd-tree
-        vvhKDTreeConstruction(cphoton_indirect_data, vvh_indirect_root);
-        vvhKDTreeConstruction(cphoton_caustics_data, vvh_caustics_root);
+                    nearest.reset(PHOTON_QUERY_RADIUS);
+                    cPhotonGather(position, caustics, nearest);
+                    if (nearest.size() == 0) {
+                        continue;
+                    }
 
-        // construct ispc friendly cphoton data
-        ispc_cphoton_indirect_data.size = cphoton_indirect_data.size();
-        ispc_cphoton_indirect_data.posx = new float[cphoton_indirect_data.size()];
-        ispc_cphoton_indirect_data.posy = new float[cphoton_indirect_data.size()];
-        ispc_cphoton_indirect_data.posz = new float[cphoton_indirect_data.size()];
+                    real_t area = real_t(1) / (PI * nearest.sqrDist);
+                    for (size_t k = 0; k < nearest.size(); k++)
+                    {
+                        const Photon &photon = list[nearest[k]];
+                        Color3 c = photon.getColor() * area;
+                        real_t y = (c.r + c.g + c.b) * (real_t(1) / 3);
+                        flux += c;
+                        direction += photon.getDirection() * y;
+                        luminance += y;
+                    }
+                }
 
-        ispc_cphoton_indirect_data.bitmap = new int8_t[cphoton_indirect_data.size()];
+                Photon &irradiance = irradiance_photon_list[i];
+                irradiance = Photon(Color3::Black());
+                irradiance.setPosition(position);
+                if (luminance > 0)
+                {
+                    direction = direction * (real_t(1) / luminance);
+                    real_t len = length(direction);
+                    if (len > 0) {
+                        irradiance.setColor(flux * len);
+                        irradiance.setDirection(direction * (real_t(1) / len));
+                    }
+                }
+            }
+        });
+        if (previewInterrupted()) {
+            return;
+        }
 
-        ispc_cphoton_caustics_data.size = cphoton_caustics_data.size();
-        ispc_cphoton_caustics_data.posx = new float[cphoton_caustics_data.size()];
-        ispc_cphoton_caustics_data.posy = new float[cphoton_caustics_data.size()];
-        ispc_cphoton_caustics_data.posz = new float[cphoton_caustics_data.size()];
-        ispc_cphoton_caustics_data.bitmap = new int8_t[cphoton_caustics_data.size()];
+        vvh_irradiance_nodes.reset(2 * irradiance_photon_list.size() + 1);
+        vvh_irradiance_root = vvh_irradiance_nodes.allocate();
+        vvhKDTreeConstruction(irradiance_photon_list, vvh_irradiance_root, vvh_irradiance_nodes);
+        bindPhotonPositions(irradiance_photon_list, ispc_irradiance_storage, ispc_irradiance_data);
 
+        printf("Precomputed irradiance at %ld photons : %d ms\n", irradiance_photon_list.size(), azGetTicks() - start);
+    }
 
-        for (size_t i = 0; i < cphoton_indirect_data.size(); i++)
+    Color3 Raytracer::shadePrecomputedIrradiance(HitRecord &record)
+    {
+        // records are IRRADIANCE_PHOTON_STRIDE times sparser than the photons
+        azNearestPhotons nearest(IRRADIANCE_LOOKUP_NUM, PHOTON_QUERY_RADIUS * IRRADIANCE_PHOTON_STRIDE);
+        vvhcPhotonLocate(record.position, vvh_irradiance_root, ispc_irradiance_data, irradiance_photon_list, nearest);
+
+        // the nearest one lit from the side of the normal, others lie on another surface
+        const Photon *best = NULL;
+        float bestDist = INFINITY;
+        for (size_t i = 0; i < nearest.size(); i++)
         {
-            ispc_cphoton_indirect_data.posx[i] = cphoton_indirect_data[i].position[0];
-            ispc_cphoton_indirect_data.posy[i] = cphoton_indirect_data[i].position[1];
-            ispc_cphoton_indirect_data.posz[i] = cphoton_indirect_data[i].position[2];
-            ispc_cphoton_indirect_data.bitmap[i] = 0;
+            const Photon &photon = irradiance_photon_list[nearest[i]];
+            if (nearest.entries[i].sqrDist < bestDist && dot(photon.getDirection(), record.normal) > 0) {
+                best = &photon;
+                bestDist = nearest.entries[i].sqrDist;
+            }
+        }
+
+        if (best == NULL) {
+            return Color3::Black();
+        }
+        return record.getPhotonLambertianColor(best->getDirection(), best->getColor());
+    }
+
+    void Raytracer::mortonSortPhotons(std::vector<Photon> &photons)
+    {
+        if (photons.empty()) {
+            return;
         }
 
-        for (size_t i = 0; i < cphoton_caustics_data.size(); i++)
+        Vector3 boundMin = photons[0].getPosition();
+        Vector3 boundMax = boundMin;
+        for (size_t i = 1; i < photons.size(); i++)
         {
-            ispc_cphoton_caustics_data.posx[i] = cphoton_caustics_data[i].position[0];
-            ispc_cphoton_caustics_data.posy[i] = cphoton_caustics_data[i].position[1];
-            ispc_cphoton_caustics_data.posz[i] = cphoton_caustics_data[i].position[2];
-            ispc_cphoton_caustics_data.bitmap[i] = 0;
+            boundMin = vmin(boundMin, photons[i].getPosition());
+            boundMax = vmax(boundMax, photons[i].getPosition());
         }
 
-        end = SDL_GetTicks();
-        acc_kdtree_cons += end - start;
-        printf("c photon KDTree Construction Time = %d ms\n", end - start);
+        Vector3 invExtent = azMortonInvExtent(boundMin, boundMax);
+        std::vector<std::pair<unsigned int, int> > order(photons.size());
+        for (size_t i = 0; i < photons.size(); i++) {
+            order[i] = std::make_pair(azMortonCode(photons[i].getPosition(), boundMin, invExtent), int(i));
+        }
+        std::sort(order.begin(), order.end());
+
+        photon_reorder_scratch.resize(photons.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            photon_reorder_scratch[i] = photons[order[i].second];
+        }
+        photons.swap(photon_reorder_scratch);
     }
 
     /**
@@ -393,7 +932,12 @@ namespace _462 {
      * @param height The height of the screen in pixels.
      * @return The color of that pixel in the final image.
      */
+#if ENABLE_GBUFFER_CACHE && !ENABLE_DOF
+    // the cached primary hit already knows the scene
+    Color3 Raytracer::trace_pixel(const Scene* /*scene*/,
+#else
     Color3 Raytracer::trace_pixel(const Scene* scene,
+#endif
                                   size_t x,
                                   size_t y,
                                   size_t width,
@@ -402,19 +946,15 @@ namespace _462 {
         assert(x < width);
         assert(y < height);
 
-        real_t dx = real_t(1)/width;
-        real_t dy = real_t(1)/height;
-
         Color3 res = Color3::Black();
         unsigned int iter;
         for (iter = 0; iter < num_samples; iter++)
         {
+#if ENABLE_DOF
             // pick a point within the pixel boundaries to fire our
             // ray through.
-            real_t i = real_t(2)*(real_t(x)+random())*dx - real_t(1);
-            real_t j = real_t(2)*(real_t(y)+random())*dy - real_t(1);
-
-#if ENABLE_DOF
+            real_t i = real_t(2)*(real_t(x)+random())/width - real_t(1);
+            real_t j = real_t(2)*(real_t(y)+random())/height - real_t(1);
             Ray r = Ray(scene->camera.get_position(), Ray::get_pixel_dir(i, j));
             res += trace(r, EPSILON, TMAX, RAYTRACE_DEPTH);
 
@@ -432,9 +972,24 @@ namespace _462 {
 
             res *= 1.0/(float)DOF_SAMPLE;
 
+#elif ENABLE_GBUFFER_CACHE
+            res += shadeCachedPrimary(x, y, iter);
 #else
-            // Entrance
+            // Entrance, through a random point within the pixel boundaries
+            real_t i = real_t(2)*(real_t(x)+random())/width - real_t(1);
+            real_t j = real_t(2)*(real_t(y)+random())/height - real_t(1);
             Ray r = Ray(scene->camera.get_position(), Ray::get_pixel_dir(i, j));
+    #if ENABLE_DENOISER
+            // first sample of the pixel also feeds the denoiser guide
+            if (iter == 0)
+            {
+                bool isHit = false;
+                HitRecord record = getClosestHit(r, EPSILON, TMAX, &isHit, Layer_All);
+                denoiser.setGuide(x, y, record);
+                res += isHit ? shade(r, record, EPSILON, TMAX, RAYTRACE_DEPTH) : scene->background_color;
+                continue;
+            }
+    #endif
             res += trace(r, EPSILON, TMAX, RAYTRACE_DEPTH);
 #endif
 
@@ -442,9 +997,92 @@ namespace _462 {
         return res*(float(1)/float(num_samples));
     }
 
+    void Raytracer::invalidateGBuffer()
+    {
+        for (size_t i = 0; i < gbuffer.size(); i++) {
+            gbuffer[i].isValid = false;
+        }
+    }
+
+    /**
+     * Shades one sample of a pixel using the cached primary hit of its jitter
+     * pattern. The eye ray is traced only the first time a pattern is used,
+     * later passes go straight to shading, so only shadow, GI and photon
+     * gathering work is done again.
+     * @param x The x-coordinate of the pixel.
+     * @param y The y-coordinate of the pixel.
+     * @param sample The sample index within the current pass.
+     * @return The shaded color of the sample.
+     */
+    Color3 Raytracer::shadeCachedPrimary(size_t x, size_t y, unsigned int sample)
+    {
+        Ray r;
+        HitRecord record = cachedPrimaryHit(x, y, sample, &r);
+        if (!record.isHit) {
+            return scene->background_color;
+        }
+
+#if ENABLE_DENOISER
+        denoiser.setGuide(x, y, record);
+#endif
+
+        return shade(r, record, EPSILON, TMAX, RAYTRACE_DEPTH);
+    }
+
+    /**
+     * The primary hit of one sample of a pixel from the cache, traced and
+     * stored the first time its jitter pattern is used.
+     * @param x The x-coordinate of the pixel.
+     * @param y The y-coordinate of the pixel.
+     * @param sample The sample index within the current pass.
+     * @param ray Set to the eye ray of the sample.
+     * @return The hit, isHit is false if the eye ray misses.
+     */
+    HitRecord Raytracer::cachedPrimaryHit(size_t x, size_t y, unsigned int sample, Ray *ray)
+    {
+        size_t pattern = ((num_iteration - 1) * num_samples + sample) % GBUFFER_JITTER_PATTERNS;
+        GBufferSample &cached = gbuffer[(pattern * height + y) * width + x];
+
+        real_t i = real_t(2)*(real_t(x)+gbufferJitter[2 * pattern])/width - real_t(1);
+        real_t j = real_t(2)*(real_t(y)+gbufferJitter[2 * pattern + 1])/height - real_t(1);
+        *ray = Ray(scene->camera.get_position(), Ray::get_pixel_dir(i, j));
+
+        if (!cached.isValid)
+        {
+            bool isHit = false;
+            HitRecord record = getClosestHit(*ray, EPSILON, TMAX, &isHit, Layer_All);
+
+            cached.isHit = isHit;
+            cached.isValid = true;
+            if (isHit)
+            {
+                cached.position = record.position;
+                cached.normal = record.normal;
+                cached.diffuse = record.diffuse;
+                cached.texture = record.texture;
+                cached.refractive_index = record.refractive_index;
+                cached.t = record.t;
+            }
+        }
+
+        HitRecord record;
+        if (!cached.isHit) {
+            return record;
+        }
+
+        record.position = cached.position;
+        record.normal = cached.normal;
+        record.diffuse = cached.diffuse;
+        record.texture = cached.texture;
+        record.refractive_index = cached.refractive_index;
+        record.t = cached.t;
+        record.isHit = true;
+        return record;
+    }
+
     bool Raytracer::PacketizedRayTrace(unsigned char* buffer)
     {
-        pass_start = SDL_GetTicks();
+        pass_start = azGetTicks();
 
         float dx = float(1)/width;
         float dy = float(1)/height;
@@ -477,6 +1115,14 @@ namespace _462 {
                 azPacket<HitRecord> hitInfoPacket(STEP_SIZE * STEP_SIZE);
                 PacketizedRayIntersection(rayPacket, hitInfoPacket, EPSILON, INFINITY);
 
+#if ENABLE_PHOTON_MAPPING && C_PHOTON_MODE && !ENABLE_SPPM
+                // photons of the whole packet in one Morton ordered batch
+                std::vector<Color3> gathered(hitInfoPacket.size());
+                if (hitInfoPacket.size() > 0) {
+                    shade_cphotons_batch(&hitInfoPacket[0], hitInfoPacket.size(), PHOTON_QUERY_RADIUS, PHOTON_GATHER_NUM, &gathered[0]);
+                }
+#endif
+
                 // TODO: shadow ray
                 // TODO: deferred shading
                 for (size_t i = 0; i < hitInfoPacket.size(); i++) {
@@ -493,7 +1139,11 @@ namespace _462 {
                         y = std::min(y, height - 1);
 //                        std::cout<<x<<" "<<y<<std::endl;
 
+#if ENABLE_PHOTON_MAPPING && C_PHOTON_MODE && !ENABLE_SPPM
+                        Color3 color = shade(ray, hitInfo, EPSILON, INFINITY, 1, &gathered[i]);
+#else
                         Color3 color = shade(ray, hitInfo, EPSILON, INFINITY, 1);
+#endif
                         raytraceColorBuffer[(y * width + x)] += color;
                         Color3 progressiveColor = raytraceColorBuffer[(y * width + x)] * ((1.0)/(num_iteration));
                         progressiveColor = clamp(progressiveColor, 0.0, 1.0);
@@ -510,7 +1160,7 @@ namespace _462 {
         // Reset raytracer for another render pass
         if (num_iteration < TOTAL_ITERATION)
         {
-            pass_end = SDL_GetTicks();
+            pass_end = azGetTicks();
             acc_pass_spent += pass_end - pass_start;
             printf("Done One Pass! Iteration = %d, Pass spent = %dms\n", num_iteration, (pass_end - pass_start));
             current_row = 0;
@@ -529,6 +1179,16 @@ namespace _462 {
         std::vector<Ray> girays;
         
         double start, end;
+
+#if ENABLE_DENOISER
+        denoiser.clearGuide();
+#endif
+        eyeHits.clear();
+#if ENABLE_ASYNC_RAY_EXCHANGE
+        // eye rays, their local trace and the shadow rays streamed in one stage,
+        // shadow rays are shaded on arrival so shadowrays stays empty
+        mpiStageOverlappedTrace(scene->node_size, scene->node_rank, &eyerays, true, buffer, &girays);
+#else
         // generate and redistribute eye rays through open mpi to different nodes
         start = MPI_Wtime();
         mpiStageDistributeEyeRays(scene->node_size, scene->node_rank, &eyerays);
@@ -548,17 +1208,44 @@ namespace _462 {
         end = MPI_Wtime();
 
         printf("[thread %d] Shadow state took %f sec\n", scene->node_rank, end - start);
+#endif
         
         // merge direct illumination buffer
         start = MPI_Wtime();
         mpiMergeFrameBufferToBuffer(scene->node_size, scene->node_rank, buffer, dibuffer);
         end = MPI_Wtime();
         printf("[thread %d] Merge Framebuffer took %f sec\n", scene->node_rank, end - start);
+
+#if ENABLE_DENOISER
+        start = MPI_Wtime();
+        mpiMergeDenoiseGuide(scene->node_size, scene->node_rank);
+        if (scene->node_rank == 0) {
+            denoiser.denoise(dibuffer);
+        }
+        end = MPI_Wtime();
+        printf("[thread %d] Denoise direct illumination took %f sec\n", scene->node_rank, end - start);
+#endif
         
         buffer.cleanbuffer(width, height);
 
-        
-        while (!mpiShouldStop(scene->node_size, scene->node_rank, shadowrays.size(), girays.size()))
+#if ENABLE_PHOTON_MAPPING && C_PHOTON_MODE && !ENABLE_SPPM
+        // photon light of the eye rays, it replaces the path traced indirect light below
+        start = MPI_Wtime();
+        mpiStagePhotonGather(scene->node_size, scene->node_rank, buffer);
+        mpiMergeFrameBufferToBuffer(scene->node_size, scene->node_rank, buffer, gibuffer);
+        for (size_t i = 0; i < 4 * width * height; i += 4)
+        {
+            Color3 color = Color3(&dibuffer[i]) + Color3(&gibuffer[i]);
+            clamp(color, 0.0, 1.0).to_array(&dibuffer[i]);
+        }
+        buffer.cleanbuffer(width, height);
+        end = MPI_Wtime();
+        printf("[thread %d] Photon gather took %f sec\n", scene->node_rank, end - start);
+        girays.clear();
+        shadowrays.clear();
+#endif
+        
+        while (!mpiShouldStop(scene->node_size, scene->node_rank, shadowrays.size(), girays.size()))
         {
             
 //            eyerays.clear();
@@ -567,13 +1254,23 @@ namespace _462 {
 //            shadowrays.clear();
             eyerays = girays;
             
+#if ENABLE_ASYNC_RAY_EXCHANGE
+            mpiStageOverlappedTrace(scene->node_size, scene->node_rank, &eyerays, false, buffer, &girays);
+#else
             mpiStageLocalRayTrace(scene->node_size, scene->node_rank, eyerays, &shadowrays, &girays, false);
             
             
             mpiStageShadowRayTracing(scene->node_size, scene->node_rank, buffer, shadowrays);
+#endif
             
             // TODO: merge global illumination buffer
             mpiMergeFrameBufferToBuffer(scene->node_size, scene->node_rank, buffer, gibuffer);
+
+#if ENABLE_DENOISER
+            if (scene->node_rank == 0) {
+                denoiser.denoise(gibuffer);
+            }
+#endif
             
             buffer.cleanbuffer(width, height);
             
@@ -599,7 +1296,7 @@ namespace _462 {
      */
     bool Raytracer::raytrace(unsigned char* buffer, real_t* max_time)
     {
-        pass_start = SDL_GetTicks();
+        pass_start = azGetTicks();
         // the time in milliseconds that we should stop
         unsigned int end_time = 0;
         bool is_done;
@@ -608,14 +1305,14 @@ namespace _462 {
         {
             // convert duration to milliseconds
             unsigned int duration = (unsigned int) (*max_time * 1000);
-            end_time = SDL_GetTicks() + duration;
+            end_time = azGetTicks() + duration;
         }
 
         // until time is up, run the raytrace. we render an entire group of
         // rows at once for simplicity and efficiency.
-        for (; !max_time || end_time > SDL_GetTicks(); current_row += STEP_SIZE)
+        for (; !max_time || end_time > azGetTicks(); current_row += STEP_SIZE)
         {
-//            if (end_time > SDL_GetTicks())
+//            if (end_time > azGetTicks())
 //            {
 //                std::cout<<"FINISH"<<std::endl;
 //            }
@@ -625,67 +1322,607 @@ namespace _462 {
             if (is_done) break;
 
             int loop_upper = std::min(current_row + STEP_SIZE, height);
+            std::vector<size_t> rowPixels(width);
             for (int c_row = current_row; c_row < loop_upper; c_row++)
             {
                 for (size_t x = 0; x < width; x++)
                 {
-                    // trace a pixel
-                    // Packet entrance
-                    Color3 color = trace_pixel(scene, x, c_row, width, height);
+                    rowPixels[x] = c_row * width + x;
+                }
+                accumulatePixels(rowPixels, buffer);
+            }
+        }
+
+        if (is_done)
+        {
+            is_done = finishPass(buffer);
+        }
+
+        return is_done;
+    }
+
+    void Raytracer::accumulatePixel(size_t x, size_t y, unsigned char *buffer)
+    {
+        // trace a pixel
+        // Packet entrance
+#if ENABLE_PHOTON_MAPPING && ENABLE_SPPM
+        Color3 color = sppmTracePixel(x, y);
+#else
+        Color3 color = trace_pixel(scene, x, y, width, height);
+#endif
+
+        accumulateColor(x, y, color, buffer);
+    }
+
+    /**
+     * Trace a batch of pixels, a row or a tile, and accumulate them as
+     * accumulatePixel does. With BATCH_PRIMARY_GATHER the primary hits of all
+     * samples are found first and the photons at them gathered in one
+     * shade_cphotons_batch sweep before any of them is shaded.
+     * @param pixels Indices y * width + x of the pixels.
+     * @param buffer The rgba output.
+     */
+    void Raytracer::accumulatePixels(const std::vector<size_t> &pixels, unsigned char *buffer)
+    {
+#if BATCH_PRIMARY_GATHER
+        size_t count = pixels.size() * num_samples;
+        std::vector<Ray> rays(count);
+        std::vector<HitRecord> records(count);
+        for (size_t p = 0; p < pixels.size(); p++)
+        {
+            size_t x = pixels[p] % width;
+            size_t y = pixels[p] / width;
+            for (unsigned int s = 0; s < num_samples; s++)
+            {
+                size_t k = p * num_samples + s;
+    #if ENABLE_GBUFFER_CACHE
+                records[k] = cachedPrimaryHit(x, y, s, &rays[k]);
+    #else
+                bool isHit = false;
+                rays[k] = generateEyeRay(scene->camera.get_position(), x, y, real_t(1)/width, real_t(1)/height);
+                records[k] = getClosestHit(rays[k], EPSILON, TMAX, &isHit, Layer_All);
+    #endif
+            }
+        }
 
-                    raytraceColorBuffer[(c_row * width + x)] += color;
-                    Color3 progressiveColor = raytraceColorBuffer[(c_row * width + x)] * ((1.0)/(num_iteration));
-                    progressiveColor = clamp(progressiveColor, 0.0, 1.0);
+        std::vector<Color3> gathered(count);
+        if (count > 0) {
+            shade_cphotons_batch(&records[0], count, PHOTON_QUERY_RADIUS, PHOTON_GATHER_NUM, &gathered[0]);
+        }
 
-                    progressiveColor.to_array(&buffer[4 * (c_row * width + x)]);
+        for (size_t p = 0; p < pixels.size(); p++)
+        {
+            size_t x = pixels[p] % width;
+            size_t y = pixels[p] / width;
+            Color3 color = Color3::Black();
+            for (unsigned int s = 0; s < num_samples; s++)
+            {
+                size_t k = p * num_samples + s;
+                if (!records[k].isHit) {
+                    color += scene->background_color;
+                    continue;
+                }
+    #if ENABLE_DENOISER
+                // first sample of the pixel also feeds the denoiser guide
+                if (s == 0) {
+                    denoiser.setGuide(x, y, records[k]);
                 }
-                // Make packets
+    #endif
+                color += shade(rays[k], records[k], EPSILON, TMAX, RAYTRACE_DEPTH, &gathered[k]);
             }
+            accumulateColor(x, y, color * (float(1)/float(num_samples)), buffer);
+        }
+#else
+        for (size_t p = 0; p < pixels.size(); p++) {
+            accumulatePixel(pixels[p] % width, pixels[p] / width, buffer);
         }
+#endif
+    }
 
-        if (is_done)
+    void Raytracer::accumulateColor(size_t x, size_t y, const Color3 &color, unsigned char *buffer)
+    {
+        raytraceColorBuffer[(y * width + x)] += color;
+        Color3 progressiveColor = raytraceColorBuffer[(y * width + x)] * ((1.0)/(num_iteration));
+#if ENABLE_PHOTON_MAPPING && ENABLE_SPPM
+        // photon passes so far, the one of this pass follows in finishPass
+        progressiveColor += sppm.radiance(y * width + x, num_iteration - 1);
+#endif
+        progressiveColor = clamp(progressiveColor, 0.0, 1.0);
+
+        progressiveColor.to_array(&buffer[4 * (y * width + x)]);
+    }
+
+    /**
+     * SPPM camera pass of a pixel. Traces one jittered eye ray through mirror
+     * and glass bounces, up to RAYTRACE_DEPTH of them, and keeps its first
+     * diffuse hit as the visible point of the pixel with the throughput of the
+     * path in its weight. Returns the direct light there, photon light is
+     * added once the photon pass is done.
+     * @param x The x-coordinate of the pixel.
+     * @param y The y-coordinate of the pixel.
+     * @return The color of the pixel without photon light.
+     */
+    Color3 Raytracer::sppmTracePixel(size_t x, size_t y)
+    {
+        size_t pixel = y * width + x;
+        Ray r = generateEyeRay(scene->camera.get_position(), x, y, real_t(1)/width, real_t(1)/height);
+        Color3 throughput = Color3::White();
+
+        for (int depth = RAYTRACE_DEPTH; depth > 0; depth--)
         {
-            if (num_iteration < TOTAL_ITERATION)
+            bool isHit = false;
+            HitRecord record = getClosestHit(r, EPSILON, TMAX, &isHit, Layer_All);
+            if (!isHit)
             {
-                pass_end = SDL_GetTicks();
-                acc_pass_spent += pass_end - pass_start;
-                printf("Done One Pass! Iteration = %d, Pass spent = %dms\n", num_iteration, (pass_end - pass_start));
+                sppm.clearVisiblePoint(pixel);
+                return throughput * scene->background_color;
+            }
 
-#if ENABLE_PHOTON_MAPPING
-                printf("Pass photon search spent: indirect = %dms, caustics = %dms\n", acc_iphoton_search_time, acc_cphoton_search_time);
+            if (record.diffuse != Color3::Black() && record.refractive_index == 0)
+            {
+                // shade scales its radiance by the texture, photon light gets the same
+                sppm.setVisiblePoint(pixel, record.position, record.normal, throughput * record.texture * record.diffuse);
+                return throughput * shade(r, record, EPSILON, TMAX, depth);
+            }
+
+            Vector3 direction;
+            if (record.refractive_index > 0)
+            {
+                // one of reflection and refraction, picked by the fresnel term, as photons do
+                float ni = float(1.0);
+                float nt = (float)record.refractive_index;
+                float reflectivity = azFresnel::FresnelDielectricEvaluate(dot(r.d, record.normal), ni, nt);
+                if (random() < reflectivity) {
+                    direction = azReflection::reflect(r.d, record.normal);
+                }
+                else {
+                    direction = azReflection::refract(r.d, record.normal, ni, nt);
+                }
+            }
+            else if (record.specular != Color3::Black())
+            {
+                direction = azReflection::reflect(r.d, record.normal);
+            }
+            else
+            {
+                // neither diffuse nor specular, nothing leaves this surface
+                break;
+            }
+
+            throughput *= record.specular;
+            direction = normalize(direction);
+            r = Ray(record.position + EPSILON * direction, direction);
+        }
+
+        sppm.clearVisiblePoint(pixel);
+        return Color3::Black();
+    }
+
+    /**
+     * SPPM photon pass. Scatters a new set of photons and hands both maps to
+     * the visible points, no photon kd-tree is built and nothing of the
+     * photons is kept for later passes.
+     */
+    void Raytracer::sppmPhotonPass()
+    {
+        unsigned int start = azGetTicks();
+
+        // the camera moved, the visible points of this pass are dropped anyway
+        if (!parallelPhotonScatter(scene)) {
+            return;
+        }
+
+        size_t numIndirect = photon_indirect_list.size();
+        size_t numCaustics = photon_caustic_list.size();
+        sppm_photons.resize(numIndirect + numCaustics);
+        for (size_t i = 0; i < numIndirect + numCaustics; i++)
+        {
+            Photon &photon = i < numIndirect ? photon_indirect_list[i] : photon_caustic_list[i - numIndirect];
+            sppm_photons[i].position = photon.getPosition();
+            sppm_photons[i].direction = photon.getDirection();
+            sppm_photons[i].flux = photon.getColor() * SPPM_FLUX_SCALE;
+        }
+
+        if (!sppm_photons.empty()) {
+            sppm.addPhotonPass(&sppm_photons[0], sppm_photons.size(), MAX_THREADS_SCATTER);
+        }
+
+        printf("SPPM photon pass = %d ms\n", azGetTicks() - start);
+    }
+
+    /**
+     * Called once every pixel got its sample of the current pass. Filters the
+     * output if the denoiser is on, then either prepares the next pass or
+     * reports the progressive render as done.
+     * @param buffer The rgba output of the pass, rewritten by SPPM and the denoiser.
+     * @return true if the last pass has been rendered.
+     */
+#if (ENABLE_PHOTON_MAPPING && ENABLE_SPPM) || ENABLE_DENOISER
+    bool Raytracer::finishPass(unsigned char *buffer)
+#else
+    bool Raytracer::finishPass(unsigned char * /*buffer*/)
+#endif
+    {
+        bool is_done = true;
+
+#if ENABLE_PHOTON_MAPPING && ENABLE_SPPM
+        // photons of this pass land on the visible points its camera pass stored
+        sppmPhotonPass();
+        for (size_t i = 0; i < width * height; i++) {
+            Color3 color = raytraceColorBuffer[i] * ((1.0)/(num_iteration)) + sppm.radiance(i, num_iteration);
+            clamp(color, 0.0, 1.0).to_array(&buffer[4 * i]);
+        }
+#endif
+
+#if ENABLE_DENOISER
+        // display the filtered average, the accumulation buffer itself stays unbiased
+        std::vector<Color3> average(width * height);
+        std::vector<Color3> filtered(width * height);
+        for (size_t i = 0; i < width * height; i++) {
+            average[i] = raytraceColorBuffer[i] * ((1.0)/(num_iteration));
+    #if ENABLE_PHOTON_MAPPING && ENABLE_SPPM
+            average[i] += sppm.radiance(i, num_iteration);
+    #endif
+        }
+        denoiser.denoise(&average[0], &filtered[0]);
+        for (size_t i = 0; i < width * height; i++) {
+            clamp(filtered[i], 0.0, 1.0).to_array(&buffer[4 * i]);
+        }
+#endif
+
+        if (num_iteration < TOTAL_ITERATION)
+        {
+            pass_end = azGetTicks();
+            acc_pass_spent += pass_end - pass_start;
+            printf("Done One Pass! Iteration = %d, Pass spent = %dms\n", num_iteration, (pass_end - pass_start));
+
+#if ENABLE_PATH_TRACING_GI && ENABLE_IRRADIANCE_CACHE
+            printf("Irradiance cache records = %ld\n", irradianceCache.size());
 #endif
-                // add postprocessing kernal to raytraceColorBuffer
-                current_row = 0;
 #if ENABLE_PHOTON_MAPPING
+            printf("Pass photon search spent: indirect = %dms, caustics = %dms\n", acc_iphoton_search_time.load(), acc_cphoton_search_time.load());
+#endif
+            // add postprocessing kernal to raytraceColorBuffer
+            current_row = 0;
+#if ENABLE_PHOTON_MAPPING && !ENABLE_SPPM
     #if C_PHOTON_MODE
-                    parallelPhotonScatter(scene);
-
+                if (parallelPhotonScatter(scene)) {
                     cPhotonKDTreeConstruction();
+                }
     #else
-                    kdtreeConstruction();
+                kdtreeConstruction();
     #endif
 #endif
 
+            is_done = false;
+            num_iteration++;
+
+
+        }
+        else
+        {
+            pass_end = azGetTicks();
+            master_end = azGetTicks();
+
+            printf("Done Progressive Photon Mapping! Iteration = %d, Total Spent = %dms\n", num_iteration, master_end - master_start);
+//                perPixelRender(buffer);
+
+            // debug varibale update
+            printf("average clear radius = %f, average shadow radius = %f, Average KDTree Construction %dms , Average Pass Spent = %dms\n", radius_clear/(float)clear_count, radius_shadow/(float)shadow_count, acc_kdtree_cons/num_iteration, acc_pass_spent/num_iteration);
+        }
+
+
+        return is_done;
+    }
+
+    void Raytracer::startPreview()
+    {
+        stopPreview();
+
+        for (int i = 0; i < PREVIEW_SLOTS; i++) {
+            previewSlots[i].assign(BUFFER_SIZE(width, height), 0);
+        }
+        previewBack = 0;
+        previewMiddle = 1;
+        previewFront = 2;
+
+        // centre tiles first, that is where the user looks while the view refines
+        int tilesX = (width + PREVIEW_TILE_SIZE - 1) / PREVIEW_TILE_SIZE;
+        int tilesY = (height + PREVIEW_TILE_SIZE - 1) / PREVIEW_TILE_SIZE;
+        std::vector<std::pair<real_t, int> > tileDistance(tilesX * tilesY);
+        for (int i = 0; i < tilesX * tilesY; i++)
+        {
+            real_t dx = ((i % tilesX) + 0.5) * PREVIEW_TILE_SIZE - 0.5 * width;
+            real_t dy = ((i / tilesX) + 0.5) * PREVIEW_TILE_SIZE - 0.5 * height;
+            tileDistance[i] = std::make_pair(dx * dx + dy * dy, i);
+        }
+        std::sort(tileDistance.begin(), tileDistance.end());
+        previewTileOrder.resize(tileDistance.size());
+        for (size_t i = 0; i < tileDistance.size(); i++) {
+            previewTileOrder[i] = tileDistance[i].second;
+        }
+
+        previewCancel = false;
+        previewRestart = false;
+        previewRunning = true;
+        previewPoolStop = false;
+        previewChunk = 0;
+        for (int i = 0; i < MAX_THREADS_TRACE; i++) {
+            previewWorkers.push_back(std::thread(&Raytracer::previewWorker, this));
+        }
+        master_start = azGetTicks();
+        previewThread = std::thread(&Raytracer::previewLoop, this);
+    }
+
+    void Raytracer::stopPreview()
+    {
+        previewCancel = true;
+        if (previewThread.joinable()) {
+            previewThread.join();
+        }
+
+        // no chunk is handed out any more, wake the idle workers to leave
+        {
+            std::lock_guard<std::mutex> guard(previewPoolLock);
+            previewPoolStop = true;
+        }
+        previewChunkReady.notify_all();
+        for (size_t i = 0; i < previewWorkers.size(); i++) {
+            previewWorkers[i].join();
+        }
+        previewWorkers.clear();
+
+        // scatter and builds run outside the preview too, they must not see a stale cancel
+        previewCancel = false;
+        previewRestart = false;
+    }
+
+    /**
+     * Restart the preview from the first pass for a new camera. The camera is
+     * handed to the controller thread, which leaves the tile, scatter batch or
+     * tree level it is on and starts over, so the ui thread never waits for a
+     * pass. Geometry, photon maps and the irradiance cache are kept since they
+     * do not depend on the view.
+     */
+    void Raytracer::restartPreview(const Camera &camera)
+    {
+        {
+            std::lock_guard<std::mutex> guard(previewLock);
+            if (previewRunning) {
+                previewCamera = camera;
+                previewRestart = true;
+                return;
+            }
+        }
+
+        // the preview rendered all its passes, its thread is already done
+        stopPreview();
+        resetPreviewView(camera);
+        startPreview();
+    }
+
+    bool Raytracer::previewInterrupted() const
+    {
+        return previewCancel || previewRestart;
+    }
+
+    void Raytracer::resetPreviewView(const Camera &camera)
+    {
+        scene->camera = camera;
+        scene->camera.aspect = real_t(width) / real_t(height);
+        Ray::init(scene->camera);
+
+        for (size_t i = 0; i < width * height; i++) {
+            raytraceColorBuffer[i] = Color3::Black();
+        }
+        num_iteration = 1;
+        current_row = 0;
+
+        invalidateGBuffer();
+#if ENABLE_DENOISER
+        denoiser.clearGuide();
+#endif
+#if ENABLE_PHOTON_MAPPING && ENABLE_SPPM
+        sppm.reset(width * height, PHOTON_QUERY_RADIUS, SPPM_ALPHA);
+#endif
+    }
+
+    bool Raytracer::acquirePreview(unsigned char *buffer)
+    {
+        // only this side clears the dirty bit, so it can not vanish between load and exchange
+        if (!(previewMiddle.load() & PREVIEW_DIRTY)) {
+            return false;
+        }
+
+        previewFront = previewMiddle.exchange(previewFront) & ~PREVIEW_DIRTY;
+        std::copy(previewSlots[previewFront].begin(), previewSlots[previewFront].end(), buffer);
+        return true;
+    }
+
+    void Raytracer::previewLoop()
+    {
+        size_t numTiles = previewTileOrder.size();
+        size_t chunkSize = (numTiles + PREVIEW_PUBLISH_CHUNKS - 1) / PREVIEW_PUBLISH_CHUNKS;
+
+        bool is_done = false;
+        while (!previewCancel)
+        {
+            if (previewRestart)
+            {
+                Camera camera;
+                {
+                    std::lock_guard<std::mutex> guard(previewLock);
+                    camera = previewCamera;
+                    previewRestart = false;
+                }
+                resetPreviewView(camera);
+                // untraced tiles of the first stage show black, not the old view
+                std::fill(previewSlots[previewBack].begin(), previewSlots[previewBack].end(), 0);
+                master_start = azGetTicks();
                 is_done = false;
-                num_iteration++;
+            }
 
+            if (is_done)
+            {
+                // all passes rendered, leave unless the camera moved meanwhile
+                std::lock_guard<std::mutex> guard(previewLock);
+                if (!previewRestart) {
+                    previewRunning = false;
+                    return;
+                }
+                continue;
+            }
 
+#if ENABLE_PHOTON_MAPPING && !ENABLE_SPPM && C_PHOTON_MODE
+            // a restart interrupted the build of the last pass, finish it before tracing
+            if (photon_trees_stale) {
+                cPhotonKDTreeConstruction();
+                continue;
             }
-            else
+#endif
+
+            pass_start = azGetTicks();
+
+            // the first pass is split into stages of increasing resolution, every
+            // stage only traces the pixels the coarser stages left out
+            previewRefine = num_iteration == 1;
+            for (previewStep = previewRefine ? PREVIEW_COARSE_STEP : 1; previewStep >= 1 && !previewInterrupted(); previewStep /= 2)
             {
-                pass_end = SDL_GetTicks();
-                master_end = SDL_GetTicks();
+                for (size_t begin = 0; begin < numTiles && !previewInterrupted(); begin += chunkSize)
+                {
+                    size_t end = std::min(begin + chunkSize, numTiles);
+                    tracePreviewChunk(begin, end, &previewSlots[previewBack][0]);
 
-                printf("Done Progressive Photon Mapping! Iteration = %d, Total Spent = %dms\n", num_iteration, master_end - master_start);
-//                perPixelRender(buffer);
+                    // the last chunk of a pass is published after finishPass
+                    if (!previewInterrupted() && !(previewStep == 1 && end == numTiles)) {
+                        publishPreview();
+                    }
+                }
+            }
 
-                // debug varibale update
-                printf("average clear radius = %f, average shadow radius = %f, Average KDTree Construction %dms , Average Pass Spent = %dms\n", radius_clear/(float)clear_count, radius_shadow/(float)shadow_count, acc_kdtree_cons/num_iteration, acc_pass_spent/num_iteration);
+            // a cancelled or restarted pass is incomplete, never publish it
+            if (previewInterrupted()) {
+                continue;
             }
 
+            is_done = finishPass(&previewSlots[previewBack][0]);
+            if (previewInterrupted()) {
+                continue;
+            }
+            publishPreview();
         }
 
-        return is_done;
+        std::lock_guard<std::mutex> guard(previewLock);
+        previewRunning = false;
+    }
+
+    /**
+     * Hand tiles [begin, end) to the worker pool and wait until they are traced.
+     * A published frame must hold whole tiles, so the next chunk starts only
+     * once every worker is back; tiles are taken one at a time, so the wait is
+     * for the tiles still in flight.
+     */
+    void Raytracer::tracePreviewChunk(size_t begin, size_t end, unsigned char *frame)
+    {
+        std::unique_lock<std::mutex> lock(previewPoolLock);
+        previewNextTile = begin;
+        previewChunkEnd = end;
+        previewFrame = frame;
+        previewBusy = int(previewWorkers.size());
+        previewChunk++;
+        previewChunkReady.notify_all();
+        while (previewBusy > 0) {
+            previewChunkDone.wait(lock);
+        }
+    }
+
+    void Raytracer::previewWorker()
+    {
+        unsigned int chunk = 0;
+        while (true)
+        {
+            unsigned char *frame;
+            size_t chunkEnd;
+            {
+                std::unique_lock<std::mutex> lock(previewPoolLock);
+                while (!previewPoolStop && previewChunk == chunk) {
+                    previewChunkReady.wait(lock);
+                }
+                if (previewPoolStop) {
+                    return;
+                }
+                chunk = previewChunk;
+                frame = previewFrame;
+                chunkEnd = previewChunkEnd;
+            }
+
+            size_t next;
+            while (!previewInterrupted() && (next = previewNextTile.fetch_add(1)) < chunkEnd)
+            {
+                tracePreviewTile(previewTileOrder[next], frame);
+            }
+
+            std::lock_guard<std::mutex> guard(previewPoolLock);
+            if (--previewBusy == 0) {
+                previewChunkDone.notify_one();
+            }
+        }
+    }
+
+    /**
+     * Trace one tile for the current preview stage. A coarse pixel is shown
+     * as a step x step block until finer stages overwrite the rest of it, its
+     * sample stays in the accumulation buffer as the first sample of the pixel.
+     */
+    void Raytracer::tracePreviewTile(int tile, unsigned char *frame)
+    {
+        size_t tilesX = (width + PREVIEW_TILE_SIZE - 1) / PREVIEW_TILE_SIZE;
+        size_t x0 = (tile % tilesX) * PREVIEW_TILE_SIZE;
+        size_t y0 = (tile / tilesX) * PREVIEW_TILE_SIZE;
+        size_t x1 = std::min(x0 + PREVIEW_TILE_SIZE, width);
+        size_t y1 = std::min(y0 + PREVIEW_TILE_SIZE, height);
+        size_t step = previewStep;
+
+        std::vector<size_t> pixels;
+        for (size_t y = y0; y < y1; y += step)
+        {
+            for (size_t x = x0; x < x1; x += step)
+            {
+                // already traced by a coarser stage of this pass
+                if (previewRefine && step < PREVIEW_COARSE_STEP && x % (2 * step) == 0 && y % (2 * step) == 0) {
+                    continue;
+                }
+                pixels.push_back(y * width + x);
+            }
+        }
+
+        accumulatePixels(pixels, frame);
+
+        if (step == 1) {
+            return;
+        }
+        for (size_t p = 0; p < pixels.size(); p++)
+        {
+            size_t x = pixels[p] % width;
+            size_t y = pixels[p] / width;
+
+            // blocks never cross tiles, the tile size is a multiple of the coarse step
+            const unsigned char *src = &frame[4 * (y * width + x)];
+            for (size_t by = y; by < std::min(y + step, y1); by++) {
+                for (size_t bx = x; bx < std::min(x + step, x1); bx++) {
+                    std::copy(src, src + 4, &frame[4 * (by * width + bx)]);
+                }
+            }
+        }
+    }
+
+    void Raytracer::publishPreview()
+    {
+        int published = previewBack;
+        previewBack = previewMiddle.exchange(published | PREVIEW_DIRTY) & ~PREVIEW_DIRTY;
+
+        // the ui only ever reads the published frame, so copying from it is safe
+        std::copy(previewSlots[published].begin(), previewSlots[published].end(), previewSlots[previewBack].begin());
     }
 
 //    void Raytracer::perPixelRender(unsigned char* buffer)
@@ -708,7 +1945,7 @@ namespace _462 {
      * @param   t1          upper limit of t
      * @param   depth       maximun depth
      */
-    void Raytracer::photonTrace(Ray ray, real_t t0, real_t t1, int depth)
+    void Raytracer::photonTrace(Ray ray, real_t t0, real_t t1, int depth, PhotonScatterData *data)
     {
         if (depth == 0) {
             return;
@@ -717,168 +1954,192 @@ namespace _462 {
         bool isHit = false;
         HitRecord record = getClosestHit(ray, t0, t1, &isHit, Layer_All);
 
-        if (isHit)
-        {
-            // refractive
-            if (record.refractive_index > 0) {
+        if (isHit) {
+            photonScatterHit(ray, record, t0, t1, depth, data, NULL);
+        }
+    }
+
+    /**
+     * Store or bounce a photon at its hit, the part of photonTrace after the hit
+     * test. Bounces are traced right away, or queued in bounces with their
+     * remaining depth when it is not NULL.
+     */
+    void Raytracer::photonScatterHit(Ray &ray, HitRecord &record, real_t t0, real_t t1, int depth,
+                                     PhotonScatterData *data, std::vector<Ray> *bounces)
+    {
+        // refractive
+        if (record.refractive_index > 0) {
 
-                float ni = float(1.0);
-                float nt = (float)record.refractive_index;
-                float cos_theta = dot(ray.d, record.normal);
+            float ni = float(1.0);
+            float nt = (float)record.refractive_index;
+            float cos_theta = dot(ray.d, record.normal);
 
-                float reflectivity = azFresnel::FresnelDielectricEvaluate(cos_theta, ni, nt);
-                float transmity    = 1.f - reflectivity;
+            float reflectivity = azFresnel::FresnelDielectricEvaluate(cos_theta, ni, nt);
+            float transmity    = 1.f - reflectivity;
 
-                if (reflectivity > 0.f) {
-                    Vector3 reflectDirection = azReflection::reflect(ray.d, record.normal);
-                    reflectDirection = normalize(reflectDirection);
+            if (reflectivity > 0.f) {
+                Vector3 reflectDirection = azReflection::reflect(ray.d, record.normal);
+                reflectDirection = normalize(reflectDirection);
 
-                    Ray reflectRay = Ray(record.position + EPSILON * reflectDirection, reflectDirection);
+                Ray reflectRay = Ray(record.position + EPSILON * reflectDirection, reflectDirection);
 
-                    reflectRay.photon = ray.photon;
-                    reflectRay.photon.setColor(reflectRay.photon.getColor() * record.specular * reflectivity);
-                    //                    reflectRay.photon.color *= record.specular;
-                    reflectRay.photon.mask |= 0x2;
-                    photonTrace(reflectRay, t0, t1, depth - 1);
+                reflectRay.photon = ray.photon;
+                reflectRay.photon.setColor(reflectRay.photon.getColor() * record.specular * reflectivity);
+                //                    reflectRay.photon.color *= record.specular;
+                reflectRay.photon.mask |= 0x2;
+                photonBounce(reflectRay, t0, t1, depth - 1, data, bounces);
 
-                }
+            }
 
-                if (transmity > 0.f) {
+            if (transmity > 0.f) {
 
-                    Vector3 refractDirection = azReflection::refract(ray.d, record.normal, ni, nt);
-                    refractDirection = normalize(refractDirection);
+                Vector3 refractDirection = azReflection::refract(ray.d, record.normal, ni, nt);
+                refractDirection = normalize(refractDirection);
 
-                    // create refractive reflection for photon
-                    Ray refractRay = Ray(record.position + EPSILON * refractDirection , refractDirection);
-                    refractRay.photon = ray.photon;
-                    refractRay.photon.setColor(refractRay.photon.getColor() * record.specular * transmity);
-                    //                    refractRay.photon.color *= record.specular;
-                    refractRay.photon.mask |= 0x2;
-                    photonTrace(refractRay, t0, t1, depth-1);
-                }
+                // create refractive reflection for photon
+                Ray refractRay = Ray(record.position + EPSILON * refractDirection , refractDirection);
+                refractRay.photon = ray.photon;
+                refractRay.photon.setColor(refractRay.photon.getColor() * record.specular * transmity);
+                //                    refractRay.photon.color *= record.specular;
+                refractRay.photon.mask |= 0x2;
+                photonBounce(refractRay, t0, t1, depth - 1, data, bounces);
             }
-            // specular reflective
-            else if (record.specular != Color3::Black())
-            {
-                // Pure reflective surface
-                if (record.diffuse == Color3::Black()) {
+        }
+        // specular reflective
+        else if (record.specular != Color3::Black())
+        {
+            // Pure reflective surface
+            if (record.diffuse == Color3::Black()) {
+
+                Vector3 reflectDirection = azReflection::reflect(ray.d, record.normal);
+                reflectDirection = normalize(reflectDirection);
+                Ray reflectRay = Ray(record.position + reflectDirection * EPSILON, reflectDirection);
+                reflectRay.photon = ray.photon;
+                reflectRay.photon.setColor(reflectRay.photon.getColor() * record.specular);
+//                    reflectRay.photon.color *= record.specular;
+                reflectRay.photon.mask |= 0x2;
+                photonBounce(reflectRay, t0, t1, depth - 1, data, bounces);
 
+            }
+            // Hit on a surface that is both reflective and diffusive
+            else
+            {
+                real_t prob = random();
+                // Then there is a possibility of whether reflecting or absorbing
+                if (prob < 0.5) {
                     Vector3 reflectDirection = azReflection::reflect(ray.d, record.normal);
-                    reflectDirection = normalize(reflectDirection);
                     Ray reflectRay = Ray(record.position + reflectDirection * EPSILON, reflectDirection);
                     reflectRay.photon = ray.photon;
                     reflectRay.photon.setColor(reflectRay.photon.getColor() * record.specular);
-//                    reflectRay.photon.color *= record.specular;
+//                        reflectRay.photon.color *= record.specular;
                     reflectRay.photon.mask |= 0x2;
-                    photonTrace(reflectRay, t0, t1, depth - 1);
-
+                    photonBounce(reflectRay, t0, t1, depth - 1, data, bounces);
                 }
-                // Hit on a surface that is both reflective and diffusive
-                else
-                {
-                    real_t prob = random();
-                    // Then there is a possibility of whether reflecting or absorbing
-                    if (prob < 0.5) {
-                        Vector3 reflectDirection = azReflection::reflect(ray.d, record.normal);
-                        Ray reflectRay = Ray(record.position + reflectDirection * EPSILON, reflectDirection);
-                        reflectRay.photon = ray.photon;
-                        reflectRay.photon.setColor(reflectRay.photon.getColor() * record.specular);
-//                        reflectRay.photon.color *= record.specular;
-                        reflectRay.photon.mask |= 0x2;
-                        photonTrace(reflectRay, t0, t1, depth - 1);
-                    }
-                    else {
-                        // absorb
-                        if (photon_indirect_list.size() < INDIRECT_PHOTON_NEEDED)
-                        {
-                            ray.photon.position = record.position;
+                else {
+                    // absorb
+                    if (data->indirect_needed > 0)
+                    {
+                        ray.photon.setPosition(record.position);
 //                            ray.photon.direction = -ray.d;
-                            setPhotonDirection(ray.photon, -ray.d);
-//                            ray.photon.setDirection(-ray.d);
+                        ray.photon.setDirection(-ray.d);
 //                            ray.photon.color = ray.photon.color;// * record.diffuse;
 //                            ray.photon.color = ray.photon.color/
 //                            ray.photon.normal = record.normal;
-                            photon_indirect_list.push_back(ray.photon);
-                        }
-
+                        data->worker_photon_indirect.push_back(ray.photon);
+                        data->indirect_needed--;
                     }
+
                 }
             }
-            // diffusive
-            else {
-                // direct illumination, do not store
-                if (ray.photon.mask == 0x0) {
-                    // consider don't do direct illumination
-                    // if remove this, global photons could be faster but caustics are getting far slower
-                    real_t prob = random();
-                    if (prob > PROB_DABSORB) {
-                        Ray photonRay = Ray(record.position, uniformSampleHemisphere(record.normal));
-                        photonRay.photon = ray.photon;
-                        photonRay.photon.mask |= 0x1;
+        }
+        // diffusive
+        else {
+            // direct illumination, do not store
+            if (ray.photon.mask == 0x0) {
+                // consider don't do direct illumination
+                // if remove this, global photons could be faster but caustics are getting far slower
+                real_t prob = random();
+                if (prob > PROB_DABSORB) {
+                    Ray photonRay = Ray(record.position, uniformSampleHemisphere(record.normal));
+                    photonRay.photon = ray.photon;
+                    photonRay.photon.mask |= 0x1;
 //                        photonRay.photon.color = ray.photon.color * record.diffuse;
-                        photonRay.photon.setColor(ray.photon.getColor() * record.diffuse);
+                    photonRay.photon.setColor(ray.photon.getColor() * record.diffuse);
 //                        photonRay.photon.setColor(ray.photon.getColor()  * (real_t(1)/real_t(1.0 - PROB_DABSORB)));
 
 //                        ray.photon.color *= real_t(1)/real_t(1.0 - PROB_DABSORB);
 //                        ray.photon.setColor(ray.photon.getColor() * (real_t(1)/real_t(1.0 - PROB_DABSORB)));
 
-                        photonTrace(photonRay, t0, t1, depth-1);
-                    }
+                    photonBounce(photonRay, t0, t1, depth - 1, data, bounces);
+                }
 //                    else
 //                    {
 //                        // absorb
 //                        if (photon_indirect_list.size() < INDIRECT_PHOTON_NEEDED)
 //                        {
-//                            ray.photon.position = record.position;
+//                            ray.photon.setPosition(record.position);
 //                            ray.photon.direction = -ray.d;
 //                            ray.photon.normal = record.normal;
 //                            photon_indirect_list.push_back(ray.photon);
 //                        }
 //                    }
-                }
-                // caustics
-                else if (ray.photon.mask == 0x2) {
+            }
+            // caustics
+            else if (ray.photon.mask == 0x2) {
 //                    printf("nice mask!\n");
-                    if (photon_caustic_list.size() < CAUSTICS_PHOTON_NEEDED) {
-                        ray.photon.position = record.position;
+                if (data->caustics_needed > 0) {
+                    ray.photon.setPosition(record.position);
 //                        ray.photon.direction = -ray.d;
-                        setPhotonDirection(ray.photon, -ray.d);
+                    ray.photon.setDirection(-ray.d);
 //                        ray.photon.normal = (record.normal);
-                        photon_caustic_list.push_back(ray.photon);
+                    data->worker_photon_caustics.push_back(ray.photon);
+                    data->caustics_needed--;
 
-                    }
                 }
-                // indirect illumination
-                else {
-                    real_t prob = random();
-                    if (prob < PROB_DABSORB) {
-                        // Store photon in indirect illumination map
-                        if (photon_indirect_list.size() < INDIRECT_PHOTON_NEEDED) {
-                            ray.photon.position = (record.position);
+            }
+            // indirect illumination
+            else {
+                real_t prob = random();
+                if (prob < PROB_DABSORB) {
+                    // Store photon in indirect illumination map
+                    if (data->indirect_needed > 0) {
+                        ray.photon.setPosition(record.position);
 //                            ray.photon.direction = (-ray.d);
-                            setPhotonDirection(ray.photon, -ray.d);
+                        ray.photon.setDirection(-ray.d);
 //                            ray.photon.normal = (record.normal);
 //                            ray.photon.color *= real_t(1)/real_t(PROB_DABSORB);
-                            ray.photon.setColor(ray.photon.getColor() * (real_t(1)/real_t(PROB_DABSORB)));
-                            photon_indirect_list.push_back(ray.photon);
-                        }
+                        ray.photon.setColor(ray.photon.getColor() * (real_t(1)/real_t(PROB_DABSORB)));
+                        data->worker_photon_indirect.push_back(ray.photon);
+                        data->indirect_needed--;
                     }
-                    else {
-                        // Generate a diffusive reflect
-                        Ray photonRay = Ray(record.position, uniformSampleHemisphere(record.normal));
-                        photonRay.photon = ray.photon;
-                        photonRay.photon.mask |= 0x1;
+                }
+                else {
+                    // Generate a diffusive reflect
+                    Ray photonRay = Ray(record.position, uniformSampleHemisphere(record.normal));
+                    photonRay.photon = ray.photon;
+                    photonRay.photon.mask |= 0x1;
 //                        photonRay.photon.color = (ray.photon.color * record.diffuse);
-                        photonRay.photon.setColor(ray.photon.getColor() * record.diffuse);
+                    photonRay.photon.setColor(ray.photon.getColor() * record.diffuse);
 //                        ray.photon.color *= real_t(1)/real_t(1.0 - PROB_DABSORB);
-                        ray.photon.setColor(ray.photon.getColor() * (real_t(1)/real_t(1.0 - PROB_DABSORB)));
-                        photonTrace(photonRay, t0, t1, depth-1);
-                    }
+                    ray.photon.setColor(ray.photon.getColor() * (real_t(1)/real_t(1.0 - PROB_DABSORB)));
+                    photonBounce(photonRay, t0, t1, depth - 1, data, bounces);
                 }
             }
         }
     }
 
+    void Raytracer::photonBounce(Ray &ray, real_t t0, real_t t1, int depth,
+                                 PhotonScatterData *data, std::vector<Ray> *bounces)
+    {
+        if (!bounces) {
+            photonTrace(ray, t0, t1, depth, data);
+        }
+        else if (depth > 0) {
+            ray.depth = depth;
+            bounces->push_back(ray);
+        }
+    }
+
     /**
      * @brief   Ray tracing a given ray, return the color of the hiting point on surface
      * @param   ray     Ray to trace
@@ -909,7 +2170,11 @@ namespace _462 {
      * @param   depth   Recursion depth
      * @return  Color3  Shading color of hit point, after calculating diffusive, ambient, reflection etc.
      */
-    Color3 Raytracer::shade(Ray ray, HitRecord record, real_t t0, real_t t1, int depth)
+#if ENABLE_PHOTON_MAPPING && !ENABLE_SPPM && C_PHOTON_MODE
+    Color3 Raytracer::shade(Ray ray, HitRecord record, real_t t0, real_t t1, int depth, const Color3 *gathered)
+#else
+    Color3 Raytracer::shade(Ray ray, HitRecord record, real_t t0, real_t t1, int depth, const Color3 * /*gathered*/)
+#endif
     {
         Color3 radiance = Color3::Black();
 
@@ -926,27 +2191,38 @@ namespace _462 {
             // Xiao debug, 8/11/2014, at SIGGRAPH
             // TODO: Actually apply BRDF for path tracing
             // try to simulate lambertian BRDF model for monte carlo path tracing
-            Color3 indirectRadiance = Color3::Black();
-            for (int i = 0; i < PT_GI_SAMPLE; i++) {
-                Vector3 dir = uniformSampleHemisphere(record.normal);
-                Ray secondRay = Ray(record.position + dir * EPSILON, dir);
+    #if ENABLE_IRRADIANCE_CACHE
+            // first diffuse bounce comes from the cache, lambertian BRDF is diffuse/pi
+            if (depth == RAYTRACE_DEPTH)
+            {
+                radiance += record.diffuse * irradianceCacheLookup(record, t0, t1, depth) * INV_PI;
+            }
+            else
+    #endif
+            {
+                Color3 indirectRadiance = Color3::Black();
+                for (int i = 0; i < PT_GI_SAMPLE; i++) {
+                    Vector3 dir = uniformSampleHemisphere(record.normal);
+                    Ray secondRay = Ray(record.position + dir * EPSILON, dir);
 
-                Color3 Li = record.diffuse * trace(secondRay, t0, t1, depth - 1);
+                    Color3 Li = record.diffuse * trace(secondRay, t0, t1, depth - 1);
 
-                indirectRadiance += Li;
+                    indirectRadiance += Li;
 
+                }
+                radiance += indirectRadiance * (1.f/float(PT_GI_SAMPLE));
             }
-            radiance += indirectRadiance * (1.f/float(PT_GI_SAMPLE));
 
 #else
 #endif
             // normal
-#if ENABLE_PHOTON_MAPPING
+#if ENABLE_PHOTON_MAPPING && !ENABLE_SPPM
                 int coeef = 25;
     #if C_PHOTON_MODE
                 if (CAUSTICS_PHOTON_NEEDED + INDIRECT_PHOTON_NEEDED > 0)
                 {
-                    Color3 photonRadiance = shade_cphotons(record, PHOTON_QUERY_RADIUS, 0.001) * (2.0/(CAUSTICS_PHOTON_NEEDED + INDIRECT_PHOTON_NEEDED)) * coeef;
+                    Color3 photonColor = gathered ? *gathered : shade_cphotons(record, PHOTON_QUERY_RADIUS, PHOTON_GATHER_NUM);
+                    Color3 photonRadiance = photonColor * (2.0/(CAUSTICS_PHOTON_NEEDED + INDIRECT_PHOTON_NEEDED)) * coeef;
                     photonRadiance = clamp(photonRadiance, 0, 1.0);
                     radiance += photonRadiance;
                     radiance = clamp(radiance, 0, 1.0);
@@ -959,6 +2235,134 @@ namespace _462 {
         return record.texture * radiance;
     }
 
+    /**
+     * @brief Irradiance at a diffuse hit. Interpolated from nearby cache records
+     *        when one of them is valid here, otherwise a new record is sampled
+     *        and stored, so hemisphere rays are only traced at sparse points.
+     */
+    Color3 Raytracer::irradianceCacheLookup(HitRecord &record, real_t t0, real_t t1, int depth)
+    {
+        Color3 irradiance = Color3::Black();
+        if (irradianceCache.interpolate(record.position, record.normal, &irradiance)) {
+            return irradiance;
+        }
+
+        IrradianceRecord irradianceRecord = sampleIrradianceRecord(record, t0, t1, depth);
+        irradianceCache.insert(irradianceRecord);
+        return irradianceRecord.irradiance;
+    }
+
+    /**
+     * @brief Sample irradiance over the hemisphere at a hit with cosine weighted
+     *        strata, and estimate rotation and translation gradients from the
+     *        same samples (Ward & Heckbert 1992).
+     */
+    IrradianceRecord Raytracer::sampleIrradianceRecord(HitRecord &record, real_t t0, real_t t1, int depth)
+    {
+        const int M = IRRADIANCE_CACHE_THETA;
+        const int N = IRRADIANCE_CACHE_PHI;
+
+        // tangent frame around the normal
+        Vector3 n = record.normal;
+        Vector3 helper = fabs(n.x) > 0.5 ? Vector3(0, 1, 0) : Vector3(1, 0, 0);
+        Vector3 u = normalize(cross(helper, n));
+        Vector3 v = cross(n, u);
+
+        std::vector<Color3> L(M * N);
+        std::vector<real_t> r(M * N);
+        std::vector<real_t> theta(M * N);
+
+        real_t invDistSum = 0;
+        int hitCount = 0;
+
+        for (int j = 0; j < M; j++) {
+            for (int k = 0; k < N; k++) {
+                real_t sampleTheta = asin(sqrt((j + random()) / M));
+                real_t samplePhi = 2 * PI * (k + random()) / N;
+                Vector3 dir = sin(sampleTheta) * cos(samplePhi) * u +
+                              sin(sampleTheta) * sin(samplePhi) * v +
+                              cos(sampleTheta) * n;
+
+                Ray sampleRay = Ray(record.position + dir * EPSILON, dir);
+                bool isHit = false;
+                HitRecord sampleRecord = getClosestHit(sampleRay, t0, t1, &isHit, Layer_All);
+
+                int idx = j * N + k;
+                theta[idx] = sampleTheta;
+                if (isHit) {
+                    L[idx] = shade(sampleRay, sampleRecord, t0, t1, depth - 1);
+                    r[idx] = sampleRecord.t;
+                    invDistSum += 1.0 / std::max(sampleRecord.t, EPSILON);
+                    hitCount++;
+                }
+                else {
+                    L[idx] = scene->background_color;
+                    r[idx] = INFINITY;
+                }
+            }
+        }
+
+        IrradianceRecord irradianceRecord;
+        irradianceRecord.position = record.position;
+        irradianceRecord.normal = n;
+        irradianceRecord.radius = hitCount > 0 ? hitCount / invDistSum : INFINITY;
+
+        Color3 sum = Color3::Black();
+        for (int i = 0; i < M * N; i++) {
+            sum += L[i];
+        }
+        irradianceRecord.irradiance = sum * (PI / (M * N));
+
+        for (int c = 0; c < 3; c++) {
+            irradianceRecord.rotGradient[c] = Vector3::Zero();
+            irradianceRecord.transGradient[c] = Vector3::Zero();
+        }
+
+        for (int k = 0; k < N; k++) {
+            real_t phi = 2 * PI * (k + 0.5) / N;
+            real_t phiMinus = 2 * PI * k / N;
+            Vector3 uk = cos(phi) * u + sin(phi) * v;                       // center of the phi stratum
+            Vector3 vk = -sin(phi) * u + cos(phi) * v;                      // perpendicular to it
+            Vector3 vkMinus = -sin(phiMinus) * u + cos(phiMinus) * v;       // across its lower phi edge
+            int kPrev = (k + N - 1) % N;
+
+            for (int j = 0; j < M; j++) {
+                int idx = j * N + k;
+                real_t sinThetaMinus = sqrt(real_t(j) / M);
+                real_t sinThetaPlus = sqrt(real_t(j + 1) / M);
+
+                // rotation: tilting the normal changes the cosine weight of each sample
+                real_t rotWeight = -tan(theta[idx]) * (PI / (M * N));
+
+                // translation across the theta edge shared with stratum j - 1
+                real_t thetaWeight = 0;
+                Color3 thetaDiff = Color3::Black();
+                if (j > 0) {
+                    int idxPrev = (j - 1) * N + k;
+                    real_t cosThetaMinus2 = 1 - sinThetaMinus * sinThetaMinus;
+                    thetaWeight = (2 * PI / N) * sinThetaMinus * cosThetaMinus2 / std::min(r[idx], r[idxPrev]);
+                    thetaDiff = L[idx] - L[idxPrev];
+                }
+
+                // translation across the phi edge shared with stratum k - 1
+                int idxLeft = j * N + kPrev;
+                real_t phiWeight = (sinThetaPlus - sinThetaMinus) / std::min(r[idx], r[idxLeft]);
+                Color3 phiDiff = L[idx] - L[idxLeft];
+
+                const float Lc[3] = { L[idx].r, L[idx].g, L[idx].b };
+                const float thetaDiffc[3] = { thetaDiff.r, thetaDiff.g, thetaDiff.b };
+                const float phiDiffc[3] = { phiDiff.r, phiDiff.g, phiDiff.b };
+                for (int c = 0; c < 3; c++) {
+                    irradianceRecord.rotGradient[c] += vk * (rotWeight * Lc[c]);
+                    irradianceRecord.transGradient[c] += uk * (thetaWeight * thetaDiffc[c]) +
+                                                         vkMinus * (phiWeight * phiDiffc[c]);
+                }
+            }
+        }
+
+        return irradianceRecord;
+    }
+
     /**
      * @brief Do direct illumination for ray tracing
      */
@@ -1007,110 +2411,167 @@ namespace _462 {
     Color3 Raytracer::shade_caustics(HitRecord &record, real_t radius, size_t num_samples)
     {
         Color3 causticsColor = Color3::Black();
-        std::vector<Photon> nearestCausticPhotons;
 
-        if (record.refractive_index == 0)
+        // the balanced tree is 1-based, slot 0 is unused
+        if (record.refractive_index == 0 && kdtree_photon_caustic_list.size() > 1)
         {
-            // sample radius
-//            real_t sampleSquaredRadiusCaustics = 0.04;   // 0.1 // 0.001 // 0.0225
-//            real_t maxSquaredDistCaustics = 0.001;      // 0.001 // 0.001
-            size_t maxPhotonsEstimate = num_samples;
-
-            // gather samples
-            // TODO: doing nearest neighbor search with KD Tree
-            float maxSearchSquaredRadius = radius * 0.9;
-            while (nearestCausticPhotons.size() == 0) {
-                maxSearchSquaredRadius /= 0.9;
-                locatePhotons(1, record.position, kdtree_photon_caustic_list, nearestCausticPhotons, maxSearchSquaredRadius, maxPhotonsEstimate);
-            }
-
+            // the num_samples nearest photons within radius, one query: a full heap
+            // shrinks the radius to the farthest photon kept
+            azNearestPhotons nearest(num_samples, radius);
+            locatePhotons(1, record.position, kdtree_photon_caustic_list, nearest);
 
             // calculate radiance
-            for (size_t i = 0; i < nearestCausticPhotons.size(); i++)
+            for (size_t i = 0; i < nearest.size(); i++)
             {
-                causticsColor +=
-                record.getPhotonLambertianColor(getPhotonDirection(nearestCausticPhotons[i]), nearestCausticPhotons[i].getColor());
-//                record.getPhotonLambertianColor(nearestCausticPhotons[i].direction, nearestCausticPhotons[i].getColor())
-//                * getConeFilterWeight(sqrt(nearestCausticPhotons[i].squaredDistance), sqrt(sampleSquaredRadiusCaustics));
-                //* getGaussianFilterWeight(nearestCausticPhotons[i].squaredDistance, maxPhotonsEstimate);
+                Photon &photon = kdtree_photon_caustic_list[nearest[i]];
+                causticsColor += record.getPhotonLambertianColor(photon.getDirection(), photon.getColor());
             }
 
             // color/= PI*r^2
-//            causticsColor *= (real_t(1)/((real_t(1) - real_t(2)/(real_t(3) * CONE_K)) * (PI * maxSquaredDistCaustics))) * (1.0/(CAUSTICS_PHOTON_NEEDED));
-            causticsColor = causticsColor * (real_t(1)/(PI * maxSearchSquaredRadius));// * 0.0001;// * (1.0/(CAUSTICS_PHOTON_NEEDED));
+            causticsColor = causticsColor * (real_t(1)/(PI * nearest.sqrDist));
         }
 
-        nearestCausticPhotons.clear();
-
         return causticsColor;
 
     }
 
+    void Raytracer::cPhotonGather(const Vector3 &position, bool caustics, azNearestPhotons &nearest)
+    {
+#if ENABLE_PHOTON_GRID
+        const float query[3] = { float(position.x), float(position.y), float(position.z) };
+        (caustics ? photon_caustics_grid : photon_indirect_grid).locate(query, nearest);
+#else
+        if (caustics) {
+            vvhcPhotonLocate(position, vvh_caustics_root, ispc_cphoton_caustics_data, photon_caustic_list, nearest);
+        }
+        else {
+            vvhcPhotonLocate(position, vvh_indirect_root, ispc_cphoton_indirect_data, photon_indirect_list, nearest);
+        }
+#endif
+    }
+
+    Color3 Raytracer::shadeNearestCPhotons(HitRecord &record, bool caustics, const azNearestPhotons &nearest)
+    {
+        std::vector<Photon> &list = caustics ? photon_caustic_list : photon_indirect_list;
+
+        Color3 color = Color3::Black();
+        for (size_t i = 0; i < nearest.size(); i++)
+        {
+            Photon &photon = list[nearest[i]];
+            color += record.getPhotonLambertianColor(photon.getDirection(), photon.getColor());
+        }
+
+        // color/= PI*r^2
+        return color * (real_t(1)/(PI * nearest.sqrDist));
+    }
+
     Color3 Raytracer::shade_cphotons(HitRecord &record, real_t radius, size_t num_samples)
     {
         Color3 color = Color3::Black();
-        std::vector<int> nearestPhotonIndices;
-        std::vector<Photon> sourcePhotons;
 
         if (record.refractive_index == 0)
         {
-            size_t maxPhotonsEstimate = num_samples;
-            float maxSearchSquaredRadius = radius;// * 0.9;
+#if ENABLE_PRECOMPUTED_IRRADIANCE
+            unsigned int lookupStart = azGetTicks();
+            color = shadePrecomputedIrradiance(record);
+            acc_iphoton_search_time += azGetTicks() - lookupStart;
+            return color;
+#endif
+
+            // each map is estimated over its own radius, a full heap shrinks it
+            azNearestPhotons nearestIndirect(num_samples, radius);
+            azNearestPhotons nearestCaustics(num_samples, radius);
 
             unsigned int start, end;
-            if (sourcePhotons.size() == 0)
-            {
-//                maxSearchSquaredRadius /= 0.9;
-                start = SDL_GetTicks();
-                vvhcPhotonLocate(record.position,
-                                 vvh_indirect_root,
-                                 ispc_cphoton_indirect_data,
-                                 cphoton_indirect_data,
-                                 nearestPhotonIndices,
-                                 maxSearchSquaredRadius,
-                                 maxPhotonsEstimate);
-
-                // convert cphoton to normal photon
-                for (size_t i = 0; i < nearestPhotonIndices.size(); i++)
-                {
-                    sourcePhotons.push_back(photon_indirect_list[nearestPhotonIndices[i]]);
-                }
-                nearestPhotonIndices.clear();
-                end = SDL_GetTicks();
-                acc_iphoton_search_time += end - start;
-
-                start = SDL_GetTicks();
-                vvhcPhotonLocate(record.position,
-                                 vvh_caustics_root,
-                                 ispc_cphoton_caustics_data,
-                                 cphoton_caustics_data,
-                                 nearestPhotonIndices,
-                                 maxSearchSquaredRadius,
-                                 maxPhotonsEstimate);
-
-                // convert cphoton to normal photon
-                for (size_t i = 0; i < nearestPhotonIndices.size(); i++)
-                {
-                    sourcePhotons.push_back(photon_caustic_list[nearestPhotonIndices[i]]);
-                }
-                nearestPhotonIndices.clear();
-                end = SDL_GetTicks();
-                acc_cphoton_search_time += end - start;
-            }
 
-//            printf("source photon = %ld\n",sourcePhotons.size());
-            // shade
-            for (size_t i = 0; i < sourcePhotons.size(); i++)
+            start = azGetTicks();
+            cPhotonGather(record.position, false, nearestIndirect);
+            end = azGetTicks();
+            acc_iphoton_search_time += end - start;
+
+            start = azGetTicks();
+            cPhotonGather(record.position, true, nearestCaustics);
+            end = azGetTicks();
+            acc_cphoton_search_time += end - start;
+
+            color = shadeNearestCPhotons(record, false, nearestIndirect) +
+                    shadeNearestCPhotons(record, true, nearestCaustics);
+        }
+
+        return color;
+    }
+
+    /**
+     * @brief shade_cphotons for a whole buffer of hits. The points are sorted by
+     *        their Morton code inside the bounds of the batch, so consecutive
+     *        queries walk mostly the same kd-tree nodes and leaves while they are
+     *        still in cache. The indirect tree is searched for all points, then
+     *        the caustics tree, instead of switching trees every point. Colors
+     *        are the same as from shade_cphotons, black for misses and
+     *        refractive surfaces.
+     */
+    void Raytracer::shade_cphotons_batch(HitRecord *records, size_t count, real_t radius, size_t num_samples, Color3 *colors)
+    {
+        Vector3 boundMin(INFINITY, INFINITY, INFINITY);
+        Vector3 boundMax(-INFINITY, -INFINITY, -INFINITY);
+
+        std::vector<std::pair<unsigned int, size_t> > order;
+        order.reserve(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            colors[i] = Color3::Black();
+            if (records[i].isHit && records[i].refractive_index == 0)
             {
-//                std::cout<<sourcePhotons[i].getColor()<<std::endl;
-                color +=
-                record.getPhotonLambertianColor(getPhotonDirection(sourcePhotons[i]), sourcePhotons[i].getColor());
+                order.push_back(std::make_pair(0u, i));
+                boundMin = vmin(boundMin, records[i].position);
+                boundMax = vmax(boundMax, records[i].position);
             }
+        }
 
-            color *= (real_t(1)/(PI * maxSearchSquaredRadius));
+        if (order.empty()) {
+            return;
         }
 
-        return color;
+        Vector3 invExtent = azMortonInvExtent(boundMin, boundMax);
+        for (size_t k = 0; k < order.size(); k++) {
+            order[k].first = azMortonCode(records[order[k].second].position, boundMin, invExtent);
+        }
+        std::sort(order.begin(), order.end());
+
+#if ENABLE_PRECOMPUTED_IRRADIANCE
+        unsigned int lookupStart = azGetTicks();
+        for (size_t k = 0; k < order.size(); k++) {
+            colors[order[k].second] = shadePrecomputedIrradiance(records[order[k].second]);
+        }
+        acc_iphoton_search_time += azGetTicks() - lookupStart;
+        return;
+#endif
+
+        // one heap reused by every query of a sweep
+        azNearestPhotons nearest(num_samples, radius);
+        unsigned int start, end;
+
+        start = azGetTicks();
+        for (size_t k = 0; k < order.size(); k++)
+        {
+            HitRecord &record = records[order[k].second];
+            nearest.reset(radius);
+            cPhotonGather(record.position, false, nearest);
+            colors[order[k].second] += shadeNearestCPhotons(record, false, nearest);
+        }
+        end = azGetTicks();
+        acc_iphoton_search_time += end - start;
+
+        start = azGetTicks();
+        for (size_t k = 0; k < order.size(); k++)
+        {
+            HitRecord &record = records[order[k].second];
+            nearest.reset(radius);
+            cPhotonGather(record.position, true, nearest);
+            colors[order[k].second] += shadeNearestCPhotons(record, true, nearest);
+        }
+        end = azGetTicks();
+        acc_cphoton_search_time += end - start;
     }
 
     void Raytracer::PacketizedRayIntersection(azPacket<Ray> &rayPacket, azPacket<HitRecord> &recordPacket, float t0, float t1)
@@ -1223,213 +2684,113 @@ namespace _462 {
         return (real_t(1) - dist_x_p/(CONE_K * dist_max));
     }
 
-    void Raytracer::balance(size_t index, std::vector<Photon> &balancedKDTree, std::vector<Photon> &list)
+    static inline real_t balanceCoord(const Photon &photon, int axis)
     {
-        if (index == 1) {
-            assert((balancedKDTree.size() == (list.size() + 1)));
-        }
-
-        if (list.size() == 1) {
-            balancedKDTree[index] = list[0];
-            return;
-        }
-
-        // If there is no data in photon list, do nothing and return
-        if (list.size() == 0) {
-            // actually program should not run to here, this should be checked on subdivision
-            return;
-        }
-
-        // get the surrounding cube
-        // O(N)
-        Vector3 max = Vector3(-INFINITY, -INFINITY, -INFINITY);
-        Vector3 min = Vector3(INFINITY, INFINITY, INFINITY);
-        for (std::vector<Photon>::iterator it = list.begin(); it != list.end(); it++)
-        {
-            // calculate box
-            max.x = it->position.x >= max.x ? it->position.x : max.x;
-            max.y = it->position.y >= max.y ? it->position.y : max.y;
-            max.z = it->position.z >= max.z ? it->position.z : max.z;
-
-            min.x = it->position.x <= min.x ? it->position.x : min.x;
-            min.y = it->position.y <= min.y ? it->position.y : min.y;
-            min.z = it->position.z <= min.z ? it->position.z : min.z;
-        }
-
-        char splitAxis = -1;
-        Vector3 diff = Vector3(max.x - min.x, max.y - min.y, max.z - min.z);
-        if ((diff.x >= diff.y) && (diff.x >= diff.z))
-            splitAxis = 0;
-        else if ((diff.y >= diff.x) && (diff.y >= diff.z))
-            splitAxis = 1;
-        else if ((diff.z >= diff.x) && (diff.z >= diff.y))
-            splitAxis = 2;
-
-        // Sorting the vector
-        bool (*comparator)(const Photon &a, const Photon &b) = NULL;
-
-        switch (splitAxis) {
-            case 0:
-                comparator = photonComparatorX;
-                break;
-            case 1:
-                comparator = photonComparatorY;
-                break;
-            case 2:
-                comparator = photonComparatorZ;
-                break;
-
-            default:
-                break;
-        }
-
-        // O(NlogN)
-        std::sort(list.begin(), list.end(), comparator);
-
-        // On Left-balancing Binary Trees, J. Andreas Brentzen (jab@imm.dtu.dk)
-        size_t N = list.size();
-        size_t exp = (size_t)log2(N);
-        size_t M = pow(2, exp);
-        size_t R = N - (M - 1);
-        size_t LT, RT;
-        if (R <= M/2)
-        {
-            LT = (M - 2)/2 + R;
-            RT = (M - 2)/2;
-        }
-        else
-        {
-            LT = (M - 2)/2 + M/2;
-            RT = (M - 2)/2 + R - M/2;
-        }
-        size_t const median = LT;
-
-        // if more than One data
-        Photon p = list[median];
-        p.splitAxis = splitAxis;
-        assert(index < balancedKDTree.size());
-        balancedKDTree[index] = p;
-
-//        printf("LT = %d, RT = %d\n", LT, RT);
-
-        if (LT > 0) {
-            std::vector<Photon> leftList(list.begin(), list.begin() + median);
-            balance(2 * index, balancedKDTree, leftList);
-        }
-
-        if (RT > 0) {
-            std::vector<Photon> rightList(list.begin() + median + 1, list.end());
-            balance(2 * index + 1, balancedKDTree, rightList);
-        }
-
-        list.clear();
+        return photon.position[axis];
     }
-
-
-    // TODO: change to c style kdtree, and use ispc for parallelism
-    void Raytracer::cPhotonBalance(size_t index, std::vector<cPhoton> &balancedKDTree, std::vector<cPhoton> &list)
-    {
-        if (index == 1) {
-            assert((balancedKDTree.size() == (list.size() + 1)));
-        }
-
-        if (list.size() == 1) {
-            balancedKDTree[index] = list[0];
-            return;
-        }
-
-        // If there is no data in photon list, do nothing and return
-        if (list.size() == 0) {
-            // actually program should not run to here, this should be checked on subdivision
-            return;
-        }
-
-
-        // get the surrounding cube
-        // O(N)
-        Vector3 max = Vector3(-INFINITY, -INFINITY, -INFINITY);
-        Vector3 min = Vector3(INFINITY, INFINITY, INFINITY);
-        // TODO: parallel
-        for (std::vector<cPhoton>::iterator it = list.begin(); it != list.end(); it++)
-        {
-            // calculate box
-            max.x = it->position[0] >= max.x ? it->position[0] : max.x;
-            max.y = it->position[1] >= max.y ? it->position[1] : max.y;
-            max.z = it->position[2] >= max.z ? it->position[2] : max.z;
-
-            min.x = it->position[0] <= min.x ? it->position[0] : min.x;
-            min.y = it->position[1] <= min.y ? it->position[1] : min.y;
-            min.z = it->position[2] <= min.z ? it->position[2] : min.z;
-        }
-
-        char splitAxis = -1;
-        Vector3 diff = Vector3(max.x - min.x, max.y - min.y, max.z - min.z);
-        if ((diff.x >= diff.y) && (diff.x >= diff.z))
-            splitAxis = 0;
-        else if ((diff.y >= diff.x) && (diff.y >= diff.z))
-            splitAxis = 1;
-        else if ((diff.z >= diff.x) && (diff.z >= diff.y))
-            splitAxis = 2;
-
-        // Sorting the vector
-        bool (*comparator)(const cPhoton &a, const cPhoton &b) = NULL;
-
-        switch (splitAxis) {
-            case 0:
-                comparator = cPhotonComparatorX;
-                break;
-            case 1:
-                comparator = cPhotonComparatorY;
-                break;
-            case 2:
-                comparator = cPhotonComparatorZ;
-                break;
-
-            default:
-                break;
+
+    /**
+     * Left-balanced kd-tree of Jensen over list[head, tail), stored from index on.
+     * Works in place on one array: nth_element moves the left-balanced median of
+     * the split axis to its final slot with the two halves around it, and each
+     * half is balanced in its own range. The split axis is the longest side of
+     * the cell, which is handed down cut at the median, so photons are only
+     * touched by nth_element, O(n log n) in all. The first levels give one half
+     * to a new thread while this one balances the other.
+     */
+    template<typename T>
+    static void balanceRange(size_t index, std::vector<T> &balancedKDTree, std::vector<T> &list,
+                             size_t head, size_t tail, Vector3 cellMin, Vector3 cellMax, int parallelLevels)
+    {
+        size_t N = tail - head;
+        if (N == 0) {
+            return;
+        }
+        if (N == 1) {
+            balancedKDTree[index] = list[head];
+            return;
         }
 
-        // O(NlogN)
-        std::sort(list.begin(), list.end(), comparator);
+        Vector3 diff = cellMax - cellMin;
+        int splitAxis = 2;
+        if ((diff.x >= diff.y) && (diff.x >= diff.z))
+            splitAxis = 0;
+        else if ((diff.y >= diff.x) && (diff.y >= diff.z))
+            splitAxis = 1;
 
-        // On Left-balancing Binary Trees, J. Andreas Brentzen (jab@imm.dtu.dk)
-        size_t N = list.size();
+        // On Left-balancing Binary Trees, J. Andreas Baerentzen (jab@imm.dtu.dk)
         size_t exp = (size_t)log2(N);
-        size_t M = pow(2, exp);
+        size_t M = size_t(1) << exp;
         size_t R = N - (M - 1);
-        size_t LT, RT;
+        size_t LT;
         if (R <= M/2)
-        {
             LT = (M - 2)/2 + R;
-            RT = (M - 2)/2;
-        }
         else
-        {
             LT = (M - 2)/2 + M/2;
-            RT = (M - 2)/2 + R - M/2;
-        }
-        size_t const median = LT;
+        size_t const median = head + LT;
 
-        // if more than One data
-        cPhoton p = list[median];
+        std::nth_element(list.begin() + head, list.begin() + median, list.begin() + tail,
+                         [splitAxis](const T &a, const T &b) {
+                             return balanceCoord(a, splitAxis) < balanceCoord(b, splitAxis);
+                         });
+
+        T p = list[median];
         p.splitAxis = splitAxis;
         assert(index < balancedKDTree.size());
         balancedKDTree[index] = p;
 
-//        printf("LT = %d, RT = %d\n", LT, RT);
+        Vector3 leftMax = cellMax;
+        Vector3 rightMin = cellMin;
+        leftMax[splitAxis] = balanceCoord(p, splitAxis);
+        rightMin[splitAxis] = balanceCoord(p, splitAxis);
+
+        if (parallelLevels > 0 && N >= BALANCE_PARALLEL_GRANULARITY)
+        {
+            std::thread left(balanceRange<T>, 2 * index, std::ref(balancedKDTree), std::ref(list),
+                             head, median, cellMin, leftMax, parallelLevels - 1);
+            balanceRange(2 * index + 1, balancedKDTree, list, median + 1, tail, rightMin, cellMax, parallelLevels - 1);
+            left.join();
+        }
+        else
+        {
+            balanceRange(2 * index, balancedKDTree, list, head, median, cellMin, leftMax, 0);
+            balanceRange(2 * index + 1, balancedKDTree, list, median + 1, tail, rightMin, cellMax, 0);
+        }
+    }
+
+    // bounds of list[head, tail) and thread levels, then the in-place builder
+    template<typename T>
+    static void balanceList(size_t index, std::vector<T> &balancedKDTree, std::vector<T> &list,
+                            size_t head, size_t tail)
+    {
+        if (index == 1) {
+            assert((balancedKDTree.size() == (tail - head + 1)));
+        }
 
-        if (LT > 0) {
-            std::vector<cPhoton> leftList(list.begin(), list.begin() + median);
-            cPhotonBalance(2 * index, balancedKDTree, leftList);
+        Vector3 max = Vector3(-INFINITY, -INFINITY, -INFINITY);
+        Vector3 min = Vector3(INFINITY, INFINITY, INFINITY);
+        for (size_t i = head; i < tail; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                max[axis] = std::max(max[axis], balanceCoord(list[i], axis));
+                min[axis] = std::min(min[axis], balanceCoord(list[i], axis));
+            }
         }
 
-        if (RT > 0) {
-            std::vector<cPhoton> rightList(list.begin() + median + 1, list.end());
-            cPhotonBalance(2 * index + 1, balancedKDTree, rightList);
+        // 2^levels subtrees get a thread each
+        int parallelLevels = 0;
+        while ((1 << parallelLevels) < MAX_THREADS_SCATTER) {
+            parallelLevels++;
         }
 
-        list.clear();
+        balanceRange(index, balancedKDTree, list, head, tail, min, max, parallelLevels);
+    }
 
+    void Raytracer::balance(size_t index, std::vector<Photon> &balancedKDTree, std::vector<Photon> &list,
+                           size_t head, size_t tail)
+    {
+        balanceList(index, balancedKDTree, list, head, tail);
     }
 
     /**
@@ -1444,17 +2805,17 @@ namespace _462 {
     void Raytracer::locatePhotons(size_t p,
                                   Vector3 position,
                                   std::vector<Photon> &balancedKDTree,
-                                  std::vector<Photon> &nearestPhotons,
-                                  float &sqrDist,
-                                  size_t maxNum)
+                                  azNearestPhotons &nearest)
     {
         // examine child nodes
         Photon photon = balancedKDTree[p];
 
-        if (2 * p + 1 < balancedKDTree.size())
+        // left-balanced, so a node with children has a left one, the right one may be missing
+        size_t size = balancedKDTree.size();
+        if (2 * p < size)
         {
             assert(photon.splitAxis != -1);
-            Vector3 diff = position - photon.position;
+            Vector3 diff = position - photon.getPosition();
             real_t diffToPlane = 0.0;
             switch (photon.splitAxis) {
                 case 0:
@@ -1475,117 +2836,30 @@ namespace _462 {
             if (diffToPlane < 0)
             {
                 // search left subtree
-                locatePhotons(2 * p, position, balancedKDTree, nearestPhotons, sqrDist, maxNum);
-                if (sqrDiffToPlane < sqrDist)
+                locatePhotons(2 * p, position, balancedKDTree, nearest);
+                if (2 * p + 1 < size && sqrDiffToPlane < nearest.sqrDist)
                 {
                     // check right subtree
-                    locatePhotons(2 * p + 1, position, balancedKDTree, nearestPhotons, sqrDist, maxNum);
+                    locatePhotons(2 * p + 1, position, balancedKDTree, nearest);
                 }
             }
             else
             {
                 // search right subtree
-                locatePhotons(2 * p + 1, position, balancedKDTree, nearestPhotons, sqrDist, maxNum);
-                if (sqrDiffToPlane < sqrDist)
-                {
-                    // check left subtree
-                    locatePhotons(2 * p, position, balancedKDTree, nearestPhotons, sqrDist, maxNum);
-                }
-            }
-
-        }
-
-        // compute true squared distance to photon
-        real_t sqrDistPhoton = squared_distance(position, photon.position);
-        if (sqrDistPhoton <= sqrDist)
-        {
-            nearestPhotons.push_back(photon);
-//            photon.squaredDistance = sqrDistPhoton;
-//            if (nearestPhotons.size() < maxNum)
-//            {
-//                nearestPhotons.push_back(photon);
-//                std::push_heap(nearestPhotons.begin(), nearestPhotons.end());
-//            }
-//            else
-//            {
-//                if (sqrDistPhoton < nearestPhotons.front().squaredDistance)
-//                {
-//                    std::pop_heap(nearestPhotons.begin(), nearestPhotons.end());
-//                    nearestPhotons.pop_back();
-//                    nearestPhotons.push_back(photon);
-//                    std::push_heap(nearestPhotons.begin(), nearestPhotons.end());
-//
-//                    sqrDist = nearestPhotons.front().squaredDistance;
-//                }
-//            }
-        }
-    }
-
-    // c style locate photons
-    void Raytracer::cPhotonLocate(size_t p,
-                                  Vector3 position,
-                                  std::vector<cPhoton> &balancedKDTree,
-                                  std::vector<cPhoton> &nearestPhotons,
-                                  float &sqrDist,
-                                  size_t maxNum)
-    {
-        assert(balancedKDTree.size() > 0);
-
-        // examine child nodes
-        cPhoton cphoton = balancedKDTree[p];
-        Vector3 cphotonpos(cphoton.position);
-//        Photon photon = dataSource[cphoton.index];
-
-        if (2 * p + 1 < balancedKDTree.size())
-        {
-            assert(cphoton.splitAxis != -1);
-            Vector3 diff = position - cphotonpos;
-            real_t diffToPlane = 0.0;
-            switch (cphoton.splitAxis) {
-                case 0:
-                    diffToPlane = diff.x;
-                    break;
-                case 1:
-                    diffToPlane = diff.y;
-                    break;
-                case 2:
-                    diffToPlane = diff.z;
-                    break;
-                default:
-                    assert(0);
-                    break;
-            }
-            float sqrDiffToPlane = diffToPlane * diffToPlane;
-
-            if (diffToPlane < 0)
-            {
-                // search left subtree
-                cPhotonLocate(2 * p, position, balancedKDTree, nearestPhotons, sqrDist, maxNum);
-                if (sqrDiffToPlane < sqrDist)
-                {
-                    // check right subtree
-                    cPhotonLocate(2 * p + 1, position, balancedKDTree, nearestPhotons, sqrDist, maxNum);
+                if (2 * p + 1 < size) {
+                    locatePhotons(2 * p + 1, position, balancedKDTree, nearest);
                 }
-            }
-            else
-            {
-                // search right subtree
-                cPhotonLocate(2 * p + 1, position, balancedKDTree, nearestPhotons, sqrDist, maxNum);
-                if (sqrDiffToPlane < sqrDist)
+                if (sqrDiffToPlane < nearest.sqrDist)
                 {
                     // check left subtree
-                    cPhotonLocate(2 * p, position, balancedKDTree, nearestPhotons, sqrDist, maxNum);
+                    locatePhotons(2 * p, position, balancedKDTree, nearest);
                 }
             }
 
         }
 
         // compute true squared distance to photon
-        real_t sqrDistPhoton = squared_distance(position, cphotonpos);
-        if (sqrDistPhoton <= sqrDist)
-        {
-            nearestPhotons.push_back(cphoton);
-        }
+        nearest.insert(int(p), squared_distance(position, photon.getPosition()));
     }
 
     void Raytracer::applyGammaHDR(Color3 &color)
@@ -1598,46 +2872,21 @@ namespace _462 {
         color.b = A * pow(color.b, gamma);
     }
 
-    void Raytracer::setPhotonDirection(Photon &photon, Vector3 dir)
-    {
-        // from jensen's implementation
-        int theta = int( acos(dir.z)*(256.0/M_PI) );
-        if (theta > 255)
-            photon.theta = 255;
-        else
-            photon.theta = (unsigned char)theta;
-
-        int phi = int( atan2(dir.y,dir.x) * (256.0 / (2.0 * M_PI)) );
-        if (phi > 255)
-            photon.phi = 255;
-        else if (phi < 0)
-            photon.phi = (unsigned char)(phi + 256);
-        else
-            photon.phi = (unsigned char)phi;
-    }
-
-    Vector3 Raytracer::getPhotonDirection(Photon &photon)
-    {
-        return Vector3(sintheta[photon.theta] * cosphi[photon.phi],
-                       sintheta[photon.theta] * sinphi[photon.phi],
-                       costheta[photon.theta]);
-    }
-
-    void Raytracer::vvhKDTreePreprocess(std::vector<cPhoton>& /*source*/,
+    void Raytracer::vvhKDTreePreprocess(std::vector<Photon>& /*source*/,
                                         std::vector<metaCPhoton>& /*sortedSource*/)
     {
-//        std::vector<cPhoton> datax = source;
-//        std::vector<cPhoton> datay = source;
-//        std::vector<cPhoton> dataz = source;
+//        std::vector<Photon> datax = source;
+//        std::vector<Photon> datay = source;
+//        std::vector<Photon> dataz = source;
 //
-//        std::sort(datax.begin(), datax.end(), cPhotonComparatorX);
-//        std::sort(datay.begin(), datay.end(), cPhotonComparatorY);
-//        std::sort(dataz.begin(), dataz.end(), cPhotonComparatorZ);
+//        std::sort(datax.begin(), datax.end(), photonComparatorX);
+//        std::sort(datay.begin(), datay.end(), photonComparatorY);
+//        std::sort(dataz.begin(), dataz.end(), photonComparatorZ);
 
     }
 
     /// vvh
-    void Raytracer::vvhKDTreeConstruction(std::vector<cPhoton> &list, KDNode *root)
+    void Raytracer::vvhKDTreeConstruction(std::vector<Photon> &list, KDNode *root, azPool<KDNode> &nodes)
     {
         if (list.size() < 1) {
             return;
@@ -1663,11 +2912,15 @@ namespace _462 {
 
         activeList.push_back(root);
 
-        // large node stage
+        // large node stage. An interrupted build leaves a partial tree, the caller
+        // checks previewInterrupted and rebuilds
         while (activeList.size() > 0)
         {
+            if (previewInterrupted()) {
+                return;
+            }
 //            printf("active list size = %ld\n",activeList.size());
-            vvhProcessLargeNode(activeList, smallList, nextList, list);
+            vvhProcessLargeNode(activeList, smallList, nextList, list, nodes);
             nodeList.insert(nodeList.end(), activeList.begin(), activeList.end());
 
             // swap
@@ -1684,7 +2937,10 @@ namespace _462 {
         activeList = smallList;
         while (activeList.size() > 0)
         {
-            vvhProcessSmallNode(activeList, nextList, list);
+            if (previewInterrupted()) {
+                return;
+            }
+            vvhProcessSmallNode(activeList, nextList, list, nodes);
             nodeList.insert(nodeList.end(), activeList.begin(), activeList.end());
 
             // swap
@@ -1699,113 +2955,145 @@ namespace _462 {
         vvhPreorderTraversal(nodeList, list);
     }
 
+    // workers for one level of the vvh build, enough photons for each to be worth a thread
+    // and at most one per node
+    static size_t vvhLevelWorkers(const std::vector<KDNode *> &level)
+    {
+        size_t photons = 0;
+        for (size_t i = 0; i < level.size(); i++) {
+            photons += level[i]->tail - level[i]->head;
+        }
+        size_t workers = std::min(size_t(MAX_THREADS_SCATTER), photons / VVH_PARALLEL_GRANULARITY + 1);
+        return std::max(size_t(1), std::min(workers, level.size()));
+    }
+
     void Raytracer::vvhProcessLargeNode(std::vector<KDNode *> &activeList,
                                         std::vector<KDNode *> &smallList,
                                         std::vector<KDNode *> &nextList,
-                                        std::vector<cPhoton> &list)
+                                        std::vector<Photon> &list,
+                                        azPool<KDNode> &nodes)
     {
-        for (size_t i = 0; i < activeList.size(); i++)
-        {
-            // get the surrounding cube
-            // O(N)
-            Vector3 max = Vector3(-INFINITY, -INFINITY, -INFINITY);
-            Vector3 min = Vector3(INFINITY, INFINITY, INFINITY);
+        // nodes of a level cover disjoint ranges of list, so they split independently
+        size_t numWorkers = vvhLevelWorkers(activeList);
+        std::vector<std::vector<KDNode *> > workerSmall(numWorkers);
+        std::vector<std::vector<KDNode *> > workerNext(numWorkers);
+
+        azParallelChunks(activeList.size(), numWorkers, [&](size_t begin, size_t end, size_t w) {
+            for (size_t i = begin; i < end; i++) {
+                vvhSplitLargeNode(activeList[i], workerSmall[w], workerNext[w], list, nodes);
+            }
+        });
 
-            KDNode *node = activeList[i];
-            int begin = node->head;
-            int end = node->tail;
+        for (size_t w = 0; w < numWorkers; w++) {
+            smallList.insert(smallList.end(), workerSmall[w].begin(), workerSmall[w].end());
+            nextList.insert(nextList.end(), workerNext[w].begin(), workerNext[w].end());
+        }
+    }
 
-//            printf("node %d, begin = %d, end = %d\n", i, begin, end);
-            for (int j = begin; j < end; j++)
-            {
-                // calculate box
-                max.x = list[j].position[0] >= max.x ? list[j].position[0] : max.x;
-                max.y = list[j].position[1] >= max.y ? list[j].position[1] : max.y;
-                max.z = list[j].position[2] >= max.z ? list[j].position[2] : max.z;
+    void Raytracer::vvhSplitLargeNode(KDNode *node,
+                                      std::vector<KDNode *> &smallList,
+                                      std::vector<KDNode *> &nextList,
+                                      std::vector<Photon> &list,
+                                      azPool<KDNode> &nodes)
+    {
+        // get the surrounding cube
+        // O(N)
+        Vector3 max = Vector3(-INFINITY, -INFINITY, -INFINITY);
+        Vector3 min = Vector3(INFINITY, INFINITY, INFINITY);
 
-                min.x = list[j].position[0] <= min.x ? list[j].position[0] : min.x;
-                min.y = list[j].position[1] <= min.y ? list[j].position[1] : min.y;
-                min.z = list[j].position[2] <= min.z ? list[j].position[2] : min.z;
-            }
+        int begin = node->head;
+        int end = node->tail;
 
-            int splitAxis = -1;
-            Vector3 diff = Vector3(max.x - min.x, max.y - min.y, max.z - min.z);
-            if ((diff.x >= diff.y) && (diff.x >= diff.z))
-                splitAxis = 0;
-            else if ((diff.y >= diff.x) && (diff.y >= diff.z))
-                splitAxis = 1;
-            else if ((diff.z >= diff.x) && (diff.z >= diff.y))
-                splitAxis = 2;
+//        printf("node begin = %d, end = %d\n", begin, end);
+        for (int j = begin; j < end; j++)
+        {
+            // calculate box
+            max.x = list[j].position[0] >= max.x ? list[j].position[0] : max.x;
+            max.y = list[j].position[1] >= max.y ? list[j].position[1] : max.y;
+            max.z = list[j].position[2] >= max.z ? list[j].position[2] : max.z;
 
-            // Sorting the vector
-            bool (*comparator)(const cPhoton &a, const cPhoton &b) = NULL;
+            min.x = list[j].position[0] <= min.x ? list[j].position[0] : min.x;
+            min.y = list[j].position[1] <= min.y ? list[j].position[1] : min.y;
+            min.z = list[j].position[2] <= min.z ? list[j].position[2] : min.z;
+        }
 
-            switch (splitAxis) {
-                case 0:
-                    comparator = cPhotonComparatorX;
-                    break;
-                case 1:
-                    comparator = cPhotonComparatorY;
-                    break;
-                case 2:
-                    comparator = cPhotonComparatorZ;
-                    break;
+        int splitAxis = -1;
+        Vector3 diff = Vector3(max.x - min.x, max.y - min.y, max.z - min.z);
+        if ((diff.x >= diff.y) && (diff.x >= diff.z))
+            splitAxis = 0;
+        else if ((diff.y >= diff.x) && (diff.y >= diff.z))
+            splitAxis = 1;
+        else if ((diff.z >= diff.x) && (diff.z >= diff.y))
+            splitAxis = 2;
 
-                default:
-                    break;
-            }
+        // Sorting the vector
+        bool (*comparator)(const Photon &a, const Photon &b) = NULL;
+
+        switch (splitAxis) {
+            case 0:
+                comparator = photonComparatorX;
+                break;
+            case 1:
+                comparator = photonComparatorY;
+                break;
+            case 2:
+                comparator = photonComparatorZ;
+                break;
+
+            default:
+                break;
+        }
 
-            // O(NlogN)
+        // O(NlogN)
 //            std::sort(list.begin() + begin, list.begin() + end, comparator);
-            int median = node->head + (node->tail - node->head)/2;
-            std::nth_element(list.begin() + begin, list.begin() + median, list.begin() + end, comparator);
+        int median = node->head + (node->tail - node->head)/2;
+        std::nth_element(list.begin() + begin, list.begin() + median, list.begin() + end, comparator);
 
 
-            // Split node i at spatial median of the longest axis
-            node->cphotonIndex = median;
-            node->splitAxis = splitAxis;
-            node->splitValue = list[node->cphotonIndex].position[splitAxis];
-            list[node->cphotonIndex].splitAxis = splitAxis;
+        // Split node i at spatial median of the longest axis
+        node->cphotonIndex = median;
+        node->splitAxis = splitAxis;
+        node->splitValue = list[node->cphotonIndex].position[splitAxis];
+        list[node->cphotonIndex].splitAxis = splitAxis;
 
-            KDNode *lch = new KDNode;
-            KDNode *rch = new KDNode;
+        KDNode *lch = nodes.allocate();
+        KDNode *rch = nodes.allocate();
 
-            lch->isLeaf = false;
-            lch->head = begin;
-            lch->tail = median;
+        lch->isLeaf = false;
+        lch->head = begin;
+        lch->tail = median;
 
-            rch->isLeaf = false;
-            rch->head = median + 1;
-            rch->tail = end;
+        rch->isLeaf = false;
+        rch->head = median + 1;
+        rch->tail = end;
 
-            node->left = lch;
-            node->right = rch;
+        node->left = lch;
+        node->right = rch;
 
-            if (lch->tail - lch->head <= SMALL_NODE_GRANULARITY)
-            {
+        if (lch->tail - lch->head <= SMALL_NODE_GRANULARITY)
+        {
 #if SIMPLE_SMALL_NODE
-                lch->isLeaf = true;
+            lch->isLeaf = true;
 #endif
-                smallList.push_back(lch);
-            }
-            else
-                nextList.push_back(lch);
+            smallList.push_back(lch);
+        }
+        else
+            nextList.push_back(lch);
 
-            if (rch->tail - rch->head <= SMALL_NODE_GRANULARITY)
-            {
+        if (rch->tail - rch->head <= SMALL_NODE_GRANULARITY)
+        {
 #if SIMPLE_SMALL_NODE
-                rch->isLeaf = true;
+            rch->isLeaf = true;
 #endif
-                smallList.push_back(rch);
-            }
-            else
-                nextList.push_back(rch);
+            smallList.push_back(rch);
         }
+        else
+            nextList.push_back(rch);
     }
 
     void Raytracer::vvhPreprocessSmallNodes(std::vector<KDNode *> &smallList,
                                             std::vector<KDNode *> &nodeList,
-                                            std::vector<cPhoton> & /*list*/)
+                                            std::vector<Photon> & /*list*/)
     {
         // temporary treat all small nodes as leaf nodes
 #if SIMPLE_SMALL_NODE
@@ -1816,146 +3104,150 @@ namespace _462 {
 
     void Raytracer::vvhProcessSmallNode(std::vector<KDNode *> &activelist,
                                         std::vector<KDNode *> &nextList,
-                                        std::vector<cPhoton> &list)
+                                        std::vector<Photon> &list,
+                                        azPool<KDNode> &nodes)
     {
-        for (size_t i = 0; i < activelist.size(); i++)
-        {
-            KDNode *node = activelist[i];
-            float VVH0 = node->tail - node->head;
-            std::vector<cPhoton> data(node->tail - node->head);
-            std::copy(list.begin() + node->head, list.begin() + node->tail, data.begin());
-            char splitAxis = -1;
-            if (vvhComputeVVH(data, VVH0, splitAxis))
-            {
-                // need split
-                std::copy(data.begin(), data.end(), list.begin() + node->head);
-                node->splitAxis = splitAxis;
+        size_t numWorkers = vvhLevelWorkers(activelist);
+        std::vector<std::vector<KDNode *> > workerNext(numWorkers);
 
-                int begin = node->head;
-                int end = node->tail;
-                int median = node->head + (node->tail - node->head)/2;
+        azParallelChunks(activelist.size(), numWorkers, [&](size_t begin, size_t end, size_t w) {
+            for (size_t i = begin; i < end; i++) {
+                vvhSplitSmallNode(activelist[i], workerNext[w], list, nodes);
+            }
+        });
 
-                // Split node i at spatial median of the longest axis
-                node->cphotonIndex = median;
-                node->splitAxis = splitAxis;
-                node->splitValue = list[node->cphotonIndex].position[(int)splitAxis];
-                list[node->cphotonIndex].splitAxis = splitAxis;
+        for (size_t w = 0; w < numWorkers; w++) {
+            nextList.insert(nextList.end(), workerNext[w].begin(), workerNext[w].end());
+        }
+    }
 
-                KDNode *lch = new KDNode;
-                KDNode *rch = new KDNode;
+    void Raytracer::vvhSplitSmallNode(KDNode *node,
+                                      std::vector<KDNode *> &nextList,
+                                      std::vector<Photon> &list,
+                                      azPool<KDNode> &nodes)
+    {
+        float VVH0 = node->tail - node->head;
+        char splitAxis = -1;
+        int median = -1;
+        if (vvhComputeVVH(list, node->head, node->tail, VVH0, splitAxis, median))
+        {
+            // need split, the candidate photon goes to median and the rest around it
+            bool (*comparator)(const Photon &a, const Photon &b) =
+                splitAxis == 0 ? photonComparatorX : (splitAxis == 1 ? photonComparatorY : photonComparatorZ);
+            std::nth_element(list.begin() + node->head, list.begin() + median, list.begin() + node->tail, comparator);
 
-                lch->isLeaf = false;
-                lch->head = begin;
-                lch->tail = median;
+            int begin = node->head;
+            int end = node->tail;
 
-                rch->isLeaf = false;
-                rch->head = median + 1;
-                rch->tail = end;
+            node->cphotonIndex = median;
+            node->splitAxis = splitAxis;
+            node->splitValue = list[node->cphotonIndex].position[(int)splitAxis];
+            list[node->cphotonIndex].splitAxis = splitAxis;
 
-                node->left = lch;
-                node->right = rch;
+            KDNode *lch = nodes.allocate();
+            KDNode *rch = nodes.allocate();
 
-                nextList.push_back(lch);
-                nextList.push_back(rch);
+            lch->isLeaf = false;
+            lch->head = begin;
+            lch->tail = median;
 
-            }
-            else
-            {
-                activelist[i]->isLeaf = true;
-            }
+            rch->isLeaf = false;
+            rch->head = median + 1;
+            rch->tail = end;
 
+            node->left = lch;
+            node->right = rch;
+
+            nextList.push_back(lch);
+            nextList.push_back(rch);
+        }
+        else
+        {
+            node->isLeaf = true;
         }
     }
 
-    bool Raytracer::vvhComputeVVH(std::vector<cPhoton> &data, float &VVH0, char &axis)
+    /**
+     * Voxel volume heuristic of Zhou et al. 2008, evaluated at VVH_BINS bin borders
+     * per axis instead of at every photon. One pass counts the photons per bin of all
+     * three axes, a prefix sum over the counts then gives both child counts of every
+     * border. Child volumes are the node voxel cut at the border. The split photon
+     * itself is tested at the node, it costs one.
+     * @param   head, tail  photon range of the node in list
+     * @param   VVH0        cost of not splitting, the photon count
+     * @param   axis        out, best split axis
+     * @param   median      out, index in list the split photon goes to
+     * @return  true if some split is cheaper than VVH0
+     */
+    bool Raytracer::vvhComputeVVH(std::vector<Photon> &list, int head, int tail,
+                                  float &VVH0, char &axis, int &median)
     {
-        float VVH = VVH0;
-        bool ret = false;
-        char splitAxis = -1;
-        std::vector<cPhoton> xdata = data;
-        std::vector<cPhoton> ydata = data;
-        std::vector<cPhoton> zdata = data;
-        std::sort(xdata.begin(), xdata.end(), cPhotonComparatorX);
-        std::sort(ydata.begin(), ydata.end(), cPhotonComparatorY);
-        std::sort(zdata.begin(), zdata.end(), cPhotonComparatorZ);
-
-        Vector3 a(xdata[0].position[0], ydata[0].position[1], zdata[0].position[2]);
-        Vector3 b(xdata[xdata.size() - 1].position[0], ydata[ydata.size() - 1].position[1], zdata[zdata.size() - 1].position[2]);
-        float v = vvhComputeVolume(a, b);
+        axis = -1;
+        if (tail - head < 3) {
+            return false;
+        }
 
-        // x axis
-        for (size_t i = 1; i < xdata.size()-1; i++)
+        Vector3 min(INFINITY, INFINITY, INFINITY);
+        Vector3 max(-INFINITY, -INFINITY, -INFINITY);
+        for (int j = head; j < tail; j++)
         {
-            Vector3 la(xdata[0].position);
-            Vector3 lb(xdata[i-1].position);
-            Vector3 ra(xdata[i+1].position);
-            Vector3 rb(xdata[xdata.size()-1].position);
-            float vl = vvhComputeVolume(la, lb);
-            float vr = vvhComputeVolume(ra, rb);
-            float vvh_i = 1 + vl/v + vr/v;
-            if (vvh_i < VVH) {
-                VVH = vvh_i;
-                splitAxis = 0;
-            }
+            const float *p = list[j].position;
+            min = Vector3(std::min(min.x, real_t(p[0])), std::min(min.y, real_t(p[1])), std::min(min.z, real_t(p[2])));
+            max = Vector3(std::max(max.x, real_t(p[0])), std::max(max.y, real_t(p[1])), std::max(max.z, real_t(p[2])));
+        }
+        float v = vvhComputeVolume(min, max);
+
+        // no more borders than photons, tiny nodes are the bulk of the small node stage
+        int numBins = std::min(VVH_BINS, tail - head);
+        real_t scale[3];
+        for (int a = 0; a < 3; a++) {
+            real_t extent = max[a] - min[a];
+            scale[a] = extent > 0 ? numBins / extent : 0;
         }
 
-        // y axis
-        for (size_t i = 1; i < ydata.size()-1; i++)
+        int count[3][VVH_BINS] = { { 0 } };
+        for (int j = head; j < tail; j++)
         {
-            Vector3 la(ydata[0].position);
-            Vector3 lb(ydata[i-1].position);
-            Vector3 ra(ydata[i+1].position);
-            Vector3 rb(ydata[ydata.size()-1].position);
-            float vl = vvhComputeVolume(la, lb);
-            float vr = vvhComputeVolume(ra, rb);
-            float vvh_i = 1 + vl/v + vr/v;
-            if (vvh_i < VVH) {
-                VVH = vvh_i;
-                splitAxis = 1;
+            const float *p = list[j].position;
+            for (int a = 0; a < 3; a++) {
+                count[a][std::min(numBins - 1, int((p[a] - min[a]) * scale[a]))]++;
             }
         }
 
-        // z axis
-        for (size_t i = 1; i < zdata.size()-1; i++)
+        float VVH = VVH0;
+        for (int a = 0; a < 3; a++)
         {
-            Vector3 la(zdata[0].position);
-            Vector3 lb(zdata[i-1].position);
-            Vector3 ra(zdata[i+1].position);
-            Vector3 rb(zdata[zdata.size()-1].position);
-            float vl = vvhComputeVolume(la, lb);
-            float vr = vvhComputeVolume(ra, rb);
-            float vvh_i = 1 + vl/v + vr/v;
-            if (vvh_i < VVH) {
-                VVH = vvh_i;
-                splitAxis = 2;
+            if (scale[a] == 0) {
+                continue;
             }
-        }
-
-        axis = splitAxis;
 
-        // need split
-        if (VVH < VVH0)
-        {
-            switch (splitAxis) {
-                case 0:
-                    data = xdata;
-                    ret = true;
-                    break;
-                case 1:
-                    data = ydata;
-                    ret = true;
-                    break;
-                case 2:
-                    data = zdata;
-                    ret = true;
-                    break;
+            // border k separates bins [0, k) from [k, numBins), the lowest photon
+            // of the right side becomes the split photon
+            int left = 0;
+            for (int k = 1; k < numBins; k++)
+            {
+                left += count[a][k - 1];
+                int right = (tail - head) - left;
+                if (left == 0 || right == 0) {
+                    continue;
+                }
 
-                default:
-                    break;
+                Vector3 leftMax = max;
+                Vector3 rightMin = min;
+                leftMax[a] = rightMin[a] = min[a] + k / scale[a];
+                float vl = vvhComputeVolume(min, leftMax);
+                float vr = vvhComputeVolume(rightMin, max);
+                float vvh_k = 1 + (left * vl + (right - 1) * vr) / v;
+                if (vvh_k < VVH) {
+                    VVH = vvh_k;
+                    axis = a;
+                    median = head + left;
+                }
             }
         }
 
-        return ret;
+        // need split
+        return VVH < VVH0;
     }
 
     float Raytracer::vvhComputeVolume(Vector3 a, Vector3 b)
@@ -1964,11 +3256,11 @@ namespace _462 {
             return SPHERE_VOLUME;
 
         Vector3 diff = b - a;
-        return diff.x * diff.y * diff.z + TWO_MUL_RADIUS * (diff.x * diff.y + diff.x * diff.z + diff.y + diff.z ) + SPHERE_VOLUME;
+        return diff.x * diff.y * diff.z + TWO_MUL_RADIUS * (diff.x * diff.y + diff.x * diff.z + diff.y * diff.z) + SPHERE_VOLUME;
     }
 
     void Raytracer::vvhPreorderTraversal(std::vector<KDNode *>& /*nodeList*/,
-                                         std::vector<cPhoton> & /*list*/ )
+                                         std::vector<Photon> & /*list*/ )
     {
 //        for (std::vector<KDNode *>::iterator it = nodeList.begin(); it != nodeList.end(); it++)
 //        {
@@ -1981,47 +3273,33 @@ namespace _462 {
     void Raytracer::vvhcPhotonLocate(Vector3 position,
                                      KDNode *node,
                                      ispcCPhotonData &ispcCphotonData,
-                                     std::vector<cPhoton> &cPhotonList,
-                                     std::vector<int> &nearestPhotonsIndices,
-                                     float &sqrDist,
-                                     size_t maxNum)
+                                     std::vector<Photon> &photonList,
+                                     azNearestPhotons &nearest)
     {
         assert(node != NULL);
 
-        if (cPhotonList.size() < 1) {
+        if (photonList.size() < 1) {
             return;
         }
 
         // if the node is leaf, check children for get nearstPhotons
         if (node->isLeaf)
         {
-            int begin = node->head;
-            int end = node->tail;
-            std::vector<cPhoton>::iterator it;
-
-            for (int i = begin; i < end; i++)
-            {
-                cPhoton cphoton = cPhotonList[i];
-                Vector3 cphotonpos(cphoton.position);
-
-                // compute true squared distance to photon
-                real_t sqrDistPhoton = squared_distance(position, cphotonpos);
-                if (sqrDistPhoton <= sqrDist)
-                {
-                    nearestPhotonsIndices.push_back(cphoton.index);
-                }
-            }
+            // slot i of the SoA arrays is photonList[i], scanned several photons at a time
+            const float query[3] = { float(position.x), float(position.y), float(position.z) };
+            azGatherLeaf(ispcCphotonData.posx, ispcCphotonData.posy, ispcCphotonData.posz,
+                         NULL, node->head, node->tail, query, nearest);
         }
         // if the node is a splitting node
         else
         {
-            cPhoton cphoton = cPhotonList[node->cphotonIndex];
-            Vector3 cphotonpos(cphoton.position);
+            const Photon &photon = photonList[node->cphotonIndex];
+            Vector3 photonpos = photon.getPosition();
 
-            Vector3 diff = position - cphotonpos;
+            Vector3 diff = position - photonpos;
 
             real_t diffToPlane = 0.0;
-            switch (cphoton.splitAxis) {
+            switch (photon.splitAxis) {
                 case 0:
                     diffToPlane = diff.x;
                     break;
@@ -2031,64 +3309,25 @@ namespace _462 {
                 case 2:
                     diffToPlane = diff.z;
                     break;
-                default:
-                    assert(0);
-                    break;
-            }
-            real_t sqrDiffToPlane = diffToPlane * diffToPlane;
-
-            if (diffToPlane < 0)
-            {
-                // search left subtree
-                vvhcPhotonLocate(position,
-                                 node->left,
-                                 ispcCphotonData,
-                                 cPhotonList,
-                                 nearestPhotonsIndices,
-                                 sqrDist,
-                                 maxNum);
-
-                if (sqrDiffToPlane < sqrDist)
-                {
-                    // check right subtree
-                    vvhcPhotonLocate(position,
-                                     node->right,
-                                     ispcCphotonData,
-                                     cPhotonList,
-                                     nearestPhotonsIndices,
-                                     sqrDist,
-                                     maxNum);
-                }
-            }
-            else
-            {
-                // search right subtree
-                vvhcPhotonLocate(position,
-                                 node->right,
-                                 ispcCphotonData,
-                                 cPhotonList,
-                                 nearestPhotonsIndices,
-                                 sqrDist,
-                                 maxNum);
-
-                if (sqrDiffToPlane < sqrDist)
-                {
-                    // check left subtree
-                    vvhcPhotonLocate(position,
-                                     node->left,
-                                     ispcCphotonData,
-                                     cPhotonList,
-                                     nearestPhotonsIndices,
-                                     sqrDist,
-                                     maxNum);
-                }
+                default:
+                    assert(0);
+                    break;
             }
+            real_t sqrDiffToPlane = diffToPlane * diffToPlane;
+
+            // near side first, the splitting photon next, so the far side is only
+            // searched if it can still beat the shrunk radius
+            KDNode *nearChild = diffToPlane < 0 ? node->left : node->right;
+            KDNode *farChild = diffToPlane < 0 ? node->right : node->left;
+
+            vvhcPhotonLocate(position, nearChild, ispcCphotonData, photonList, nearest);
 
             // compute true squared distance to photon
-            real_t sqrDistPhoton = squared_distance(position, cphotonpos);
-            if (sqrDistPhoton <= sqrDist)
+            nearest.insert(node->cphotonIndex, squared_distance(position, photonpos));
+
+            if (sqrDiffToPlane < nearest.sqrDist)
             {
-                nearestPhotonsIndices.push_back(cphoton.index);
+                vvhcPhotonLocate(position, farChild, ispcCphotonData, photonList, nearest);
             }
         }
     }
@@ -2116,135 +3355,219 @@ namespace _462 {
         }
     }
     
-    void Raytracer::mpiStageDistributeEyeRays(int procs, int procId, std::vector<Ray> *eyerays)
+    // closest first forwarding keeps the nodes a ray visited in the 32 bits of Ray::visited
+    static bool mpiForwardRays(int procs)
+    {
+        if (ENABLE_RAY_FORWARDING && procs > 32)
+        {
+            static bool logged = false;
+            if (!logged) {
+                printf("Ray forwarding needs at most 32 nodes, %d nodes broadcast rays instead\n", procs);
+                logged = true;
+            }
+            return false;
+        }
+        return ENABLE_RAY_FORWARDING;
+    }
+    
+    // the node not visited by ray whose box it enters first before tmax, -1 for none
+    int Raytracer::mpiNextNode(int procs, const Ray &ray, real_t tmax)
+    {
+        int next = -1;
+        real_t nearest = tmax;
+        for (int node_id = 0; node_id < procs; node_id++) {
+            real_t tEnter;
+            if (!(ray.visited & (1u << node_id)) &&
+                scene->nodeBndBox[node_id].intersect(ray, EPSILON, tmax, &tEnter) &&
+                (next < 0 || tEnter < nearest)) {
+                next = node_id;
+                nearest = tEnter;
+            }
+        }
+        return next;
+    }
+    
+    // eye rays of row y in the screen region of this node, to the node whose box they
+    // enter first when forwarding, else to every node whose box they cross
+    template <typename RaySink>
+    void Raytracer::mpiGenerateEyeRays(int procs, int procId, int y, RaySink &sink)
     {
         int wstep = width / scene->node_size;
-        int hstep = height;
         real_t dx = real_t(1)/width;
         real_t dy = real_t(1)/height;
         
-        // node ray list to send out rays
-        RayBucket currentNodeRayList(procs);
-        
-        // Generate all eye rays in screen region, bin them
-        for (int y = 0; y < hstep; y++) {
-            for (int x = wstep * procId; x < wstep * (procId + 1); x++) {
-                
-                // pick a point within the pixel boundaries to fire our
-                // ray through.
-                real_t i = real_t(2)*(real_t(x)+random())*dx - real_t(1);
-                real_t j = real_t(2)*(real_t(y)+random())*dy - real_t(1);
-                
-                Ray r = Ray(scene->camera.get_position(), Ray::get_pixel_dir(i, j));
+        for (int x = wstep * procId; x < wstep * (procId + 1); x++) {
+            
+            // pick a point within the pixel boundaries to fire our
+            // ray through.
+            real_t i = real_t(2)*(real_t(x)+random())*dx - real_t(1);
+            real_t j = real_t(2)*(real_t(y)+random())*dy - real_t(1);
+            
+            Ray r = Ray(scene->camera.get_position(), Ray::get_pixel_dir(i, j));
+            r.x = x;
+            r.y = y;
+            r.color = Color3::Black();
+            r.depth = 2;
+            if (mpiForwardRays(procs))
+            {
+                int node_id = mpiNextNode(procs, r, TMAX);
+                if (node_id >= 0) {
+                    sink.push_back(node_id, r);
+                }
+            }
+            else
+            {
                 for (int node_id = 0; node_id < procs; node_id++) {
                     BndBox nodeBBox = scene->nodeBndBox[node_id];
                     if (nodeBBox.intersect(r, EPSILON, TMAX)) {
                         // push ray into node's ray list
-                        r.x = x;
-                        r.y = y;
-                        r.color = Color3::Black();
-                        r.depth = 2;
-                        currentNodeRayList.push_back(node_id, r);
+                        sink.push_back(node_id, r);
                     }
                 }
             }
         }
+    }
+    
+    void Raytracer::mpiStageDistributeEyeRays(int procs, int procId, std::vector<Ray> *eyerays)
+    {
+        // node ray list to send out rays
+        RayBucket currentNodeRayList(procs, RayWire_Eye);
+        
+        // Generate all eye rays in screen region, bin them
+        for (size_t y = 0; y < height; y++) {
+            mpiGenerateEyeRays(procs, procId, y, currentNodeRayList);
+        }
         
         // all to all distribute eye rays
         mpiAlltoallRayDistribution(procs, procId, currentNodeRayList, eyerays);
         
     }
     
-    // each node do local raytracing, generate shadow rays, do shadowray-node boundingbox
-    // test, distribute shadow rays, maintain local lookup table, send shadow rays to other nodes
-    void Raytracer::mpiStageLocalRayTrace(int procs,
-                                          int procId,
-                                          std::vector<Ray> &eyerays,
-                                          std::vector<Ray> *shadowRays,
-                                          std::vector<Ray> *giRays,
-                                          bool iseyeray)
+    /**
+     * Local trace of one eye or gi ray: shade its hit on this node, send the shadow
+     * rays towards every node whose box they cross and the next gi ray to the nodes
+     * it may hit.
+     */
+    template <typename RaySink>
+    void Raytracer::mpiLocalTraceRay(int procs, int procId, Ray ray, bool iseyeray,
+                                     RaySink &shadowSink, RaySink &giSink, RaySink &forwardSink)
     {
-        // shadow ray list used for shading
-        RayBucket nodeShadowRayList(procs);
-        RayBucket nodeGIRayList(procs);
+        // forwarded rays end at the nearest hit found so far
+        real_t tmax = std::min(real_t(TMAX), real_t(ray.maxt));
+        bool isHit = false;
+        HitRecord record = getClosestHit(ray, EPSILON, tmax, &isHit, Layer_All);
         
-        // for each eye ray
-        for (size_t i = 0; i < eyerays.size(); i++) {
-            Ray ray = eyerays[i];
-            bool isHit = false;
-            HitRecord record = getClosestHit(ray, EPSILON, TMAX, &isHit, Layer_All);
+        // a node whose box the ray enters before its nearest hit may have a
+        // nearer one, the farther hit here loses against it in the z test.
+        // Only shaded hits write the pixel, the ray goes on past the others.
+        if (mpiForwardRays(procs))
+        {
+            bool isShaded = isHit && record.diffuse != Color3::Black() && record.refractive_index == 0;
+            Ray forward = ray;
+            forward.visited |= 1u << procId;
+            forward.maxt = isShaded ? record.t : tmax;
+            int node_id = mpiNextNode(procs, forward, forward.maxt);
+            if (node_id >= 0) {
+                forwardSink.push_back(node_id, forward);
+            }
+        }
+        
+        // calculate zbuffer value
+        if (isHit) {
             
-            // calculate zbuffer value
-            if (isHit) {
-                
-                // since time is the data used for depth buffer test,
-                // only eye ray should update this value
-                if (iseyeray)
-                {
-                    ray.time = record.t;
-                }
-                
-                if (record.diffuse != Color3::Black() && record.refractive_index == 0)
-                {
-                    // for each light
-                    for (size_t li = 0; li < scene->num_lights(); li++) {
-                        
-                        Light *aLight = scene->get_lights()[li];
-                        // TODO: optimize
-                        // shade the hit point color direclty
-                        Vector3 samplePoint;
-                        float tlight;
-                        Color3 shadingColor = record.diffuse * aLight->SampleLight(record.position,
-                                                                                   record.normal,
-                                                                                   EPSILON,
-                                                                                   TMAX,
-                                                                                   &samplePoint,
-                                                                                   &tlight);
-                        shadingColor *= INV_PI;
-                        
-                        // for each light sample
-                        // TODO: we sample only one point per light for now
-                        Vector3 d_shadowRay_normolized = normalize(aLight->getPointToLightDirection(record.position, samplePoint));
-                        
-                        Ray shadowRay = Ray(record.position, d_shadowRay_normolized);
-                        shadowRay.x = ray.x;
-                        shadowRay.y = ray.y;
-                        shadowRay.maxt = tlight;
-                        shadowRay.lightIndex = li;
-                        shadowRay.depth = ray.depth - 1;
-                        shadowRay.color = shadingColor;
-                        shadowRay.time = ray.time;
-                        shadowRay.source = procId;
+            // since time is the data used for depth buffer test,
+            // only eye ray should update this value
+            if (iseyeray)
+            {
+                ray.time = record.t;
+#if ENABLE_DENOISER
+                denoiser.setGuide(ray.x, ray.y, record);
+#endif
+#if ENABLE_PHOTON_MAPPING && C_PHOTON_MODE && !ENABLE_SPPM
+                EyeHit hit;
+                hit.position = record.position;
+                hit.normal = record.normal;
+                hit.diffuse = record.diffuse;
+                hit.texture = record.texture;
+                hit.t = record.t;
+                hit.x = ray.x;
+                hit.y = ray.y;
+                hit.isShaded = record.diffuse != Color3::Black() && record.refractive_index == 0;
+                eyeHits.push_back(hit);
+#endif
+            }
+            
+            if (record.diffuse != Color3::Black() && record.refractive_index == 0)
+            {
+                // for each light
+                for (size_t li = 0; li < scene->num_lights(); li++) {
+                    
+                    Light *aLight = scene->get_lights()[li];
+                    // TODO: optimize
+                    // shade the hit point color direclty
+                    Vector3 samplePoint;
+                    float tlight;
+                    Color3 shadingColor = record.diffuse * aLight->SampleLight(record.position,
+                                                                               record.normal,
+                                                                               EPSILON,
+                                                                               TMAX,
+                                                                               &samplePoint,
+                                                                               &tlight);
+                    shadingColor *= INV_PI;
+                    
+                    // for each light sample
+                    // TODO: we sample only one point per light for now
+                    Vector3 d_shadowRay_normolized = normalize(aLight->getPointToLightDirection(record.position, samplePoint));
+                    
+                    Ray shadowRay = Ray(azRayWireOrigin(record.position, record.normal, d_shadowRay_normolized),
+                                        d_shadowRay_normolized);
+                    shadowRay.x = ray.x;
+                    shadowRay.y = ray.y;
+                    shadowRay.maxt = tlight;
+                    shadowRay.lightIndex = li;
+                    shadowRay.depth = ray.depth - 1;
+                    shadowRay.color = shadingColor;
+                    shadowRay.time = ray.time;
+                    shadowRay.source = procId;
+                    
+                    // for each node bounding box
+                    for (int bidx = 0; bidx < procs; bidx++) {
+                        BndBox nodeBndBox = scene->nodeBndBox[bidx];
+                        // if shadow ray hits any bounding boxes, send to other nodes for shading
+                        if (nodeBndBox.intersect(shadowRay, EPSILON, shadowRay.maxt)) {
+                            shadowSink.push_back(bidx, shadowRay);
+                        }
+                        // if shadow not hit any bounding boxes,
+                        // send to self for shading, or the data will lose
+                        else {
+                            shadowSink.push_back(procId, shadowRay);
+                        }
+                    }
+                    
+                    if (ray.depth > 0) {
+                        // generate second rays
+                        Vector3 dir = uniformSampleHemisphere(record.normal);
+                        Ray secondRay = Ray(azRayWireOrigin(record.position, record.normal, dir), dir);
+                        secondRay.x = ray.x;
+                        secondRay.y = ray.y;
+                        secondRay.depth = ray.depth - 1;
+                        secondRay.color = shadingColor;
+                        secondRay.time = ray.time;
                         
-                        // for each node bounding box
-                        for (int bidx = 0; bidx < procs; bidx++) {
-                            BndBox nodeBndBox = scene->nodeBndBox[bidx];
-                            // if shadow ray hits any bounding boxes, send to other nodes for shading
-                            if (nodeBndBox.intersect(shadowRay, EPSILON, shadowRay.maxt)) {
-                                nodeShadowRayList.push_back(bidx, shadowRay);
-                            }
-                            // if shadow not hit any bounding boxes,
-                            // send to self for shading, or the data will lose
-                            else {
-                                nodeShadowRayList.push_back(procId, shadowRay);
+                        if (mpiForwardRays(procs))
+                        {
+                            int node_id = mpiNextNode(procs, secondRay, TMAX);
+                            if (node_id >= 0) {
+                                giSink.push_back(node_id, secondRay);
                             }
                         }
-                        
-                        if (ray.depth > 0) {
-                            // generate second rays
-                            Vector3 dir = uniformSampleHemisphere(record.normal);
-                            Ray secondRay = Ray(record.position, dir);
-                            secondRay.x = ray.x;
-                            secondRay.y = ray.y;
-                            secondRay.depth = ray.depth - 1;
-                            secondRay.color = shadingColor;
-                            secondRay.time = ray.time;
-                            
+                        else
+                        {
                             // for each node bounding box
                             for (int bidx = 0; bidx < procs; bidx++) {
                                 BndBox nodeBndBox = scene->nodeBndBox[bidx];
                                 if (nodeBndBox.intersect(secondRay, EPSILON, TMAX)) {
-                                    nodeGIRayList.push_back(bidx, secondRay);
+                                    giSink.push_back(bidx, secondRay);
                                 }
                             }
                         }
@@ -2252,46 +3575,432 @@ namespace _462 {
                 }
             }
         }
+    }
+
+    // each node do local raytracing, generate shadow rays, do shadowray-node boundingbox
+    // test, distribute shadow rays, maintain local lookup table, send shadow rays to other nodes
+    void Raytracer::mpiStageLocalRayTrace(int procs,
+                                          int procId,
+                                          std::vector<Ray> &eyerays,
+                                          std::vector<Ray> *shadowRays,
+                                          std::vector<Ray> *giRays,
+                                          bool iseyeray)
+    {
+        // shadow ray list used for shading
+        RayBucket nodeShadowRayList(procs, RayWire_Shadow);
+        RayBucket nodeGIRayList(procs, RayWire_GI);
+        RayWireFormat format = iseyeray ? RayWire_Eye : RayWire_GI;
+        
+        // for each eye ray
+        std::vector<Ray> forwarded;
+        {
+            RayBucket nodeForwardRayList(procs, format);
+            for (size_t i = 0; i < eyerays.size(); i++) {
+                mpiLocalTraceRay(procs, procId, eyerays[i], iseyeray, nodeShadowRayList, nodeGIRayList, nodeForwardRayList);
+            }
+            if (mpiForwardRays(procs)) {
+                mpiAlltoallRayDistribution(procs, procId, nodeForwardRayList, &forwarded);
+            }
+        }
+        
+        // rays forwarded to the next node they enter, one round per hop
+        while (mpiForwardRays(procs) && !mpiShouldStop(procs, procId, forwarded.size(), 0))
+        {
+            RayBucket nodeForwardRayList(procs, format);
+            for (size_t i = 0; i < forwarded.size(); i++) {
+                mpiLocalTraceRay(procs, procId, forwarded[i], iseyeray, nodeShadowRayList, nodeGIRayList, nodeForwardRayList);
+            }
+            mpiAlltoallRayDistribution(procs, procId, nodeForwardRayList, &forwarded);
+        }
         
         mpiAlltoallRayDistribution(procs, procId, nodeShadowRayList, shadowRays);
         mpiAlltoallRayDistribution(procs, procId, nodeGIRayList, giRays);
     }
 
+    // trace a shadow ray, write its color into buffer unless a nearer surface is there
+    void Raytracer::mpiShadowTraceRay(FrameBuffer &buffer, Ray ray)
+    {
+        // TODO: light index might be different?
+        bool isHit = false;
+        /*HitRecord shadowRecord =*/ getClosestHit(ray, EPSILON, ray.maxt, &isHit, (Layer_IgnoreShadowRay));
+        
+        int x = ray.x;
+        int y = ray.y;
+
+        int bufferIndex = y * width + x;
+        if (isHit)
+        {
+            if (ray.time < buffer.zbuffer[bufferIndex]) {
+                buffer.shadowMap[bufferIndex] = 255;
+                ray.color.to_array(&buffer.cbuffer[4 * bufferIndex]);
+                buffer.zbuffer[bufferIndex] = ray.time;
+            }
+        }
+        else
+        {
+            if (ray.time < buffer.zbuffer[bufferIndex]) {
+                buffer.shadowMap[bufferIndex] = 0;
+                ray.color.to_array(&buffer.cbuffer[4 * bufferIndex]);
+                buffer.zbuffer[bufferIndex] = ray.time;
+            }
+        }
+    }
+
     // each node takes in shadow ray, do local ray tracing, maintain shadow ray
     // hit records, send records to corresponding nodes
     void Raytracer::mpiStageShadowRayTracing(int /*procs*/, int /*procId*/, FrameBuffer &buffer, std::vector<Ray> &shadowrays)
     {
         for (size_t i = 0; i < shadowrays.size(); i++)
         {
-            Ray ray = shadowrays[i];
-            // TODO: light index might be different?
-            bool isHit = false;
-            /*HitRecord shadowRecord =*/ getClosestHit(ray, EPSILON, ray.maxt, &isHit, (Layer_IgnoreShadowRay));
-            
-            int x = ray.x;
-            int y = ray.y;
+            mpiShadowTraceRay(buffer, shadowrays[i]);
+        }
+        
+    }
+    
+    /**
+     * mpiStageDistributeEyeRays, mpiStageLocalRayTrace and mpiStageShadowRayTracing
+     * in one go, with rays streamed in batches of MPI_RAY_BATCH_SIZE. Eye rays
+     * are generated row by row, or rays holds the gi rays of the last bounce on
+     * this node. Between rows or rays every exchange is polled, so eye rays are
+     * traced and shadow rays shaded as soon as they arrive while the batches of
+     * this node are still in flight. The eye rays this node traced end up in rays,
+     * the gi rays for the next bounce in giRays.
+     */
+    void Raytracer::mpiStageOverlappedTrace(int procs, int procId, std::vector<Ray> *rays, bool iseyeray,
+                                            FrameBuffer &buffer, std::vector<Ray> *giRays)
+    {
+        double start = MPI_Wtime();
 
-            int bufferIndex = y * width + x;
-            if (isHit)
+        std::vector<Ray> traced;
+        giRays->clear();
+
+        // hop k carries the rays to the k-th node they visit, without forwarding
+        // there is one hop only
+        size_t numHops = mpiForwardRays(procs) ? procs : 1;
+        std::vector<azRayExchange *> hops(numHops, (azRayExchange *)NULL);
+
+        azRayExchange shadowExchange(procs, procId, MPI_RAY_BATCH_SIZE, RayWire_Shadow, [&](const Ray *batch, size_t count) {
+            for (size_t i = 0; i < count; i++) {
+                mpiShadowTraceRay(buffer, batch[i]);
+            }
+        });
+        azRayExchange giExchange(procs, procId, MPI_RAY_BATCH_SIZE, RayWire_GI, [&](const Ray *batch, size_t count) {
+            giRays->insert(giRays->end(), batch, batch + count);
+        });
+        for (size_t k = 0; k < numHops; k++)
+        {
+            // a ray on the last hop has visited every other node and is not forwarded,
+            // its own exchange stands in for the sink it never uses
+            size_t next = k + 1 < numHops ? k + 1 : k;
+            hops[k] = new azRayExchange(procs, procId, MPI_RAY_BATCH_SIZE, iseyeray ? RayWire_Eye : RayWire_GI,
+                                        [&, k, next](const Ray *batch, size_t count) {
+                for (size_t i = 0; i < count; i++) {
+                    assert(k + 1 < numHops || !mpiForwardRays(procs) ||
+                           (batch[i].visited | (1u << procId)) == (0xffffffffu >> (32 - procs)));
+                    mpiLocalTraceRay(procs, procId, batch[i], iseyeray, shadowExchange, giExchange, *hops[next]);
+                }
+                traced.insert(traced.end(), batch, batch + count);
+            });
+        }
+
+        if (iseyeray)
+        {
+            for (size_t y = 0; y < height; y++)
             {
-                if (ray.time < buffer.zbuffer[bufferIndex]) {
-                    buffer.shadowMap[bufferIndex] = 255;
-                    ray.color.to_array(&buffer.cbuffer[4 * bufferIndex]);
-                    buffer.zbuffer[bufferIndex] = ray.time;
+                mpiGenerateEyeRays(procs, procId, y, *hops[0]);
+                for (size_t k = 0; k < numHops; k++) {
+                    hops[k]->poll();
                 }
+                shadowExchange.poll();
+                giExchange.poll();
             }
-            else
+        }
+        else
+        {
+            // gi rays already are on the first node they enter
+            azRayExchange &forward = *hops[std::min(size_t(1), numHops - 1)];
+            for (size_t i = 0; i < rays->size(); i++)
             {
-                if (ray.time < buffer.zbuffer[bufferIndex]) {
-                    buffer.shadowMap[bufferIndex] = 0;
-                    ray.color.to_array(&buffer.cbuffer[4 * bufferIndex]);
-                    buffer.zbuffer[bufferIndex] = ray.time;
+                mpiLocalTraceRay(procs, procId, (*rays)[i], iseyeray, shadowExchange, giExchange, forward);
+                if (i % MPI_RAY_BATCH_SIZE == 0) {
+                    forward.poll();
+                    shadowExchange.poll();
+                    giExchange.poll();
                 }
             }
+            traced.insert(traced.end(), rays->begin(), rays->end());
         }
-        
+
+        // every exchange feeds only the ones after it
+        double busy = MPI_Wtime() - start;
+        double waited = 0;
+        size_t batches = 0;
+        for (size_t k = 0; k < numHops; k++)
+        {
+            hops[k]->finish();
+            waited += hops[k]->waitTime();
+            batches += hops[k]->batchesSent();
+        }
+        shadowExchange.finish();
+        giExchange.finish();
+        rays->swap(traced);
+
+        for (size_t k = 0; k < numHops; k++) {
+            delete hops[k];
+        }
+
+        printf("[thread %d] Overlapped trace took %f sec, %f sec of it before the last batch was sent, "
+               "%f sec finishing the exchanges, %ld batches sent\n",
+               procId, MPI_Wtime() - start, busy,
+               waited + shadowExchange.waitTime() + giExchange.waitTime(),
+               batches + shadowExchange.batchesSent() + giExchange.batchesSent());
     }
-    
+
+    /**
+     * Distributed photon scatter. Lights are on every node, every node emits its
+     * share of the photons of a round; photon rays then move between the nodes as
+     * in mpiStagePhotonTrace until all have ended, and photons stay on the node
+     * owning the geometry they land on. Rounds go on until the photons of all
+     * nodes fill both maps, the last round may overfill them a little.
+     */
+    void Raytracer::mpiStagePhotonScatter(int procs, int procId)
+    {
+        double start = MPI_Wtime();
+
+        PhotonScatterData data;
+        data.quota = NULL;
+
+        photon_indirect_list.clear();
+        photon_caustic_list.clear();
+
+#if ENABLE_LIGHT_POWER_CDF
+        buildLightDistributions(scene);
+#endif
+        random_seed(photonBatchSeed(++num_scatter, procId));
+
+        size_t numLights = scene->num_lights();
+        size_t emitted = 0;
+        while (numLights > 0 && emitted < PHOTON_EMISSION_LIMIT)
+        {
+            // photons stored by all nodes so far
+            unsigned long local[2] = { photon_indirect_list.size(), photon_caustic_list.size() };
+            unsigned long global[2];
+            MPI_Allreduce(local, global, 2, MPI_UNSIGNED_LONG, MPI_SUM, MPI_COMM_WORLD);
+            if (global[0] >= INDIRECT_PHOTON_NEEDED && global[1] >= CAUSTICS_PHOTON_NEEDED) {
+                break;
+            }
+            data.indirect_needed = global[0] < INDIRECT_PHOTON_NEEDED ? INDIRECT_PHOTON_NEEDED - global[0] : 0;
+            data.caustics_needed = global[1] < CAUSTICS_PHOTON_NEEDED ? CAUSTICS_PHOTON_NEEDED - global[1] : 0;
+
+            std::vector<Ray> photonRays;
+            for (size_t e = 0; e < MPI_PHOTON_ROUND_SIZE * numLights; e++)
+            {
+                real_t fluxScale;
+                Light *aLight = scene->get_lights()[pickEmissionLight(e, numLights, &fluxScale)];
+                Ray photonRay = aLight->getRandomRayFromLight();
+                photonRay.photon.mask = 0;
+                photonRay.photon.setColor(aLight->color * fluxScale);
+                photonRay.depth = PHOTON_TRACE_DEPTH;
+                photonRays.push_back(photonRay);
+            }
+            emitted += MPI_PHOTON_ROUND_SIZE * numLights * procs;
+
+            while (!mpiShouldStop(procs, procId, photonRays.size(), 0)) {
+                mpiStagePhotonTrace(procs, procId, photonRays, &data);
+            }
+
+            // a node stores all it can this round, the maps may not be full on other nodes
+            photon_indirect_list.insert(photon_indirect_list.end(),
+                                        data.worker_photon_indirect.begin(), data.worker_photon_indirect.end());
+            photon_caustic_list.insert(photon_caustic_list.end(),
+                                       data.worker_photon_caustics.begin(), data.worker_photon_caustics.end());
+            data.worker_photon_indirect.clear();
+            data.worker_photon_caustics.clear();
+        }
+
+        double end = MPI_Wtime();
+        printf("[thread %d] Photon scatter took %f sec, indirect num = %ld, caustic num = %ld\n",
+               procId, end - start, photon_indirect_list.size(), photon_caustic_list.size());
+    }
+
+    /**
+     * One bounce of the distributed photon scatter. A photon ray goes to every node
+     * whose bounding box it crosses, each reports its closest local hit back to the
+     * sender, which hands the photon to the node of the closest hit of all. That
+     * node stores or bounces it; its bounces replace photonRays for the next call.
+     */
+    void Raytracer::mpiStagePhotonTrace(int procs, int procId, std::vector<Ray> &photonRays, PhotonScatterData *data)
+    {
+        // 1. send each photon ray to the nodes it may hit, x is its index on this node
+        RayBucket candidateBucket(procs);
+        for (size_t i = 0; i < photonRays.size(); i++)
+        {
+            Ray ray = photonRays[i];
+            ray.x = int(i);
+            ray.source = procId;
+            for (int bidx = 0; bidx < procs; bidx++) {
+                if (scene->nodeBndBox[bidx].intersect(ray, EPSILON, TMAX)) {
+                    candidateBucket.push_back(bidx, ray);
+                }
+            }
+        }
+        std::vector<Ray> candidates;
+        mpiAlltoallRayDistribution(procs, procId, candidateBucket, &candidates);
+
+        // 2. trace locally, hits go back to the sender with their distance in time,
+        //    this node in source and the index of the candidate in y
+        std::vector<HitRecord> records(candidates.size());
+        RayBucket hitBucket(procs);
+        for (size_t i = 0; i < candidates.size(); i++)
+        {
+            bool isHit = false;
+            records[i] = getClosestHit(candidates[i], EPSILON, TMAX, &isHit, Layer_All);
+            if (isHit)
+            {
+                Ray hit = candidates[i];
+                hit.time = records[i].t;
+                hit.y = int(i);
+                hit.source = procId;
+                hitBucket.push_back(candidates[i].source, hit);
+            }
+        }
+        std::vector<Ray> hits;
+        mpiAlltoallRayDistribution(procs, procId, hitBucket, &hits);
+
+        // 3. the closest hit of each photon ray wins, ties go to the lower node
+        std::vector<int> closest(photonRays.size(), -1);
+        for (size_t i = 0; i < hits.size(); i++)
+        {
+            int &c = closest[hits[i].x];
+            if (c < 0 || hits[i].time < hits[c].time ||
+                (hits[i].time == hits[c].time && hits[i].source < hits[c].source)) {
+                c = int(i);
+            }
+        }
+        RayBucket ownerBucket(procs);
+        for (size_t i = 0; i < closest.size(); i++) {
+            if (closest[i] >= 0) {
+                ownerBucket.push_back(hits[closest[i]].source, hits[closest[i]]);
+            }
+        }
+        std::vector<Ray> owned;
+        mpiAlltoallRayDistribution(procs, procId, ownerBucket, &owned);
+
+        // 4. store or bounce the photons of the hits this node owns
+        photonRays.clear();
+        for (size_t i = 0; i < owned.size(); i++)
+        {
+            Ray &ray = candidates[owned[i].y];
+            photonScatterHit(ray, records[owned[i].y], EPSILON, TMAX, ray.depth, data, &photonRays);
+        }
+    }
+
+    // p is within radius of the box
+    static inline bool nearBndBox(const BndBox &box, const Vector3 &p, real_t radius)
+    {
+        for (int axis = 0; axis < 3; axis++) {
+            if (p[axis] < box.pMin[axis] - radius || p[axis] > box.pMax[axis] + radius) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Photon light of the eye hits the local trace kept on this node, no eye ray
+     * is traced again. A diffuse hit becomes a gather query, e the hit position,
+     * d its normal and color its diffuse color, sent to every node whose
+     * bounding box is within the query radius. Each node
+     * estimates the light of its own photons as shade_cphotons does; the photons
+     * of different nodes are different maps, so their estimates add up like the
+     * indirect and caustics maps do. The sum goes into buffer at the depth of the
+     * hit, every other hit of the node leaves black there so the merge keeps the
+     * nearest surface of all nodes.
+     */
+    void Raytracer::mpiStagePhotonGather(int procs, int procId, FrameBuffer &buffer)
+    {
+        real_t radius = sqrt(real_t(PHOTON_QUERY_RADIUS));
+
+        // 1. queries of the diffuse hits the local trace kept, lightIndex is the query index on this node
+        std::vector<Ray> queries;
+        std::vector<Color3> textures;
+        RayBucket queryBucket(procs);
+        for (size_t i = 0; i < eyeHits.size(); i++)
+        {
+            const EyeHit &hit = eyeHits[i];
+            int bufferIndex = hit.y * width + hit.x;
+            if (hit.t < buffer.zbuffer[bufferIndex]) {
+                buffer.zbuffer[bufferIndex] = hit.t;
+                buffer.shadowMap[bufferIndex] = 0;
+                Color3::Black().to_array(&buffer.cbuffer[4 * bufferIndex]);
+            }
+
+            if (!hit.isShaded) {
+                continue;
+            }
+
+            Ray query = Ray(hit.position, hit.normal);
+            query.color = hit.diffuse;
+            query.time = hit.t;
+            query.x = hit.x;
+            query.y = hit.y;
+            query.source = procId;
+            query.lightIndex = int(queries.size());
+            queries.push_back(query);
+            textures.push_back(hit.texture);
+
+            for (int bidx = 0; bidx < procs; bidx++) {
+                if (nearBndBox(scene->nodeBndBox[bidx], hit.position, radius)) {
+                    queryBucket.push_back(bidx, query);
+                }
+            }
+        }
+        std::vector<Ray> received;
+        mpiAlltoallRayDistribution(procs, procId, queryBucket, &received);
+
+        // 2. estimate with the photons of this node in one Morton ordered batch,
+        //    answers carry it in color
+        std::vector<HitRecord> records(received.size());
+        for (size_t i = 0; i < received.size(); i++)
+        {
+            records[i].position = received[i].e;
+            records[i].normal = received[i].d;
+            records[i].diffuse = received[i].color;
+            records[i].refractive_index = 0;
+            records[i].isHit = true;
+        }
+        std::vector<Color3> estimates(received.size());
+        if (!received.empty()) {
+            shade_cphotons_batch(&records[0], records.size(), PHOTON_QUERY_RADIUS, PHOTON_GATHER_NUM, &estimates[0]);
+        }
+
+        RayBucket answerBucket(procs);
+        for (size_t i = 0; i < received.size(); i++)
+        {
+            Ray answer = received[i];
+            answer.color = estimates[i];
+            answerBucket.push_back(received[i].source, answer);
+        }
+        std::vector<Ray> answers;
+        mpiAlltoallRayDistribution(procs, procId, answerBucket, &answers);
+
+        // 3. sum the answers of each query and scale them as shade does
+        std::vector<Color3> photonColor(queries.size(), Color3::Black());
+        for (size_t i = 0; i < answers.size(); i++) {
+            photonColor[answers[i].lightIndex] += answers[i].color;
+        }
+        for (size_t i = 0; i < queries.size(); i++)
+        {
+            int bufferIndex = queries[i].y * width + queries[i].x;
+            if (queries[i].time > buffer.zbuffer[bufferIndex]) {
+                continue;
+            }
+            Color3 photonRadiance = photonColor[i] * (2.0/(CAUSTICS_PHOTON_NEEDED + INDIRECT_PHOTON_NEEDED)) * 25;
+            photonRadiance = clamp(photonRadiance, 0, 1.0);
+            (textures[i] * photonRadiance).to_array(&buffer.cbuffer[4 * bufferIndex]);
+        }
+    }
+
     void Raytracer::mpiMergeFrameBufferToBuffer(int procs, int procId, FrameBuffer &buffer, unsigned char *rootbuffer)
     {
         assert(rootbuffer);
@@ -2467,59 +4176,49 @@ namespace _462 {
     
     void Raytracer::mpiAlltoallRayDistribution(int procs, int /* procId */, RayBucket &inputRayBucket, std::vector<Ray> *outputRayList)
     {
-        Ray *sendbuf;
-        int *sendcounts;
-        int *sendoffsets;
-        // generate data to send
-        inputRayBucket.mpi_datagen(&sendbuf, &sendoffsets, &sendcounts);
+        // the bucket arena is the send buffer, counts and offsets are in bytes
+        RayWireFormat format = inputRayBucket.format();
         
         // but first we need to send how many data each node are going to receive
         int status = -1;
-        int *recvcounts = new int[procs];
-        status = MPI_Alltoall(sendcounts, 1, MPI_INT, recvcounts, 1, MPI_INT, MPI_COMM_WORLD);
+        std::vector<int> recvcounts(procs);
+        status = MPI_Alltoall(inputRayBucket.counts(), 1, MPI_INT, recvcounts.data(), 1, MPI_INT, MPI_COMM_WORLD);
         if (status != 0) {
             printf("Fail to send and receive ray count info!\n");
             throw exception();
         }
         
         // Received ray buffer
-        int *recvoffsets = new int[procs];
+        std::vector<int> recvoffsets(procs);
         int total = 0;
         for (int i = 0; i < procs; i++) {
             recvoffsets[i] = total;
             total += recvcounts[i];
         }
-        Ray *recvbuf = new Ray[total];
-        
         
-        // reset counts, offsets for byte sized send/recv
-        size_t raysize = sizeof(Ray);
-        for (int i = 0; i < procs; i++) {
-            sendcounts[i] *= raysize;
-            sendoffsets[i] *= raysize;
-            
-            recvcounts[i] *= raysize;
-            recvoffsets[i] *= raysize;
+        // full rays land in the output list itself, packed ones in a buffer kept across stages
+        unsigned char *recvbuf;
+        outputRayList->clear();
+        if (format == RayWire_Full) {
+            outputRayList->resize(total / sizeof(Ray));
+            recvbuf = reinterpret_cast<unsigned char *>(outputRayList->data());
+        }
+        else {
+            mpi_recv_buffer.resize(total);
+            recvbuf = mpi_recv_buffer.data();
         }
         
         // send all rays by MPI alltoallv
-        status = MPI_Alltoallv(sendbuf, sendcounts, sendoffsets, MPI_BYTE, recvbuf, recvcounts, recvoffsets, MPI_BYTE, MPI_COMM_WORLD);
+        status = MPI_Alltoallv(inputRayBucket.data(), inputRayBucket.counts(), inputRayBucket.offsets(), MPI_BYTE,
+                               recvbuf, recvcounts.data(), recvoffsets.data(), MPI_BYTE, MPI_COMM_WORLD);
         if (status != 0) {
             printf("Fail to send and receive rays!\n");
             throw exception();
         }
         
-        std::vector<Ray> recvRayList(total);
-        std::copy(recvbuf, recvbuf+total, recvRayList.begin());
-        *outputRayList = recvRayList;
-        
-        delete sendbuf;
-        delete sendcounts;
-        delete sendoffsets;
-        
-        delete recvbuf;
-        delete recvcounts;
-        delete recvoffsets;
+        if (format != RayWire_Full) {
+            azUnpackRays(format, recvbuf, total, outputRayList);
+        }
     }
     
     
@@ -2542,6 +4241,26 @@ namespace _462 {
         }
     }
     
+    void Raytracer::mpiMergeDenoiseGuide(int procs, int procId)
+    {
+        size_t guidesize = denoiser.guideSize();
+        float *gbuf = NULL;
+        if (procId == 0) {
+            gbuf = (float *)malloc(guidesize * procs * sizeof(float));
+        }
+
+        MPI_Gather(denoiser.guideData(), guidesize, MPI_FLOAT, gbuf, guidesize, MPI_FLOAT, 0, MPI_COMM_WORLD);
+
+        if (procId == 0)
+        {
+            // root's own guide is already in place
+            for (int j = 1; j < procs; j++) {
+                denoiser.mergeGuide(gbuf + j * guidesize);
+            }
+            free(gbuf);
+        }
+    }
+
     bool Raytracer::mpiShouldStop(int procs, int procId, int shadowRaySize, int giRaySize)
     {
         int size = shadowRaySize + giRaySize;
@@ -12,30 +12,116 @@
 #define MAX_THREADS_SCATTER             (4)
 #define MAX_THREADS_TRACE               (4)
 
+#define GBUFFER_JITTER_PATTERNS         (4)
+
+// frames of the interactive preview: one traced into, one published, one displayed
+#define PREVIEW_SLOTS                   (3)
+#define PREVIEW_DIRTY                   (4)     // set on the published slot until the ui takes it
+
 #include "math/color.hpp"
 #include "math/random462.hpp"
 #include "math/vector.hpp"
 #include "scene/scene.hpp"
 #include "raytracer/Photon.hpp"
+#include "raytracer/azDenoiser.hpp"
+#include "raytracer/azDistribution.hpp"
+#include "raytracer/azIrradianceCache.hpp"
+#include "raytracer/azNearestPhotons.hpp"
+#include "raytracer/azPhotonGrid.hpp"
+#include "raytracer/azPool.hpp"
+#include "raytracer/azProgressivePhotonMap.hpp"
+#include "raytracer/azProjectionMap.hpp"
+#include "raytracer/azRayExchange.hpp"
 #include "raytracer/Utils.h"
 #include "scene/ray.hpp"
 #include <stack>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 #include "ray_list.hpp"
 
 namespace _462 {
 
+    /*!
+     @brief emission batch traced by one scatter worker, its photons end at
+            indirect_end / caustics_end in the worker lists
+     */
+    struct PhotonBatch
+    {
+        unsigned int index;
+        size_t indirect_end;
+        size_t caustics_end;
+    };
+
+    /*!
+     @brief state shared by the scatter workers. Batches are merged in index
+            order, so the maps only depend on the seed, not on the scheduling.
+     */
+    struct PhotonScatterQuota
+    {
+        std::atomic<unsigned int> next_batch;
+        std::atomic<bool> done;
+        unsigned int batch_limit;           // emission cap, both maps may not fill up
+        unsigned int seed;
+
+        // guards the members below
+        std::mutex lock;
+        std::vector<unsigned int> batch_indirect;   // photons stored per finished batch
+        std::vector<unsigned int> batch_caustics;
+        std::vector<bool> batch_finished;
+        // leading batches that are all finished, and the photons they stored
+        unsigned int prefix_batches;
+        size_t prefix_indirect;
+        size_t prefix_caustics;
+    };
+
     struct PhotonScatterData
     {
         std::vector<Photon> worker_photon_indirect;
         std::vector<Photon> worker_photon_caustics;
         std::vector<Light*> worker_lights_copy;
 //        PointLight worker_lights_copy;
+        std::vector<PhotonBatch> worker_batches;
+        PhotonScatterQuota *quota;
+        // photons the current batch may still store
         unsigned int indirect_needed;
         unsigned int caustics_needed;
     };
 
+    /*!
+     @brief cached primary hit of one pixel for one jitter pattern. Triangles blend
+            materials per hit, so the interpolated surface attributes are kept
+            instead of a material id.
+     */
+    struct GBufferSample
+    {
+        Vector3 position;
+        Vector3 normal;
+        Color3 diffuse;
+        Color3 texture;
+        real_t refractive_index;
+        real_t t;
+        bool isHit;
+        bool isValid;       // false until the primary ray of this slot is traced
+    };
+
+    /*!
+     @brief surface an eye ray hit in the MPI local trace, kept for the photon
+            gather so it does not trace the eye rays again
+     */
+    struct EyeHit
+    {
+        Vector3 position;
+        Vector3 normal;
+        Color3 diffuse;
+        Color3 texture;
+        real_t t;
+        int x, y;
+        bool isShaded;      // diffuse and not glass, the local trace shaded it
+    };
+
     struct ispcCPhotonData
     {
         int size;
@@ -46,6 +132,34 @@ namespace _462 {
         int8_t *bitmap;
     };
 
+    /*!
+     @brief arrays behind an ispcCPhotonData. They are kept across passes and
+            only grow, so a rebuild with no more photons than before allocates nothing.
+     */
+    struct ispcCPhotonStorage
+    {
+        std::vector<float> posx;
+        std::vector<float> posy;
+        std::vector<float> posz;
+        std::vector<int8_t> bitmap;
+
+        // room for size photons, data points at it
+        void bind(ispcCPhotonData &data, size_t size)
+        {
+            // one spare slot, so data never points at an empty vector
+            posx.resize(size + 1);
+            posy.resize(size + 1);
+            posz.resize(size + 1);
+            bitmap.resize(size + 1);
+
+            data.size = size;
+            data.posx = &posx[0];
+            data.posy = &posy[0];
+            data.posz = &posz[0];
+            data.bitmap = &bitmap[0];
+        }
+    };
+
 
     class Scene;
     struct Ray;
@@ -81,7 +195,8 @@ namespace _462 {
                 test, distribute shadow rays, maintain local lookup table, send shadow rays to other nodes,
                 generate second rays caused by eye ray, pass out as giRays
          @param procs, procId       total ranks of nodes, rank of node
-         @param in  eyerays         input of eye rays from camera
+         @param in  eyerays         input of eye rays from camera, the ones forwarded to this
+                                    node are appended
          @param out shadowRays      shadow rays used to track light sources
          @param out giRays          global illumination rays used for path tracing
          */
@@ -104,16 +219,77 @@ namespace _462 {
         void mpiStageShadowRayTracing(int procs, int procId, FrameBuffer &buffer, std::vector<Ray> &shadowrays);
         
         
-        // Helper functions for MPI_Alltoall sending and gathering rays
+        /*!
+         @brief the three stages above with non-blocking exchanges of ray batches, every
+                node traces the batches that arrive while its own are in flight
+         @param in/out rays         gi rays to trace, or nothing when iseyeray; the eye
+                                    or gi rays this node traced on return
+         @param out giRays          global illumination rays of the next bounce
+         */
+        void mpiStageOverlappedTrace(int procs, int procId, std::vector<Ray> *rays, bool iseyeray,
+                                     FrameBuffer &buffer, std::vector<Ray> *giRays);
+        
+        // eye rays of row y in the screen region of node procId, to the nodes they may hit
+        template <typename RaySink>
+        void mpiGenerateEyeRays(int procs, int procId, int y, RaySink &sink);
+        
+        // local trace of one eye or gi ray, its shadow and gi rays go to the sinks, and
+        // the ray itself to forwardSink when a node it enters before its hit is left
+        template <typename RaySink>
+        void mpiLocalTraceRay(int procs, int procId, Ray ray, bool iseyeray,
+                              RaySink &shadowSink, RaySink &giSink, RaySink &forwardSink);
+        
+        // the node not visited by ray whose box it enters first before tmax, -1 for none
+        int mpiNextNode(int procs, const Ray &ray, real_t tmax);
+        
+        // shade a shadow ray into buffer
+        void mpiShadowTraceRay(FrameBuffer &buffer, Ray ray);
+        
+        // scatter photons over the geometry of all nodes, each keeps the photons landing on its own
+        void mpiStagePhotonScatter(int procs, int procId);
+
+        // trace photon rays one bounce, photonRays is replaced by the bounces this node owns
+        void mpiStagePhotonTrace(int procs, int procId, std::vector<Ray> &photonRays, PhotonScatterData *data);
+
+        // photon light at the eye hits of this node, gathered from the nodes near each hit
+        void mpiStagePhotonGather(int procs, int procId, FrameBuffer &buffer);
+
+        // Helper functions for MPI_Alltoall sending and gathering rays, in the wire format of the bucket
         void mpiAlltoallRayDistribution(int procs, int procId, RayBucket &inputRayBucket, std::vector<Ray> *outputRayList);
 
         // merge buffer to designated buffer
         void mpiMergeFrameBufferToBuffer(int procs, int procId, FrameBuffer &buffer, unsigned char *rootbuffer);
         
         void mergebuffers(unsigned char *dibuffer, unsigned char *gibuffer, int width, int height);
+
+        // gather denoiser guides of all nodes to root, nearest primary hit wins
+        void mpiMergeDenoiseGuide(int procs, int procId);
         
         bool mpiShouldStop(int procs, int procId, int shadowRaySize, int giRaySize);
 
+        // drop all cached primary hits, call this whenever the camera moves
+        void invalidateGBuffer();
+
+        // Asynchronous progressive preview for the interactive viewer. Passes are
+        // traced by a pool of MAX_THREADS_TRACE workers off the ui thread, started
+        // with the preview and woken for every chunk of tiles, tiles from the
+        // screen centre outwards. The first pass refines from 1/16 over 1/4 to
+        // full resolution. Frames are published lock-free several times per pass
+        // and picked up with acquirePreview.
+
+        // start rendering passes in the background, returns immediately
+        void startPreview();
+
+        // cancel the running preview and wait for its workers to leave
+        void stopPreview();
+
+        // camera moved: hand camera to the running preview, which drops its samples
+        // and starts over at its next check. Returns immediately
+        void restartPreview(const Camera &camera);
+
+        // copy the newest published frame to buffer, false if none since last call
+        bool acquirePreview(unsigned char *buffer);
+
         // indirect and caustics list for photons to trace
         std::vector<Photon> photon_indirect_list;
         std::vector<Photon> photon_caustic_list;
@@ -122,40 +298,66 @@ namespace _462 {
         std::vector<Photon> kdtree_photon_indirect_list;
         std::vector<Photon> kdtree_photon_caustic_list;
 
-        // cPhoton source data
-        std::vector<cPhoton> cphoton_indirect_data;
-        std::vector<cPhoton> cphoton_caustics_data;
-
-        // ispc friendly cPhoton data, for parallel computation
+        // ispc friendly photon positions, for parallel computation
         ispcCPhotonData ispc_cphoton_indirect_data;
         ispcCPhotonData ispc_cphoton_caustics_data;
 
-        // balanced c style photon kdtree
-        std::vector<cPhoton> kdtree_cphoton_indirect;
-        std::vector<cPhoton> kdtree_cphoton_caustics;
-
         KDNode *vvh_indirect_root;
         KDNode *vvh_caustics_root;
 
+        // vvh nodes and ispc arrays live here, reused by every rebuild
+        azPool<KDNode> vvh_indirect_nodes;
+        azPool<KDNode> vvh_caustics_nodes;
+        ispcCPhotonStorage ispc_cphoton_indirect_storage;
+        ispcCPhotonStorage ispc_cphoton_caustics_storage;
+
+        // photon estimates of both maps at a subset of the photons, with ENABLE_PRECOMPUTED_IRRADIANCE
+        std::vector<Photon> irradiance_photon_list;
+        KDNode *vvh_irradiance_root;
+        azPool<KDNode> vvh_irradiance_nodes;
+        ispcCPhotonData ispc_irradiance_data;
+        ispcCPhotonStorage ispc_irradiance_storage;
+
+        // hashed grids over the same photons, used instead of the VVH trees with ENABLE_PHOTON_GRID
+        azPhotonGrid photon_indirect_grid;
+        azPhotonGrid photon_caustics_grid;
+
+        // the photon list of the last reorder, swapped back in by the next one
+        std::vector<Photon> photon_reorder_scratch;
+
+        // packed rays received by mpiAlltoallRayDistribution, kept across stages
+        std::vector<unsigned char> mpi_recv_buffer;
+
+        // visible points and per pixel statistics of ENABLE_SPPM
+        azProgressivePhotonMap sppm;
+        std::vector<SPPMPhoton> sppm_photons;
+
         unsigned int num_iteration;
+
+        // photon scatters so far, seeds the emission batches of the next one
+        unsigned int num_scatter;
+
+        // the photon lists were replaced or partly rebuilt since the trees over them were finished
+        bool photon_trees_stale;
+
+        // one per scene light, empty for lights caustic photons are not aimed for
+        std::vector<azProjectionMap> projection_maps;
+
+        // light of every emission by its photon flux, and of every targeted caustic emission
+        azDistribution1D emission_lights;
+        azDistribution1D caustic_lights;
         
 
 
     private:
 
-        // data used for photon direction encoding
-        float costheta[256];
-        float sintheta[256];
-        float cosphi[256];
-        float sinphi[256];
-
         // data used for measuring final gathering performance
         unsigned int master_start;  // Overall start time for raytracing
         unsigned int pass_start;    // Start time for each pass of raytracing & photon mapping
         unsigned int pass_end;      // End time for each pass
         unsigned int master_end;    // Overall end time for raytracing & photon mapping
-        unsigned int acc_cphoton_search_time;
-        unsigned int acc_iphoton_search_time;
+        std::atomic<unsigned int> acc_cphoton_search_time;
+        std::atomic<unsigned int> acc_iphoton_search_time;
 
         // data used for measuring the final gathering radius
         float radius_clear;
@@ -169,6 +371,95 @@ namespace _462 {
 
         Color3 *raytraceColorBuffer;
 
+        // primary hit cache, GBUFFER_JITTER_PATTERNS slots per pixel
+        std::vector<GBufferSample> gbuffer;
+        // sub-pixel offsets in [0, 1) of each jitter pattern, stored as (x, y) pairs
+        std::vector<float> gbufferJitter;
+
+        // post process filter, guided by normal, depth and albedo of primary hits
+        azDenoiser denoiser;
+
+        // eye ray hits of the current MPI frame on this node, for the photon gather
+        std::vector<EyeHit> eyeHits;
+
+        // sparse diffuse irradiance records, kept across progressive passes
+        azIrradianceCache irradianceCache;
+
+        // controller thread of the preview, runs previewLoop
+        std::thread previewThread;
+        std::atomic<bool> previewCancel;
+        // a new camera waits in previewCamera, the controller picks it up at its next check
+        std::atomic<bool> previewRestart;
+        // guards previewCamera and previewRunning
+        std::mutex previewLock;
+        Camera previewCamera;
+        // previewLoop has not returned yet, a restart can be handed to it
+        bool previewRunning;
+        // tile indices sorted by distance of the tile to the screen centre
+        std::vector<int> previewTileOrder;
+        // next entry of previewTileOrder handed out to a worker, and the end of the current chunk
+        std::atomic<size_t> previewNextTile;
+        size_t previewChunkEnd;
+        // worker pool of the preview, previewLoop bumps previewChunk to hand the
+        // workers a chunk and waits until previewBusy of them are back
+        std::vector<std::thread> previewWorkers;
+        std::mutex previewPoolLock;
+        std::condition_variable previewChunkReady;
+        std::condition_variable previewChunkDone;
+        unsigned int previewChunk;
+        int previewBusy;
+        bool previewPoolStop;
+        unsigned char *previewFrame;
+        // pixel step of the current stage, and whether pixels of coarser stages are skipped
+        int previewStep;
+        bool previewRefine;
+        // rgba frames, previewBack is owned by the render side, previewFront by
+        // the ui side, previewMiddle is the last published one
+        std::vector<unsigned char> previewSlots[PREVIEW_SLOTS];
+        int previewBack;
+        int previewFront;
+        std::atomic<int> previewMiddle;
+
+        // run passes until done or cancelled, publishing after every chunk of tiles
+        void previewLoop();
+
+        // the preview was cancelled or its camera moved, long loops check this to leave early
+        bool previewInterrupted() const;
+
+        // set camera and drop all samples accumulated for the previous view
+        void resetPreviewView(const Camera &camera);
+
+        // trace every chunk previewLoop hands out, until stopPreview ends the pool
+        void previewWorker();
+
+        // trace tiles [begin, end) of previewTileOrder into frame with the worker pool
+        void tracePreviewChunk(size_t begin, size_t end, unsigned char *frame);
+
+        // trace the pixels of one tile that belong to the current stage
+        void tracePreviewTile(int tile, unsigned char *frame);
+
+        // hand the back frame to the ui, the next back frame starts as a copy of it
+        void publishPreview();
+
+        // trace one pixel, add it to the accumulation buffer and write its average to buffer
+        void accumulatePixel(size_t x, size_t y, unsigned char *buffer);
+
+        // accumulatePixel for the pixels y * width + x of a row or tile, photons of their
+        // primary hits are gathered together with BATCH_PRIMARY_GATHER
+        void accumulatePixels(const std::vector<size_t> &pixels, unsigned char *buffer);
+
+        // add the color a pass traced for a pixel to the accumulation buffer and write its average to buffer
+        void accumulateColor(size_t x, size_t y, const Color3 &color, unsigned char *buffer);
+
+        // SPPM camera pass of a pixel, stores its visible point and returns the direct light
+        Color3 sppmTracePixel(size_t x, size_t y);
+
+        // SPPM photon pass, scatters photons and adds them to the visible points
+        void sppmPhotonPass();
+
+        // end of a progressive pass, prepares the next one. true if all passes are done
+        bool finishPass(unsigned char *buffer);
+
         Ray generateEyeRay(const Vector3 cameraPosition, size_t x, size_t y, float dx, float dy);
 
         Color3 trace_pixel(const Scene* scene,
@@ -177,66 +468,120 @@ namespace _462 {
                            size_t width,
                            size_t height);
 
+        // shade one sample of a pixel from the primary hit cache, tracing the eye ray
+        // only the first time its jitter pattern is used
+        Color3 shadeCachedPrimary(size_t x, size_t y, unsigned int sample);
+
+        // primary hit of one sample of a pixel from the cache, ray is set to its eye ray
+        HitRecord cachedPrimaryHit(size_t x, size_t y, unsigned int sample, Ray *ray);
+
         // Photon Scatter
         void photonScatter(const Scene* scene);
 
-        // Parallel Photon Scatter
-        void parallelPhotonScatter(const Scene* scene);
+        // Parallel Photon Scatter, false if the preview interrupted it and the photon lists are unchanged
+        bool parallelPhotonScatter(const Scene* scene);
 
         // worker node for parallel photon scatter
         void photonScatterWorker(PhotonScatterData *data);
 
+        // scatter batches over num_workers, then merge them into the photon lists.
+        // false if the preview interrupted it, the photon lists are left as they were
+        bool scatterPhotonBatches(const Scene* scene, size_t num_workers);
+
+        // mark the directions of every point light that reach a specular surface
+        void buildProjectionMaps(const Scene* scene);
+
+        // light CDFs of the emissions and the targeted caustic emissions
+        void buildLightDistributions(const Scene* scene);
+
+        // light of emission e of a batch and the scale of its photon flux
+        size_t pickEmissionLight(size_t e, size_t numLights, real_t *fluxScale);
+
         // kdtree construction
         void kdtreeConstruction();
 
         // c style photon kdtree construction
         void cPhotonKDTreeConstruction();
 
+        // sort photons along a Morton curve over their bounds
+        void mortonSortPhotons(std::vector<Photon> &photons);
+
+        // store the photon estimate at every IRRADIANCE_PHOTON_STRIDE-th photon and build a tree over them
+        void precomputeIrradiance();
+
         /////////// vvh kdtree ///////////
         // vvh kdtree preprocessing for faster construction
-        void vvhKDTreePreprocess(std::vector<cPhoton>& source,
+        void vvhKDTreePreprocess(std::vector<Photon>& source,
                                  std::vector<metaCPhoton>& sortedSource);
 
 
         // vvh kdtree construction
-        void vvhKDTreeConstruction(std::vector<cPhoton> &list, KDNode *root);
+        void vvhKDTreeConstruction(std::vector<Photon> &list, KDNode *root, azPool<KDNode> &nodes);
 
         void vvhProcessLargeNode(std::vector<KDNode *> &activeList,
                                  std::vector<KDNode *> &smallList,
                                  std::vector<KDNode *> &nextList,
-                                 std::vector<cPhoton> &list);
+                                 std::vector<Photon> &list,
+                                 azPool<KDNode> &nodes);
 
         void vvhPreprocessSmallNodes(std::vector<KDNode *> &smallList,
                                      std::vector<KDNode *> &nodeList,
-                                     std::vector<cPhoton> &list);
+                                     std::vector<Photon> &list);
 
         void vvhProcessSmallNode(std::vector<KDNode *> &activelist,
                                  std::vector<KDNode *> &nextList,
-                                 std::vector<cPhoton> &list);
+                                 std::vector<Photon> &list,
+                                 azPool<KDNode> &nodes);
+
+        // split one node of a level, children come from nodes and go to the given lists
+        void vvhSplitLargeNode(KDNode *node,
+                               std::vector<KDNode *> &smallList,
+                               std::vector<KDNode *> &nextList,
+                               std::vector<Photon> &list,
+                               azPool<KDNode> &nodes);
+
+        void vvhSplitSmallNode(KDNode *node,
+                               std::vector<KDNode *> &nextList,
+                               std::vector<Photon> &list,
+                               azPool<KDNode> &nodes);
 
         void vvhPreorderTraversal(std::vector<KDNode *> &nodeList,
-                                  std::vector<cPhoton> &list);
+                                  std::vector<Photon> &list);
 
+        // k nearest photons in a vvh kdtree, nearest gets indices into the photon list
         void vvhcPhotonLocate(Vector3 position,
                               KDNode *node,
                               ispcCPhotonData &ispcCphotonData,
-                              std::vector<cPhoton> &cPhotonList,
-                              std::vector<int> &nearestPhotonsIndices,
-                              float &sqrDist,
-                              size_t maxNum);
+                              std::vector<Photon> &photonList,
+                              azNearestPhotons &nearest);
 
-        bool vvhComputeVVH(std::vector<cPhoton> &data, float &VVH0, char &axis);
+        bool vvhComputeVVH(std::vector<Photon> &list, int head, int tail,
+                           float &VVH0, char &axis, int &median);
 
         float vvhComputeVolume(Vector3 a, Vector3 b);
 
         // Photon Tracing for global illumination and caustics
-        void photonTrace(Ray ray, real_t t0, real_t t1, int depth);
+        void photonTrace(Ray ray, real_t t0, real_t t1, int depth, PhotonScatterData *data);
+
+        // store or bounce a photon at a hit, bounces are queued in bounces unless it is NULL
+        void photonScatterHit(Ray &ray, HitRecord &record, real_t t0, real_t t1, int depth,
+                              PhotonScatterData *data, std::vector<Ray> *bounces);
+
+        void photonBounce(Ray &ray, real_t t0, real_t t1, int depth,
+                          PhotonScatterData *data, std::vector<Ray> *bounces);
 
         // Raytracing helper function, to decide if there is a hit on a surface to shade
         Color3 trace(Ray ray, real_t t0, real_t t1, int depth);
 
         // Shading function, shades the hit record from a surface
-        Color3 shade(Ray ray, HitRecord record, real_t t0, real_t t1, int depth);
+        // gathered, if given, is the shade_cphotons color of the record, already looked up in a batch
+        Color3 shade(Ray ray, HitRecord record, real_t t0, real_t t1, int depth, const Color3 *gathered = NULL);
+
+        // Irradiance at a diffuse hit, interpolated from the cache or sampled into a new record
+        Color3 irradianceCacheLookup(HitRecord &record, real_t t0, real_t t1, int depth);
+
+        // Stratified hemisphere sampling of irradiance and its gradients at a hit
+        IrradianceRecord sampleIrradianceRecord(HitRecord &record, real_t t0, real_t t1, int depth);
 
         // Shading of direct illumination
         Color3 shade_direct_illumination(HitRecord &record, real_t t0, real_t t1);
@@ -247,6 +592,18 @@ namespace _462 {
         // Test: Shade c photons
         Color3 shade_cphotons(HitRecord &record, real_t radius, size_t num_samples);
 
+        // shade_cphotons of count hit records at once, in Morton order, results in colors
+        void shade_cphotons_batch(HitRecord *records, size_t count, real_t radius, size_t num_samples, Color3 *colors);
+
+        // nearest photons of the indirect or caustics map, through the grid or the vvh kdtree
+        void cPhotonGather(const Vector3 &position, bool caustics, azNearestPhotons &nearest);
+
+        // shade_cphotons from the nearest precomputed irradiance photon
+        Color3 shadePrecomputedIrradiance(HitRecord &record);
+
+        // density estimate of the photons gathered at record
+        Color3 shadeNearestCPhotons(HitRecord &record, bool caustics, const azNearestPhotons &nearest);
+
         void PacketizedRayIntersection(azPacket<Ray> &rayPacket, azPacket<HitRecord> &recordPacket, float t0, float t1);
 
         // retrieve the closest hit record
@@ -277,38 +634,21 @@ namespace _462 {
 //        // Current refraction index
 //        real_t current_refractive_index;
 
-        // blance kdtree, kdtree stored in compact complete binary tree format
-        void balance(size_t index, std::vector<Photon> &balancedKDTree, std::vector<Photon> &list);
+        // blance kdtree, kdtree stored in compact complete binary tree format.
+        // list[head, tail) becomes the subtree at index, reordered in place
+        void balance(size_t index, std::vector<Photon> &balancedKDTree, std::vector<Photon> &list,
+                     size_t head, size_t tail);
 
-        // cPhoton balanced kdtree
-        void cPhotonBalance(size_t index, std::vector<cPhoton> &balancedKDTree, std::vector<cPhoton> &list);
-
-        // find nearest photons
+        // find k nearest photons, nearest gets indices into balancedKDTree
         void locatePhotons(size_t p,
                            Vector3 position,
                            std::vector<Photon> &balancedKDTree,
-                           std::vector<Photon> &nearestPhotons,
-                           float &sqrDist,
-                           size_t maxNum);
-
-        // c style locate photons
-        void cPhotonLocate(size_t p,
-                           Vector3 position,
-                           std::vector<cPhoton> &balancedKDTree,
-                           std::vector<cPhoton> &nearestPhotons,
-                           float &sqrDist,
-                           size_t maxNum);
+                           azNearestPhotons &nearest);
 
         void applyGammaHDR(Color3 &color);
 
 //        static const unsigned char filter[];
 
-        // set encoded photon direction
-        void setPhotonDirection(Photon &photon, Vector3 dir);
-
-        // get decoded photon direction
-        Vector3 getPhotonDirection(Photon &photon);
-
     };
 
     inline real_t getGaussianFilterWeight(real_t dist_sqr, real_t radius_sqr);
@@ -322,37 +662,20 @@ namespace _462 {
 
     // Photon comparator for sort functions
     inline bool photonComparatorX(const Photon &a, const Photon &b)
-    {
-        return a.position.x < b.position.x;
-    }
-
-    inline bool photonComparatorY(const Photon &a, const Photon &b)
-    {
-        return a.position.y < b.position.y;
-    }
-
-    inline bool photonComparatorZ(const Photon &a, const Photon &b)
-    {
-        return a.position.z < b.position.z;
-    }
-
-    // comparator for c style photon sorting
-    inline bool cPhotonComparatorX(const cPhoton &a, const cPhoton &b)
     {
         return a.position[0] < b.position[0];
     }
 
-    inline bool cPhotonComparatorY(const cPhoton &a, const cPhoton &b)
+    inline bool photonComparatorY(const Photon &a, const Photon &b)
     {
         return a.position[1] < b.position[1];
     }
 
-    inline bool cPhotonComparatorZ(const cPhoton &a, const cPhoton &b)
+    inline bool photonComparatorZ(const Photon &a, const Photon &b)
     {
         return a.position[2] < b.position[2];
     }
 
-
     // sampling
     inline Vector3 uniformSampleSphere(float u1, float u2)
     {
@@ -65,6 +65,12 @@ namespace _462 {
     }
     
     bool BndBox::intersect(const Ray &r, real_t t0, real_t t1) const
+    {
+        real_t tEnter;
+        return intersect(r, t0, t1, &tEnter);
+    }
+    
+    bool BndBox::intersect(const Ray &r, real_t t0, real_t t1, real_t *tEnter) const
     {
         real_t mint = t0, maxt = t1;
         
@@ -80,6 +86,7 @@ namespace _462 {
             if (mint > maxt) return false;
         }
         
+        *tEnter = mint;
         return true;
     }
     
@@ -88,6 +88,9 @@ namespace _462 {
          */
         bool intersect(const Ray &r, real_t t0, real_t t1) const;
 
+        // as above, tEnter gets the t where the ray enters the box within [t0, t1]
+        bool intersect(const Ray &r, real_t t0, real_t t1, real_t *tEnter) const;
+
         Vector3 pMin, pMax;
     };
 
@@ -10,6 +10,7 @@
 #define __Azurender__azBVHTree__
 
 #include <iostream>
+#include <limits>
 
 #include "math/matrix.hpp"
 #include "math/quaternion.hpp"
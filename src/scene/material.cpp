@@ -7,6 +7,9 @@
 
 #include "scene/material.hpp"
 #include "application/imageio.hpp"
+#ifndef AZ_HEADLESS
+#include "application/opengl.hpp"
+#endif
 
 namespace _462 {
     
@@ -31,9 +34,11 @@ namespace _462 {
     {
         if ( tex_data ) {
             free( tex_data );
+#ifndef AZ_HEADLESS
             if ( tex_handle ) {
                 glDeleteTextures( 1, &tex_handle );
             }
+#endif
         }
     }
     
@@ -89,6 +94,7 @@ namespace _462 {
             return false;
         }
         
+#ifndef AZ_HEADLESS
         // clean up old texture
         if ( tex_handle ) {
             glDeleteTextures( 1, &tex_handle );
@@ -111,11 +117,13 @@ namespace _462 {
         
         glBindTexture( GL_TEXTURE_2D, 0 );
         std::cout << "Loaded GL texture" << texture_filename << '\n';
+#endif
         return true;
     }
     
     void Material::set_gl_state() const
     {
+#ifndef AZ_HEADLESS
         float arr[4];
         arr[3] = 1.0; // alpha always 1.0
         
@@ -130,11 +138,14 @@ namespace _462 {
         glMaterialfv( GL_FRONT_AND_BACK, GL_SPECULAR,  arr );
         // make up a shininess term
         glMaterialf( GL_FRONT_AND_BACK, GL_SHININESS, shininess );
+#endif
     }
     
     void Material::reset_gl_state() const
     {
+#ifndef AZ_HEADLESS
         glBindTexture( GL_TEXTURE_2D, 0 );
+#endif
     }
     
 }
@@ -10,7 +10,6 @@
 
 #include "math/color.hpp"
 #include "math/vector.hpp"
-#include "application/opengl.hpp"
 #include <string>
 
 namespace _462 {
@@ -94,8 +93,9 @@ namespace _462 {
         // raw texture data
         unsigned char* tex_data;
         
-        // opengl descriptor of the texture
-        GLuint tex_handle;
+        // opengl descriptor of the texture, a GLuint, kept plain so this
+        // header stays free of GL for the headless build
+        unsigned int tex_handle;
         
         // prevent copy/assignment
         Material( const Material& );
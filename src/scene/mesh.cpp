@@ -7,7 +7,9 @@
  */
 
 #include "scene/mesh.hpp"
+#ifndef AZ_HEADLESS
 #include "application/opengl.hpp"
+#endif
 #include <iostream>
 #include <cstring>
 #include <string>
@@ -345,8 +347,8 @@ namespace _462 {
             return false;
         }
         
-        // compute normals if needed
-        if ( !has_normals ) {
+#ifndef AZ_HEADLESS
+        // build vertex data
             // first zero out
             for ( size_t i = 0; i < vertices.size(); ++i ) {
                 vertices[i].normal = Vector3::Zero();
@@ -369,10 +371,6 @@ namespace _462 {
                 vertices[i].normal = normalize( vertices[i].normal );
             }
             
-            has_normals = true;
-        }
-        
-        // build vertex data
         vertex_data.resize( vertices.size() * VERTEX_SIZE );
         float* vertex = &vertex_data[0];
         for ( size_t i = 0; i < vertices.size(); ++i ) {
@@ -391,18 +389,47 @@ namespace _462 {
             index[2] = triangles[i].vertices[2];
             index += 3;
         }
+#endif
         return true;
     }
     
     void Mesh::render() const
     {
+#ifndef AZ_HEADLESS
         assert( index_data.size() > 0 );
         glInterleavedArrays( GL_T2F_N3F_V3F, VERTEX_SIZE * sizeof vertex_data[0], &vertex_data[0] );
         glDrawElements( GL_TRIANGLES, index_data.size(), GL_UNSIGNED_INT, &index_data[0] );
+#endif
     }
     
     bool Mesh::initialize()
     {
+        // compute normals if needed, the raytracer relies on them even without gl data
+        if ( !has_normals && !vertices.empty() ) {
+            // first zero out
+            for ( size_t i = 0; i < vertices.size(); ++i ) {
+                vertices[i].normal = Vector3::Zero();
+            }
+            
+            // then sum in all triangle normals
+            for ( size_t i = 0; i < triangles.size(); ++i ) {
+                Vector3 pos[3];
+                for ( size_t j = 0; j < 3; ++j ) {
+                    pos[j] = vertices[triangles[i].vertices[j]].position;
+                }
+                Vector3 normal = normalize( cross( pos[1] - pos[0], pos[2] - pos[0] ) );
+                for ( size_t j = 0; j < 3; ++j ) {
+                    vertices[triangles[i].vertices[j]].normal += normal;
+                }
+            }
+            
+            // then normalize
+            for ( size_t i = 0; i < vertices.size(); ++i ) {
+                vertices[i].normal = normalize( vertices[i].normal );
+            }
+            
+            has_normals = true;
+        }
         return true;
     }
     
@@ -62,7 +62,7 @@ public:
     // scene loader stores the filename of the mesh here
     std::string filename;
 
-    /// Creates opengl data for rendering and computes normals if needed
+    /// Creates opengl data for rendering, a no-op in the headless build
     bool create_gl_data();
     /// Renders the mesh using opengl.
     void render() const;
@@ -79,6 +79,7 @@ public:
     bool has_tcoords;
     bool has_normals;
 
+	/// Computes normals if the mesh file has none, called by load()
 	bool initialize();
 
 private:
@@ -8,7 +8,9 @@
 
 #include "scene/model.hpp"
 #include "scene/material.hpp"
+#ifndef AZ_HEADLESS
 #include "application/opengl.hpp"
+#endif
 #include "scene/triangle.hpp"
 #include <iostream>
 #include <cstring>
@@ -27,6 +29,7 @@ namespace _462 {
 
     void Model::render() const
     {
+#ifndef AZ_HEADLESS
         if ( !mesh )
             return;
         if ( material )
@@ -34,6 +37,7 @@ namespace _462 {
         mesh->render();
         if ( material )
             material->reset_gl_state();
+#endif
     }
 
     void Model::createBoundingBox() const
@@ -26,6 +26,7 @@ namespace _462 {
         this->maxt = INFINITY;
         this->time = std::numeric_limits<real_t>::max();
         this->color = Color3::Black();
+        this->visited = 0;
     }
     
     Ray::Ray(Vector3 e, Vector3 d, float start, float end, float time)
@@ -35,6 +36,7 @@ namespace _462 {
         this->mint = start;
         this->maxt = end;
         this->time = time;
+        this->visited = 0;
     }
     
     void Ray::init(const Camera& camera)
@@ -8,8 +8,13 @@
 #include "scene/material.hpp"
 #include "scene/mesh.hpp"
 #include "raytracer/Photon.hpp"
+#include "raytracer/azRayWire.hpp"
 #include <string>
 #include <vector>
+#include <limits>
+#include <climits>
+#include <cstdio>
+#include <exception>
 
 
 namespace _462 {
@@ -40,74 +45,108 @@ namespace _462 {
         int x, y;
         int depth;
         int source;
+        unsigned int visited;   // ranks that traced the ray, bit per rank, for closest first forwarding
     };
     
-    typedef std::vector<std::vector<Ray> > NodeRayVector;
+    /*!
+     @brief rays for every node, packed in a wire format as they are pushed.
+            All groups share one arena, group i owns a region at offsets()[i],
+            so the arena is the MPI_Alltoallv send buffer as it is; the gaps
+            between regions are skipped by the displacements. When a group
+            outgrows its region only that region doubles, the ones after it
+            move up. Arenas go back to a free list on destruction and the next
+            bucket starts with the largest one split evenly, so after the first
+            frame a stage packs its rays without touching the heap. Buckets are
+            used from the thread running the MPI stages only.
+     */
     class RayBucket {
     public:
-        RayBucket() {}
-        ~RayBucket() {
+        RayBucket(int node_size, RayWireFormat format = RayWire_Full)
+        : node_size_(node_size), format_(format), raysize_(azRayWireSize(format)),
+          sendcounts_(node_size, 0), sendoffsets_(node_size, 0), capacities_(node_size, 0)
+        {
+            assert(node_size > 0);
+            std::vector<std::vector<unsigned char> > &pool = arenaPool();
+            if (!pool.empty()) {
+                arena_.swap(pool.back());
+                pool.pop_back();
+            }
+            size_t regionsize = arena_.size() / node_size_ / raysize_ * raysize_;
+            if (regionsize == 0) {
+                regionsize = 64 * raysize_;
+                arena_.resize(regionsize * node_size_);
+            }
             for (int i = 0; i < node_size_; i++) {
-                nodeRayVector[i].clear();
+                sendoffsets_[i] = i * regionsize;
+                capacities_[i] = regionsize;
             }
-            nodeRayVector.clear();
-            node_size_ = 0;
         }
         
-        RayBucket(int node_size)
+        ~RayBucket()
         {
-            assert(node_size > 0);
-            node_size_ = node_size;
-            for (int i = 0; i < node_size; i++) {
-                std::vector<Ray> aList;
-                nodeRayVector.push_back(aList);
+            std::vector<std::vector<unsigned char> > &pool = arenaPool();
+            pool.push_back(std::vector<unsigned char>());
+            pool.back().swap(arena_);
+            
+            // largest arena last, handed out first
+            for (size_t i = pool.size() - 1; i > 0 && pool[i].size() < pool[i - 1].size(); i--) {
+                pool[i].swap(pool[i - 1]);
             }
         }
         
-        // push a ray to group numbered "rank"
+        // pack a ray into group numbered "rank"
         void push_back(int rank, const Ray &r)
         {
             assert(rank < node_size_);
-            nodeRayVector[rank].push_back(r);
+            if (size_t(sendcounts_[rank]) + raysize_ > capacities_[rank]) {
+                grow(rank);
+            }
+            azPackRay(format_, r, &arena_[sendoffsets_[rank] + sendcounts_[rank]]);
+            sendcounts_[rank] += raysize_;
         }
         
-        /*! 
-         @brief Call this only when you done of pushing all elements, it is used 
-                for generate basic data for open MPI_Alltoallv sending
-         @param out raybucket: c-style node ray array
-         @param out sendoffset: sender buffer displacements of j group from raybucket
-         @param out sendcounts: sender buffer element counts of j group
-         @note  Very important! Numbers used in the sendoffset and sendcounts are COUNTS
-                These two value array cannot by used directly for sending MPI information
-         */
-        void mpi_datagen(Ray **raybucket, int **sendoffset, int **sendcounts)
+        // MPI_Alltoallv send buffer, counts and displacements of each group in BYTES
+        const unsigned char *data() const { return arena_.data(); }
+        const int *counts() const { return sendcounts_.data(); }
+        const int *offsets() const { return sendoffsets_.data(); }
+        
+        RayWireFormat format() const { return format_; }
+        
+    private:
+        RayBucket(const RayBucket &);
+        RayBucket &operator=(const RayBucket &);
+        
+        // double the region of group rank, the groups after it move up
+        void grow(int rank)
         {
-            size_t size = nodeRayVector.size();
-            if (size == 0) {
-                printf("No rays for current node!\n");
-                return;
+            // counts and offsets go to MPI as ints
+            size_t extra = capacities_[rank];
+            if (arena_.size() + extra > size_t(INT_MAX)) {
+                printf("Ray bucket grows past %d bytes!\n", INT_MAX);
+                throw std::exception();
             }
-            *sendcounts = new int[size];
-            *sendoffset = new int[size];
-            size_t total = 0;
-            
-            for (size_t i = 0; i < size; i++) {
-                (*sendcounts)[i] = nodeRayVector[i].size();
-                (*sendoffset)[i] = total;
-                total += (*sendcounts)[i];
-            }
-            
-            *raybucket = new Ray[total];
-            
-            for (size_t i = 0; i < size; i++) {
-                std::copy(nodeRayVector[i].begin(), nodeRayVector[i].end(), *raybucket + (*sendoffset)[i]);
+            arena_.insert(arena_.begin() + sendoffsets_[rank] + capacities_[rank], extra, 0);
+            capacities_[rank] += extra;
+            for (int i = rank + 1; i < node_size_; i++) {
+                sendoffsets_[i] += int(extra);
             }
         }
         
-    private:
-        NodeRayVector nodeRayVector;
+        // arenas of destroyed buckets, ascending in size
+        static std::vector<std::vector<unsigned char> > &arenaPool()
+        {
+            static std::vector<std::vector<unsigned char> > pool;
+            return pool;
+        }
+        
         int node_size_;
+        RayWireFormat format_;
+        size_t raysize_;
         
+        std::vector<unsigned char> arena_;
+        std::vector<int> sendcounts_;
+        std::vector<int> sendoffsets_;
+        std::vector<size_t> capacities_;    // bytes of the region of each group
     };
     
     struct Intersection
@@ -7,7 +7,9 @@
  */
 
 #include "scene/sphere.hpp"
+#ifndef AZ_HEADLESS
 #include "application/opengl.hpp"
+#endif
 
 namespace _462 {
 
@@ -83,6 +85,7 @@ namespace _462 {
     
     void Sphere::render() const
     {
+#ifndef AZ_HEADLESS
         // create geometry if we haven't already
         init_sphere();
         
@@ -98,6 +101,7 @@ namespace _462 {
         
         if ( material )
             material->reset_gl_state();
+#endif
     }
     
     void Sphere::createBoundingBox() const
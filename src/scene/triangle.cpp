@@ -6,7 +6,9 @@
  */
 
 #include "scene/triangle.hpp"
+#ifndef AZ_HEADLESS
 #include "application/opengl.hpp"
+#endif
 
 namespace _462 {
 
@@ -23,6 +25,7 @@ namespace _462 {
     
     void Triangle::render() const
     {
+#ifndef AZ_HEADLESS
         bool materials_nonnull = true;
         for ( int i = 0; i < 3; ++i )
             materials_nonnull = materials_nonnull && vertices[i].material;
@@ -50,6 +53,7 @@ namespace _462 {
         
         if ( materials_nonnull )
             vertices[0].material->reset_gl_state();
+#endif
     }
     
     /**